@@ -0,0 +1,71 @@
+#include "batch.h"
+
+NAMESPACE_BEGIN
+
+WriteBatch::WriteBatch(): records_(NULL)
+{
+	records_ = new Buffer();
+}
+
+WriteBatch::~WriteBatch()
+{
+	deletePtr(records_);
+}
+
+void WriteBatch::put(const void* key, size_t ksize, const void* val, size_t vsize)
+{
+	add(OpType::Put, key, ksize, val, vsize);
+}
+
+void WriteBatch::del(const void* key, size_t ksize)
+{
+	add(OpType::Delete, key, ksize, NULL, 0);
+}
+
+void WriteBatch::clear()
+{
+	records_->clear();
+	offsets_.clear();
+}
+
+void WriteBatch::add(OpType type, const void* key, size_t ksize, const void* val, size_t vsize)
+{
+	RecordHeader h;
+	h.type_ = type;
+	h.ksize_ = ksize;
+	h.vsize_ = vsize;
+	offsets_.push_back(records_->getSize());
+	records_->append(&h, sizeof(h));
+	records_->append(key, ksize);
+	if (vsize > 0)
+	{
+		records_->append(val, vsize);
+	}
+}
+
+WriteBatch::RecordHeader WriteBatch::getHeader(size_t i) const
+{
+	RecordHeader h;
+	memcpy(&h, records_->getBuffer() + offsets_[i], sizeof(h));
+	return h;
+}
+
+WriteBatch::OpType WriteBatch::getType(size_t i) const
+{
+	return getHeader(i).type_;
+}
+
+const void* WriteBatch::getKey(size_t i, size_t* ksize) const
+{
+	*ksize = getHeader(i).ksize_;
+	return records_->getBuffer() + offsets_[i] + sizeof(RecordHeader);
+}
+
+const void* WriteBatch::getValue(size_t i, size_t* vsize) const
+{
+	RecordHeader h = getHeader(i);
+	*vsize = h.vsize_;
+	return records_->getBuffer() + offsets_[i] + sizeof(RecordHeader) + h.ksize_;
+}
+
+NAMESPACE_END
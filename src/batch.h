@@ -0,0 +1,55 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <vector>
+#include "common.h"
+#include "storage.h"
+
+NAMESPACE_BEGIN
+
+// Puts and deletes collected to be applied together by DB::write. The
+// batch is applied atomically: other threads see all of it or none, and
+// with a write-ahead log it goes out as one record, so a crash keeps all
+// of it or none. Operations on the same key take effect in the order
+// they were added.
+class WriteBatch {
+public:
+	enum OpType {
+		Put = 0,
+		Delete = 1
+	};
+
+private:
+	struct RecordHeader {
+		OpType type_;
+		size_t ksize_;
+		size_t vsize_;
+	};
+
+	// records as RecordHeader, key, value
+	Buffer* records_;
+	std::vector<size_t> offsets_;
+
+	void add(OpType type, const void* key, size_t ksize, const void* val, size_t vsize);
+	RecordHeader getHeader(size_t i) const;
+
+public:
+	WriteBatch();
+	~WriteBatch();
+
+	WriteBatch(const WriteBatch&) = delete;
+	WriteBatch& operator=(const WriteBatch&) = delete;
+
+	void put(const void* key, size_t ksize, const void* val, size_t vsize);
+	void del(const void* key, size_t ksize);
+	void clear();
+
+	inline size_t count() const { return offsets_.size(); }
+	OpType getType(size_t i) const;
+	const void* getKey(size_t i, size_t* ksize) const;
+	const void* getValue(size_t i, size_t* vsize) const;
+};
+
+NAMESPACE_END
+
+#endif
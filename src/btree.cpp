@@ -1,21 +1,45 @@
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include "batch.h"
 #include "btree.h"
+#include "comparator.h"
+#include "keyhead.h"
+#include "file.h"
 #include "storage.h"
 
 NAMESPACE_BEGIN
 
-BTree::BTree(Storage* store):
+BTree::BTree(Storage* store, KeyComparator comparator):
 	store_(store), page_size_(store_->getPageSize()),
-	data_buf_(NULL), cmp_buf_(NULL), split_buf_(NULL)
+	data_buf_(NULL), cmp_buf_(NULL), split_buf_(NULL), leaf_buf_(NULL), sep_buf_(NULL),
+	prefix_keys_(store_->getPrefixKeys()), key_order_(store_->getKeyOrder()),
+	comparator_(key_order_ == KeyOrder::Custom ? comparator : getComparator(key_order_)),
+	key_heads_(store_->getKeyHeads()), offset_mask_(key_heads_ ? 0xffff : ~(offset_t)0),
+	version_(0), concurrent_(false), root_(0), latches_(NULL), last_leaf_(0)
 {
+	latches_ = new std::atomic<uint32_t>[latch_count];
+	for (uint32_t i = 0; i < latch_count; ++i)
+	{
+		latches_[i].store(0);
+	}
+
 	if (store_->getRootId() == 0)
 	{
 		buildRootPage(BTreePageType::Leaf);
 		store_->storeOverflowData(NULL, 0);
 	}
+	root_.store(store_->getRootId());
 
 	data_buf_ = new Buffer();
 	cmp_buf_ = new Buffer();
 	split_buf_ = new Buffer();
+	leaf_buf_ = new Buffer();
+	sep_buf_ = new Buffer();
 }
 
 BTree::~BTree()
@@ -23,6 +47,125 @@ BTree::~BTree()
 	deletePtr(data_buf_);
 	deletePtr(cmp_buf_);
 	deletePtr(split_buf_);
+	deletePtr(leaf_buf_);
+	deletePtr(sep_buf_);
+	delete[] latches_;
+}
+
+void BTree::setConcurrentReads(bool on)
+{
+	store_->lock();
+	concurrent_ = on;
+	store_->unlock();
+}
+
+bool BTree::tryLatchShared(page_id_t page_id)
+{
+	std::atomic<uint32_t>& latch = getLatch(page_id);
+	uint32_t s = latch.load(std::memory_order_relaxed);
+	while ((s & (latch_exclusive | latch_pending)) == 0)
+	{
+		if (latch.compare_exchange_weak(s, s + 1, std::memory_order_acquire,
+										std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void BTree::unlatchShared(page_id_t page_id)
+{
+	getLatch(page_id).fetch_sub(1, std::memory_order_release);
+}
+
+// Writers go one at a time under the storage lock, so an exclusive latch
+// already set is this writer's own. The pending bit turns new readers
+// away while those inside drain; readers never wait holding a latch, so
+// they always do.
+void BTree::latchExclusive(page_id_t page_id)
+{
+	std::atomic<uint32_t>& latch = getLatch(page_id);
+	if (latch.load(std::memory_order_relaxed) & latch_exclusive)
+	{
+		return;
+	}
+	latch.fetch_or(latch_pending, std::memory_order_relaxed);
+	while (latch.load(std::memory_order_acquire) & ~latch_pending)
+	{
+		std::this_thread::yield();
+	}
+	latch.store(latch_exclusive, std::memory_order_relaxed);
+	held_.push_back(page_id & (latch_count - 1));
+}
+
+void BTree::unlatchAll()
+{
+	for (size_t i = 0; i < held_.size(); ++i)
+	{
+		latches_[held_[i]].store(0, std::memory_order_release);
+	}
+	held_.clear();
+}
+
+// Latches and pins a page for a lookup. Returns NULL, holding neither,
+// if a writer has the latch or the page is not cached; the latter is
+// recorded in state.
+void* BTree::latchPage(page_id_t page_id, SearchState* state)
+{
+	if (!tryLatchShared(page_id))
+	{
+		return NULL;
+	}
+	void* page = store_->pinCached(page_id);
+	if (page == NULL)
+	{
+		unlatchShared(page_id);
+		state->missed_ = true;
+		state->miss_ = page_id;
+	}
+	return page;
+}
+
+void BTree::unlatchPage(page_id_t page_id)
+{
+	store_->unpin(page_id);
+	unlatchShared(page_id);
+}
+
+// Every page a writer changes goes through here, so with concurrent
+// reads on it is latched before its first change.
+void* BTree::writePage(page_id_t page_id)
+{
+	if (concurrent_)
+	{
+		latchExclusive(page_id);
+	}
+	return store_->getPageForWrite(page_id);
+}
+
+void BTree::freePage(page_id_t page_id)
+{
+	if (concurrent_)
+	{
+		latchExclusive(page_id);
+	}
+	if (page_id == last_leaf_)
+	{
+		last_leaf_ = 0;
+	}
+	store_->freePage(page_id);
+}
+
+// A new root is latched before lookups can find it.
+void BTree::setRootId(page_id_t page_id)
+{
+	if (concurrent_)
+	{
+		latchExclusive(page_id);
+	}
+	store_->setRootId(page_id);
+	root_.store(page_id, std::memory_order_release);
 }
 
 static inline void setPageType(void* page, BTreePageType type);
@@ -31,31 +174,25 @@ static inline size_t getPageSpace(void* page);
 
 static inline void setLeafPageId(void* page, page_id_t page_id);
 static inline page_id_t getLeafPageId(void* page);
-static inline void setLeafParent(void* page, page_id_t page_id);
-static inline page_id_t getLeafParent(void* page);
 static inline void setLeafPrev(void* page, page_id_t page_id);
 static inline page_id_t getLeafPrev(void* page);
 static inline void setLeafNext(void* page, page_id_t page_id);
 static inline page_id_t getLeafNext(void* page);
 static inline void setLeafOffset(void* page, offset_t off);
 static inline offset_t getLeafOffset(void* page);
-static inline void setLeafItemOffset(void* page, uint32_t index, offset_t off);
-static inline offset_t getLeafItemOffset(void* page, uint32_t index);
 
+static inline offset_t* getLeafSlots(void* page);
 static inline void setLeafItemCount(void* page, size_t count);
 static inline size_t getLeafItemCount(void* page);
 static inline void setInternalPageId(void* page, page_id_t page_id);
 static inline page_id_t getInternalPageId(void* page);
-static inline void setInternalParent(void* page, page_id_t page_id);
-static inline page_id_t getInternalParent(void* page);
 static inline void setInternalOffset(void* page, offset_t off);
 static inline offset_t getInternalOffset(void* page);
 static inline void setInternalItemCount(void* page, size_t count);
 static inline size_t getInternalItemCount(void* page);
-static inline void setInternalItemOffset(void* page, uint32_t index, offset_t off);
-static inline offset_t getInternalItemOffset(void* page, uint32_t index);
+static inline offset_t* getInternalSlots(void* page);
 static inline page_id_t getLastChild(void* page);
-static inline page_id_t getChild(void* page, uint32_t i);
+static inline page_id_t getPageId(void* page);
 
 void setPageType(void* page, BTreePageType type)
 {
@@ -96,16 +233,6 @@ page_id_t getLeafPageId(void* page)
 	return ((LeafPageHeader*)page)->page_id_;
 }
 
-void setLeafParent(void* page, page_id_t page_id)
-{
-	((LeafPageHeader*)page)->parent_id_ = page_id;
-}
-
-page_id_t getLeafParent(void* page)
-{
-	return ((LeafPageHeader*)page)->parent_id_;
-}
-
 void setLeafPrev(void* page, page_id_t page_id)
 {
 	((LeafPageHeader*)page)->prev_ = page_id;
@@ -146,14 +273,9 @@ size_t getLeafItemCount(void* page)
 	return ((LeafPageHeader*)page)->item_count_;
 }
 
-void setLeafItemOffset(void* page, uint32_t index, offset_t off)
+offset_t* getLeafSlots(void* page)
 {
-	*(offset_t*)((byte*)page + sizeof(LeafPageHeader) + sizeof(offset_t) * index) = off;
-}
-
-offset_t getLeafItemOffset(void* page, uint32_t index)
-{
-	return *(offset_t*)((byte*)page + sizeof(LeafPageHeader) + sizeof(offset_t) * index);
+	return (offset_t*)((byte*)page + sizeof(LeafPageHeader));
 }
 
 void setInternalPageId(void* page, page_id_t page_id)
@@ -166,16 +288,6 @@ page_id_t getInternalPageId(void* page)
 	return ((InternalPageHeader*)page)->page_id_;
 }
 
-void setInternalParent(void* page, page_id_t page_id)
-{
-	((InternalPageHeader*)page)->parent_id_ = page_id;
-}
-
-page_id_t getInternalParent(void* page)
-{
-	return ((InternalPageHeader*)page)->parent_id_;
-}
-
 void setInternalOffset(void* page, offset_t off)
 {
 	((InternalPageHeader*)page)->hoff_ = off;
@@ -196,14 +308,9 @@ size_t getInternalItemCount(void* page)
 	return ((InternalPageHeader*)page)->item_count_;
 }
 
-void setInternalItemOffset(void* page, uint32_t index, offset_t off)
-{
-	*(offset_t*)((byte*)page + sizeof(InternalPageHeader) + sizeof(offset_t) * index) = off;
-}
-
-offset_t getInternalItemOffset(void* page, uint32_t index)
+offset_t* getInternalSlots(void* page)
 {
-	return *(offset_t*)((byte*)page + sizeof(InternalPageHeader) + sizeof(offset_t) * index);
+	return (offset_t*)((byte*)page + sizeof(InternalPageHeader));
 }
 
 page_id_t getLastChild(void* page)
@@ -216,7 +323,52 @@ void setLastChild(void* page, page_id_t page_id)
 	((InternalPageHeader*)page)->last_child_id_ = page_id;
 }
 
-page_id_t getChild(void* page, uint32_t i)
+// both page headers start with the type and the page id
+page_id_t getPageId(void* page)
+{
+	return ((LeafPageHeader*)page)->page_id_;
+}
+
+
+// With key_heads_, the upper half of each key slot holds the key head
+// (see keyhead.h) and only the lower half is the item offset. Slots are
+// moved whole, so heads travel with their items; whatever writes a key
+// into a slot sets its head.
+inline offset_t BTree::getLeafItemOffset(void* page, uint32_t index)
+{
+	return getLeafSlots(page)[index] & offset_mask_;
+}
+
+inline void BTree::setLeafItemOffset(void* page, uint32_t index, offset_t off)
+{
+	offset_t* slot = getLeafSlots(page) + index;
+	*slot = (*slot & ~offset_mask_) | off;
+}
+
+inline offset_t BTree::getInternalItemOffset(void* page, uint32_t index)
+{
+	return getInternalSlots(page)[index] & offset_mask_;
+}
+
+inline void BTree::setInternalItemOffset(void* page, uint32_t index, offset_t off)
+{
+	offset_t* slot = getInternalSlots(page) + index;
+	*slot = (*slot & ~offset_mask_) | off;
+}
+
+void BTree::setKeyHead(void* page, uint32_t index)
+{
+	if (!key_heads_)
+	{
+		return;
+	}
+	byte* p = getItemPointer(page, index);
+	offset_t* slot = (getPageType(page) == BTreePageType::Internal ?
+					getInternalSlots(page) : getLeafSlots(page)) + index;
+	*slot = (*slot & offset_mask_) | (makeKeyHead(getItemLocalData(p), getItemLocalDataSize(p)) << 16);
+}
+
+inline page_id_t BTree::getChild(void* page, uint32_t i)
 {
 	if (i == getInternalItemCount(page))
 	{
@@ -225,7 +377,19 @@ page_id_t getChild(void* page, uint32_t i)
 	return *(page_id_t*)((byte*)page + getInternalItemOffset(page, i));
 }
 
-void setChild(void* page, uint32_t i, page_id_t page_id)
+inline byte* BTree::getItemPointer(void* page, uint32_t index)
+{
+	if (getPageType(page) == BTreePageType::Internal)
+	{
+		return (byte*)page + getInternalItemOffset(page, index) + sizeof(page_id_t);
+	}
+	else
+	{
+		return (byte*)page + getLeafItemOffset(page, index);
+	}
+}
+
+inline void BTree::setChild(void* page, uint32_t i, page_id_t page_id)
 {
 	if (i == getInternalItemCount(page))
 	{
@@ -241,8 +405,8 @@ void BTree::buildRootPage(BTreePageType type)
 {
 	store_->lock();
 	page_id_t rid = store_->getNewPage();
-	store_->setRootId(rid);
-	void* page = store_->acquire(rid);
+	setRootId(rid);
+	void* page = writePage(rid);
 	zeroMemory(page, page_size_);
 	setPageType(page, type);
 	if (type == BTreePageType::Internal)
@@ -253,19 +417,129 @@ void BTree::buildRootPage(BTreePageType type)
 	else
 	{
 		setLeafPageId(page, rid);
-		setLeafOffset(page, page_size_);
+		initLeaf(page);
 	}
 	store_->unlock();
 }
 
+// Looks key up without the storage lock. Latches are coupled from the
+// root down, a child latched before its parent is let go. A lookup that
+// cannot latch a child at once, or finds a page not cached, lets go of
+// everything and starts over, loading the page first; so it never waits
+// holding a latch the writer may be waiting for. The value is copied to
+// val, or val is NULL and view gets it. Returns false if the lookup kept
+// being turned away and should be run under the lock instead.
+bool BTree::sharedGet(const void* key, size_t ksize, Buffer* val, ValueView* view, bool* found)
+{
+	Buffer scratch;
+	SearchState state(&scratch);
+	for (uint32_t attempt = 0; attempt < max_shared_attempts; ++attempt)
+	{
+		if (state.missed_)
+		{
+			if (store_->pin(state.miss_))
+			{
+				store_->unpin(state.miss_);
+			}
+			state.missed_ = false;
+		}
+		else if (attempt > 0)
+		{
+			std::this_thread::yield();
+		}
+
+		page_id_t cur = root_.load(std::memory_order_acquire);
+		void* page = latchPage(cur, &state);
+		if (page && cur != root_.load(std::memory_order_acquire))
+		{
+			unlatchPage(cur);
+			continue;
+		}
+
+		uint32_t i;
+		bool hit;
+		while (page && getPageType(page) == BTreePageType::Internal)
+		{
+			hit = search(page, key, ksize, &i, &state);
+			void* child_page = NULL;
+			page_id_t child = 0;
+			if (!state.missed_)
+			{
+				child = getChild(page, i + (hit ? 1 : 0));
+				child_page = latchPage(child, &state);
+			}
+			unlatchPage(cur);
+			page = child_page;
+			cur = child;
+		}
+		if (page == NULL)
+		{
+			continue;
+		}
+
+		hit = search(page, key, ksize, &i, &state);
+		if (!state.missed_ && hit)
+		{
+			byte* p = getItemPointer(page, i+1);
+			if (val)
+			{
+				readCached(p, val, &state);
+			}
+			else if (getItemType(p) == ItemType::OnPage)
+			{
+				view->point(store_, cur, p + sizeof(OnPageItemHeader),
+							((OnPageItemHeader*)p)->size_);
+			}
+			else
+			{
+				readCached(p, view->fill(), &state);
+			}
+		}
+		else if (!state.missed_ && view)
+		{
+			view->reset();
+		}
+		unlatchPage(cur);
+
+		if (!state.missed_)
+		{
+			*found = hit;
+			return true;
+		}
+	}
+	return false;
+}
+
 size_t BTree::get(const void* key, size_t ksize, void* buf, size_t size)
 {
-	store_->lock();
+	if (concurrent_)
+	{
+		Buffer val;
+		bool found;
+		if (sharedGet(key, ksize, &val, NULL, &found))
+		{
+			size_t ret = (found ? min(size, val.getSize()) : 0);
+			memcpy(buf, val.getBuffer(), ret);
+			return ret;
+		}
+	}
 
-	get(key, ksize);
+	store_->lock();
 
-	size_t ret = min(size, data_buf_->getSize());
-	memcpy(buf, data_buf_->getBuffer(), ret);
+	page_id_t page_id;
+	byte* p = findValue(key, ksize, &page_id);
+	size_t ret = 0;
+	if (p && getItemType(p) == ItemType::OnPage)
+	{
+		ret = min(size, ((OnPageItemHeader*)p)->size_);
+		memcpy(buf, p + sizeof(OnPageItemHeader), ret);
+	}
+	else if (p)
+	{
+		readItem(p, data_buf_);
+		ret = min(size, data_buf_->getSize());
+		memcpy(buf, data_buf_->getBuffer(), ret);
+	}
 
 	store_->unlock();
 
@@ -274,13 +548,40 @@ size_t BTree::get(const void* key, size_t ksize, void* buf, size_t size)
 
 size_t BTree::get(const void* key, size_t ksize, void** val)
 {
+	if (concurrent_)
+	{
+		Buffer value;
+		bool found;
+		if (sharedGet(key, ksize, &value, NULL, &found))
+		{
+			size_t ret = (found ? value.getSize() : 0);
+			void* data = (void*)(new byte[ret]);
+			memcpy(data, value.getBuffer(), ret);
+			*val = data;
+			return ret;
+		}
+	}
+
 	store_->lock();
 
-	get(key, ksize);
+	page_id_t page_id;
+	byte* p = findValue(key, ksize, &page_id);
+	const void* src = NULL;
+	size_t ret = 0;
+	if (p && getItemType(p) == ItemType::OnPage)
+	{
+		src = p + sizeof(OnPageItemHeader);
+		ret = ((OnPageItemHeader*)p)->size_;
+	}
+	else if (p)
+	{
+		readItem(p, data_buf_);
+		src = data_buf_->getBuffer();
+		ret = data_buf_->getSize();
+	}
 
-	void* data = (void*)(new byte[data_buf_->getSize()]);
-	size_t ret = data_buf_->getSize();
-	memcpy(data, data_buf_->getBuffer(), ret);
+	void* data = (void*)(new byte[ret]);
+	memcpy(data, src, ret);
 	*val = data;
 
 	store_->unlock();
@@ -288,17 +589,185 @@ size_t BTree::get(const void* key, size_t ksize, void** val)
 	return ret;
 }
 
-void BTree::get(const void* key, size_t ksize)
+// Reads an on-page value in place, pinning its leaf for the life of the
+// view; overflow values are copied into the view.
+bool BTree::get(const void* key, size_t ksize, ValueView* view)
 {
+	bool found;
+	if (concurrent_ && sharedGet(key, ksize, NULL, view, &found))
+	{
+		return found;
+	}
+
+	store_->lock();
+
 	page_id_t page_id;
+	byte* p = findValue(key, ksize, &page_id);
+	if (p == NULL)
+	{
+		view->reset();
+	}
+	else if (getItemType(p) == ItemType::OnPage)
+	{
+		view->point(store_, page_id, p + sizeof(OnPageItemHeader),
+					((OnPageItemHeader*)p)->size_);
+	}
+	else
+	{
+		readItem(p, view->fill());
+	}
+
+	store_->unlock();
+
+	return p != NULL;
+}
+
+// Returns the value item of key inside its leaf, or NULL if key is absent.
+byte* BTree::findValue(const void* key, size_t ksize, page_id_t* page_id)
+{
 	uint32_t i;
-	bool found = rec_search(key, ksize, &page_id, &i);
-	if (!found)
+	if (!rec_search(key, ksize, page_id, &i))
 	{
-		data_buf_->clear();
-		return;
+		return NULL;
+	}
+	void* page = store_->getPage(*page_id);
+	return (byte*)page + getLeafItemOffset(page, i+1);
+}
+
+// Looks count keys up under one lock; value i goes to vals[i] and
+// found[i] tells whether key i is there. The keys are visited in order,
+// so neighbours share the upper part of their descent. They go through
+// in groups of multiget_group: the leaf ids of a whole group are found
+// first, then all its leaves prefetched (read ahead by the OS if not
+// cached) before any is searched, and its values prefetched before any
+// is copied, so the cache misses of one lookup overlap those of the
+// others.
+void BTree::multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+					Buffer* vals, bool* found)
+{
+	std::vector<size_t> order(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [this, keys, ksizes](size_t a, size_t b) {
+		return compareKeys(keys[a], ksizes[a], keys[b], ksizes[b]) < 0;
+	});
+
+	store_->lock();
+
+	std::vector<DescentStep> steps;
+	std::vector<Buffer*> fences;
+	page_id_t leaves[multiget_group];
+	byte* items[multiget_group];
+	for (size_t from = 0; from < count; from += multiget_group)
+	{
+		size_t n = min(count - from, (size_t)multiget_group);
+		for (size_t k = 0; k < n; ++k)
+		{
+			size_t j = order[from+k];
+			leaves[k] = descend(keys[j], ksizes[j], &steps, &fences);
+		}
+		for (size_t k = 0; k < n; ++k)
+		{
+			if (k == 0 || leaves[k] != leaves[k-1])
+			{
+				store_->prefetchPage(leaves[k]);
+			}
+		}
+		for (size_t k = 0; k < n; ++k)
+		{
+			size_t j = order[from+k];
+			void* page = store_->getPage(leaves[k]);
+			uint32_t i;
+			items[k] = NULL;
+			if (search(page, keys[j], ksizes[j], &i))
+			{
+				items[k] = getItemPointer(page, i+1);
+				prefetch(items[k], CACHE_LINE);
+			}
+		}
+		for (size_t k = 0; k < n; ++k)
+		{
+			size_t j = order[from+k];
+			found[j] = (items[k] != NULL);
+			vals[j].clear();
+			if (items[k])
+			{
+				readItem(items[k], &vals[j]);
+			}
+		}
+		// steps keeps page ids and copied fences, so the pages may go
+		store_->releasePages();
+	}
+
+	store_->unlock();
+
+	for (size_t d = 0; d < fences.size(); ++d)
+	{
+		deletePtr(fences[d]);
+	}
+}
+
+// Finds the leaf of key for keys coming in ascending order. steps holds
+// the path of the previous key; the descent picks up from the deepest
+// page on it whose fence is still above key. Fences shrink going down,
+// so once the leaf's own is passed they are tried from the root down.
+// fences[d] keeps the separator found at depth d.
+page_id_t BTree::descend(const void* key, size_t ksize, std::vector<DescentStep>* steps,
+						std::vector<Buffer*>* fences)
+{
+	if (!steps->empty() && !isBelowFence(steps->back(), key, ksize))
+	{
+		size_t keep = 1;
+		while (keep < steps->size() && isBelowFence((*steps)[keep], key, ksize))
+		{
+			++keep;
+		}
+		steps->resize(keep);
+	}
+	if (steps->empty())
+	{
+		DescentStep root = { store_->getRootId(), NULL };
+		steps->push_back(root);
+	}
+
+	for (;;)
+	{
+		DescentStep step = steps->back();
+		void* page = store_->getPage(step.page_id_);
+		if (getPageType(page) == BTreePageType::Leaf)
+		{
+			return step.page_id_;
+		}
+		uint32_t i;
+		if (search(page, key, ksize, &i))
+		{
+			++i;
+		}
+		DescentStep child = { getChild(page, i), step.fence_ };
+		if (i < getInternalItemCount(page))
+		{
+			size_t depth = steps->size();
+			if (fences->size() <= depth)
+			{
+				fences->resize(depth + 1, NULL);
+			}
+			if ((*fences)[depth] == NULL)
+			{
+				(*fences)[depth] = new Buffer();
+			}
+			child.fence_ = (*fences)[depth];
+			getItem(page, i, child.fence_);
+		}
+		steps->push_back(child);
 	}
-	getItem(page_id, i+1, data_buf_);
+}
+
+bool BTree::isBelowFence(const DescentStep& step, const void* key, size_t ksize)
+{
+	return step.fence_ == NULL ||
+		compareKeys(key, ksize, step.fence_->getBuffer(), step.fence_->getSize()) < 0;
 }
 
 bool BTree::rec_search(const void* key, size_t ksize, page_id_t* page_id, uint32_t* index)
@@ -308,8 +777,10 @@ bool BTree::rec_search(const void* key, size_t ksize, page_id_t* page_id, uint32
 	bool found;
 	uint32_t i;
 
+	path_.clear();
 	for (;;)
 	{
+		path_.push_back(cur);
 		page = store_->getPage(cur);
 		found = search(page, key, ksize, &i);
 		if (getPageType(page) == BTreePageType::Internal)
@@ -327,28 +798,164 @@ bool BTree::rec_search(const void* key, size_t ksize, page_id_t* page_id, uint32
 	return found;
 }
 
-bool BTree::search(void* page, const void* key, size_t ksize, uint32_t* index)
+// rec_search for put. Keys growing in time land in the rightmost leaf
+// over and over, and every key at or past that leaf's first key belongs
+// there, so such keys skip the descent from the root.
+bool BTree::searchForPut(const void* key, size_t ksize, page_id_t* page_id, uint32_t* index)
 {
-	BTreePageType type = getPageType(page);
-	int32_t step = (type == BTreePageType::Leaf ? 2 : 1);
-	int32_t left = 0;
-	int32_t right = (type == BTreePageType::Leaf ?
-				getLeafItemCount(page) :
-				getInternalItemCount(page)) - step;
-	int32_t r, mid;
-	bool found = false;
-
-	while (left <= right)
+	if (last_leaf_ != 0)
 	{
-		mid = (type == BTreePageType::Leaf ?
-			((left + right) >> 1) & ~0x1 :
-			(left + right) >> 1);
-
-		r = compare(page, mid, key, ksize);
-		if (r == 0)
+		void* page = store_->getPage(last_leaf_);
+		if (getLeafItemCount(page) > 0 && compare(page, 0, key, ksize) <= 0)
 		{
-			left = mid;
-			found = true;
+			// there is no path to the leaf; a split descends for one
+			path_.clear();
+			*page_id = last_leaf_;
+			return search(page, key, ksize, index);
+		}
+	}
+
+	bool found = rec_search(key, ksize, page_id, index);
+	if (getLeafNext(store_->getPage(*page_id)) == 0)
+	{
+		last_leaf_ = *page_id;
+	}
+	return found;
+}
+
+// Search for an integer key under its integer order. Keys of the same
+// width are read straight off the page and compared as T; only keys of
+// another size go through the comparator.
+template<class T>
+bool BTree::searchInteger(void* page, const void* key, int32_t step, int32_t right,
+						uint32_t* index, SearchState* state)
+{
+	T k, v;
+	memcpy(&k, key, sizeof(T));
+	int32_t left = 0;
+	int32_t mid;
+	while (left <= right)
+	{
+		mid = (step == 2 ? ((left + right) >> 1) & ~0x1 : (left + right) >> 1);
+		byte* p = getItemPointer(page, mid);
+		if (getItemType(p) == ItemType::OnPage && getItemLocalDataSize(p) == sizeof(T))
+		{
+			memcpy(&v, p + sizeof(OnPageItemHeader), sizeof(T));
+			if (v == k)
+			{
+				*index = mid;
+				return true;
+			}
+			else if (v < k)
+			{
+				left = mid + step;
+			}
+			else
+			{
+				right = mid - step;
+			}
+		}
+		else
+		{
+			int32_t r = compareItem(p, key, sizeof(T), state);
+			if (r == 0)
+			{
+				*index = mid;
+				return true;
+			}
+			else if (r < 0)
+			{
+				left = mid + step;
+			}
+			else
+			{
+				right = mid - step;
+			}
+		}
+	}
+	*index = left;
+	return false;
+}
+
+bool BTree::search(void* page, const void* key, size_t ksize, uint32_t* index,
+				SearchState* state)
+{
+	BTreePageType type = getPageType(page);
+	int32_t step = (type == BTreePageType::Leaf ? 2 : 1);
+	int32_t left = 0;
+	int32_t right = (type == BTreePageType::Leaf ?
+				getLeafItemCount(page) :
+				getInternalItemCount(page)) - step;
+	int32_t r, mid;
+	bool found = false;
+
+	switch (key_order_)
+	{
+	case KeyOrder::Int32:
+		if (ksize == sizeof(int32_t))
+		{
+			return searchInteger<int32_t>(page, key, step, right, index, state);
+		}
+		break;
+	case KeyOrder::UInt32:
+		if (ksize == sizeof(uint32_t))
+		{
+			return searchInteger<uint32_t>(page, key, step, right, index, state);
+		}
+		break;
+	case KeyOrder::Int64:
+		if (ksize == sizeof(int64_t))
+		{
+			return searchInteger<int64_t>(page, key, step, right, index, state);
+		}
+		break;
+	case KeyOrder::UInt64:
+		if (ksize == sizeof(uint64_t))
+		{
+			return searchInteger<uint64_t>(page, key, step, right, index, state);
+		}
+		break;
+	default:
+		break;
+	}
+
+	// a key outside the page prefix sorts before or after the whole leaf;
+	// inside it only the suffixes are compared
+	const byte* prefix;
+	size_t plen = (type == BTreePageType::Leaf ? getLeafPrefix(page, &prefix) : 0);
+	if (plen > 0)
+	{
+		r = memcmp(prefix, key, min(plen, ksize));
+		if (r != 0 || ksize < plen)
+		{
+			*index = (r >= 0 ? 0 : right + step);
+			return false;
+		}
+		key = (const byte*)key + plen;
+		ksize -= plen;
+	}
+
+	// only keys with the head of the search key need a look
+	if (key_heads_ && left <= right)
+	{
+		size_t below, upto;
+		offset_t* slots = (type == BTreePageType::Leaf ? getLeafSlots(page) : getInternalSlots(page));
+		countKeyHeads(slots, right / step + 1, step, makeKeyHead(key, ksize), &below, &upto);
+		left = below * step;
+		right = (int32_t)(upto * step) - step;
+	}
+
+	while (left <= right)
+	{
+		mid = (type == BTreePageType::Leaf ?
+			((left + right) >> 1) & ~0x1 :
+			(left + right) >> 1);
+
+		r = compareItem(getItemPointer(page, mid), key, ksize, state);
+		if (r == 0)
+		{
+			left = mid;
+			found = true;
 			break;
 		}
 		else if (r < 0)
@@ -367,11 +974,73 @@ bool BTree::search(void* page, const void* key, size_t ksize, uint32_t* index)
 
 int32_t BTree::compare(void* page, uint32_t index, const void* key, size_t ksize)
 {
-	getItem(page, index, cmp_buf_);
-	int32_t r = memcmp(cmp_buf_->getBuffer(), key, min(ksize, cmp_buf_->getSize()));
+	const byte* prefix;
+	size_t plen = (getPageType(page) == BTreePageType::Leaf ? getLeafPrefix(page, &prefix) : 0);
+	if (plen > 0)
+	{
+		int32_t r = memcmp(prefix, key, min(plen, ksize));
+		if (r != 0)
+		{
+			return r;
+		}
+		if (ksize < plen)
+		{
+			return 1;
+		}
+		key = (const byte*)key + plen;
+		ksize -= plen;
+	}
+	return compareItem(getItemPointer(page, index), key, ksize);
+}
+
+// Compares against the key bytes on the page; the overflow chain is
+// only read when the local prefix ties. Under a state whose overflow
+// page is not cached the result is meaningless and state says so.
+int32_t BTree::compareItem(const byte* p, const void* key, size_t ksize,
+						SearchState* state)
+{
+	size_t local_size = getItemLocalDataSize(p);
+	if (getItemType(p) == ItemType::OnPage)
+	{
+		if (key_order_ != KeyOrder::Bytes)
+		{
+			return comparator_(getItemLocalData(p), local_size, key, ksize);
+		}
+		int32_t r = memcmp(getItemLocalData(p), key, min(local_size, ksize));
+		return (r != 0 ? r : local_size - ksize);
+	}
+
+	if (key_order_ == KeyOrder::Bytes)
+	{
+		int32_t r = memcmp(getItemLocalData(p), key, min(local_size, ksize));
+		if (r != 0)
+		{
+			return r;
+		}
+	}
+
+	Buffer* buf = cmp_buf_;
+	if (state)
+	{
+		buf = state->buf_;
+		if (!readCached(p, buf, state))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		readItem(p, buf);
+	}
+
+	if (key_order_ != KeyOrder::Bytes)
+	{
+		return comparator_(buf->getBuffer(), buf->getSize(), key, ksize);
+	}
+	int32_t r = memcmp(buf->getBuffer(), key, min(ksize, buf->getSize()));
 	if (r == 0)
 	{
-		return cmp_buf_->getSize() - ksize;
+		return buf->getSize() - ksize;
 	}
 	return r;
 }
@@ -384,17 +1053,25 @@ void BTree::getItem(page_id_t page_id, uint32_t index, Buffer* buf)
 
 void BTree::getItem(void* page, uint32_t index, Buffer* buf)
 {
-	BTreePageType type = getPageType(page);
-	byte* p;
 	buf->clear();
-	if (type == BTreePageType::Internal)
-	{
-		p = (byte*)page + getInternalItemOffset(page, index) + sizeof(page_id_t);
-	}
-	else
+	if (getPageType(page) == BTreePageType::Leaf && (index & 0x1) == 0)
 	{
-		p = (byte*)page + getLeafItemOffset(page, index);
+		const byte* prefix;
+		size_t plen = getLeafPrefix(page, &prefix);
+		buf->append(prefix, plen);
 	}
+	appendItem(getItemPointer(page, index), buf);
+}
+
+// Copies the item at p into buf, following its overflow chain if needed.
+void BTree::readItem(const byte* p, Buffer* buf)
+{
+	buf->clear();
+	appendItem(p, buf);
+}
+
+void BTree::appendItem(const byte* p, Buffer* buf)
+{
 	if (getItemType(p) == ItemType::OnPage)
 	{
 		buf->append(p + sizeof(OnPageItemHeader), ((OnPageItemHeader*)p)->size_);
@@ -423,7 +1100,52 @@ void BTree::getItem(void* page, uint32_t index, Buffer* buf)
 	}
 }
 
+// readItem for lookups without the storage lock: overflow pages are
+// pinned only while they are copied, and only if they are cached.
+bool BTree::readCached(const byte* p, Buffer* buf, SearchState* state)
+{
+	buf->clear();
+	if (getItemType(p) == ItemType::OnPage)
+	{
+		buf->append(p + sizeof(OnPageItemHeader), ((OnPageItemHeader*)p)->size_);
+		return true;
+	}
+
+	size_t total = ((OffPageItemHeader*)p)->total_size_;
+	buf->append(p + sizeof(OffPageItemHeader), getItemSizeOnPage(p) - sizeof(OffPageItemHeader));
+	total -= getItemSizeOnPage(p) - sizeof(OffPageItemHeader);
+	page_id_t pid = ((OffPageItemHeader*)p)->ov_page_id_;
+	offset_t off = ((OffPageItemHeader*)p)->ov_off_;
+	while (total > 0)
+	{
+		void* page = store_->pinCached(pid);
+		if (page == NULL)
+		{
+			state->missed_ = true;
+			state->miss_ = pid;
+			return false;
+		}
+		size_t read_bytes = min(page_size_-off, total);
+		buf->append((byte*)page + off, read_bytes);
+		total -= read_bytes;
+		page_id_t next = ((OverflowPageHeader*)page)->next_;
+		store_->unpin(pid);
+		pid = next;
+		off = sizeof(OverflowPageHeader);
+	}
+	return true;
+}
+
 void BTree::put(const void* key, size_t ksize, const void* val, size_t vsize)
+{
+	store_->lock();
+	++version_;
+	insert(key, ksize, val, vsize);
+	unlatchAll();
+	store_->unlock();
+}
+
+void BTree::insert(const void* key, size_t ksize, const void* val, size_t vsize)
 {
 	page_id_t page_id;
 	uint32_t i;
@@ -431,7 +1153,7 @@ void BTree::put(const void* key, size_t ksize, const void* val, size_t vsize)
 
 	for (;;)
 	{
-		found = rec_search(key, ksize, &page_id, &i);
+		found = searchForPut(key, ksize, &page_id, &i);
 		if (found)
 		{
 			if (modifyLeafItem(page_id, i+1, val, vsize))
@@ -440,7 +1162,7 @@ void BTree::put(const void* key, size_t ksize, const void* val, size_t vsize)
 			}
 			else
 			{
-				remove(key, ksize);
+				erase(key, ksize);
 				continue;
 			}
 		}
@@ -451,14 +1173,108 @@ void BTree::put(const void* key, size_t ksize, const void* val, size_t vsize)
 				break;
 			}
 		}
-		splitLeaf(page_id);
+		if (path_.empty() || path_.back() != page_id)
+		{
+			rec_search(key, ksize, &page_id, &i);
+		}
+		splitLeaf(page_id, i);
 		// iter();
 	}
 }
 
+// Applies a batch under one lock, in key order. Keys that follow each
+// other in the same leaf are applied there without another descent: a
+// key stays in the leaf the last descent reached while it sorts below
+// that leaf's fence. An operation that has to split or merge pages goes
+// the long way and the next one descends afresh. With concurrent reads
+// on, every page the batch changes stays latched until all of it is in.
+void BTree::write(const WriteBatch* batch)
+{
+	std::vector<size_t> order(batch->count());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [this, batch](size_t a, size_t b) {
+		size_t asize, bsize;
+		const void* akey = batch->getKey(a, &asize);
+		const void* bkey = batch->getKey(b, &bsize);
+		return compareKeys(akey, asize, bkey, bsize) < 0;
+	});
+
+	store_->lock();
+	++version_;
+
+	Buffer fence;
+	bool bounded = false;
+	page_id_t page_id = 0;
+	for (size_t k = 0; k < order.size(); ++k)
+	{
+		size_t ksize, vsize;
+		const void* key = batch->getKey(order[k], &ksize);
+		if (page_id == 0 || (bounded &&
+			compareKeys(key, ksize, fence.getBuffer(), fence.getSize()) >= 0))
+		{
+			page_id = findLeaf(key, ksize, &fence, &bounded);
+		}
+
+		uint32_t i;
+		bool found = search(store_->getPage(page_id), key, ksize, &i);
+		if (batch->getType(order[k]) == WriteBatch::OpType::Delete)
+		{
+			if (found && removeItem(page_id, i))
+			{
+				page_id = 0;
+			}
+			continue;
+		}
+
+		const void* val = batch->getValue(order[k], &vsize);
+		if (found ? !modifyLeafItem(page_id, i+1, val, vsize)
+			: !insertLeafItem(page_id, i, key, ksize, val, vsize))
+		{
+			insert(key, ksize, val, vsize);
+			page_id = 0;
+		}
+	}
+
+	unlatchAll();
+	store_->unlock();
+}
+
+// Descends to the leaf key belongs in, recording path_, and copies that
+// leaf's fence, the separator all its keys sort below, to fence. The
+// rightmost leaf has none and bounded is then false.
+page_id_t BTree::findLeaf(const void* key, size_t ksize, Buffer* fence, bool* bounded)
+{
+	page_id_t cur = store_->getRootId();
+	*bounded = false;
+	path_.clear();
+	for (;;)
+	{
+		path_.push_back(cur);
+		void* page = store_->getPage(cur);
+		if (getPageType(page) == BTreePageType::Leaf)
+		{
+			return cur;
+		}
+		uint32_t i;
+		if (search(page, key, ksize, &i))
+		{
+			++i;
+		}
+		if (i < getInternalItemCount(page))
+		{
+			getItem(page, i, fence);
+			*bounded = true;
+		}
+		cur = getChild(page, i);
+	}
+}
+
 bool BTree::modifyLeafItem(page_id_t page_id, uint32_t index, const void* val, size_t vsize)
 {
-	void* page = store_->getPage(page_id);
+	void* page = writePage(page_id);
 	byte* p = (byte*)page + getLeafItemOffset(page, index);
 	ItemType itype = getItemType(p);
 	if (itype == ItemType::OnPage && ((OnPageItemHeader*)p)->size_ >= vsize)
@@ -478,7 +1294,7 @@ bool BTree::modifyLeafItem(page_id_t page_id, uint32_t index, const void* val, s
 		offset_t off = ((OffPageItemHeader*)p)->ov_off_;
 		while(vsize > 0)
 		{
-			void* page = store_->getPage(pid);
+			void* page = writePage(pid);
 			write_bytes = min(page_size_ - off, vsize);
 			memcpy((byte*)page+off, val, write_bytes);
 			val = (byte*)val + write_bytes;
@@ -498,12 +1314,39 @@ bool BTree::insertLeafItem(page_id_t page_id, uint32_t index,
 						const void* key, size_t ksize,
 						const void* val, size_t vsize)
 {
-	void* page = store_->getPage(page_id);
-	size_t off_page_size = adjustAlign(((page_size_ - sizeof(LeafPageHeader)) / store_->getMinItems())
-									 - sizeof(offset_t) - ALIGN_WIDTH);
-	size_t on_page_key_size = sizeof(OnPageItemHeader) + adjustAlign(ksize);
-	size_t on_page_val_size = sizeof(OnPageItemHeader) + adjustAlign(vsize);
-	size_t need = min(on_page_key_size, off_page_size) + min(on_page_val_size, off_page_size);
+	void* page = writePage(page_id);
+
+	// keep only the part of the page prefix the new key shares
+	const byte* prefix;
+	size_t plen = getLeafPrefix(page, &prefix);
+	if (plen > 0)
+	{
+		size_t keep = 0;
+		if (isOnPage(ksize))
+		{
+			while (keep < plen && keep < ksize && prefix[keep] == ((const byte*)key)[keep])
+			{
+				++keep;
+			}
+		}
+		if (keep < plen)
+		{
+			std::vector<size_t> items;
+			leaf_buf_->clear();
+			expandLeaf(page, &items);
+			if (getLeafSize(items, 0, items.size(), keep) > page_size_)
+			{
+				return false;
+			}
+			rebuildLeaf(page, items, 0, items.size(), keep);
+			plen = getLeafPrefix(page, &prefix);
+		}
+		key = (const byte*)key + plen;
+		ksize -= plen;
+	}
+
+	size_t key_size = getItemSize(ksize);
+	size_t need = key_size + getItemSize(vsize);
 
 	if (need + (sizeof(offset_t) << 1) > getPageSpace(page))
 	{
@@ -513,21 +1356,94 @@ bool BTree::insertLeafItem(page_id_t page_id, uint32_t index,
 	size_t n = getLeafItemCount(page);
 	for (uint32_t i = n+1; i > index+1; --i)
 	{
-		setLeafItemOffset(page, i, getLeafItemOffset(page, i-2));
+		getLeafSlots(page)[i] = getLeafSlots(page)[i-2];
 	}
 	setLeafItemCount(page, n+2);
 	setLeafOffset(page, getLeafOffset(page)-need);
 	setLeafItemOffset(page, index, getLeafOffset(page));
-	setLeafItemOffset(page, index+1, getLeafOffset(page)+min(on_page_key_size, off_page_size));
+	setLeafItemOffset(page, index+1, getLeafOffset(page)+key_size);
 
 	byte* p = (byte*)page + getLeafItemOffset(page, index);
 	writeItem(p, key, ksize);
+	setKeyHead(page, index);
 	p = (byte*)page + getLeafItemOffset(page, index+1);
 	writeItem(p, val, vsize);
 
 	return true;
 }
 
+// Whether an item of size bytes is stored whole on its page.
+bool BTree::isOnPage(size_t size)
+{
+	size_t off_page_size = adjustAlign(((page_size_ - sizeof(LeafPageHeader)) / store_->getMinItems())
+									 - sizeof(offset_t) - ALIGN_WIDTH);
+	return sizeof(OnPageItemHeader) + adjustAlign(size) <= off_page_size;
+}
+
+// Length of the shortest prefix of key right that still sorts after the
+// key in item left, or rsize when the local bytes of left cannot tell.
+size_t BTree::getSeparatorSize(const byte* left, const void* right, size_t rsize)
+{
+	if (key_order_ != KeyOrder::Bytes)
+	{
+		return rsize;
+	}
+	const byte* a = (const byte*)getItemLocalData(left);
+	const byte* b = (const byte*)right;
+	size_t asize = getItemLocalDataSize(left);
+	size_t n = min(asize, rsize);
+	size_t i = 0;
+	while (i < n && a[i] == b[i])
+	{
+		++i;
+	}
+	if (i == asize && getItemType(left) == ItemType::OffPage)
+	{
+		return rsize;
+	}
+	return min(i + 1, rsize);
+}
+
+// Picks the separator between the leaf items left and right: the
+// shortest prefix of the right key that sorts after the left one. Any
+// key of the right page is at least that, and internal pages only need
+// to tell the two pages apart. The result lives in sep_buf_ or is right
+// itself; returns its size.
+size_t BTree::getSeparator(const byte* left, const byte* right, const byte** sep)
+{
+	const byte* data = (const byte*)getItemLocalData(right);
+	size_t local_size = getItemLocalDataSize(right);
+	size_t size = getSeparatorSize(left, data, local_size);
+	if (size >= local_size)
+	{
+		*sep = right;
+		return getItemSizeOnPage(right);
+	}
+	return buildSeparator(data, size, sep);
+}
+
+// Makes an on-page item of the first size bytes of key in sep_buf_.
+size_t BTree::buildSeparator(const void* key, size_t size, const byte** sep)
+{
+	OnPageItemHeader header;
+	header.size_ = 0;
+	setItemType(&header, ItemType::OnPage);
+	setItemLocalDataSize(&header, size);
+	sep_buf_->clear();
+	sep_buf_->append(&header, sizeof(header));
+	sep_buf_->append(key, size);
+	*sep = sep_buf_->getBuffer();
+	return sep_buf_->getSize();
+}
+
+// Bytes a leaf item of size bytes takes on its page.
+size_t BTree::getItemSize(size_t size)
+{
+	size_t off_page_size = adjustAlign(((page_size_ - sizeof(LeafPageHeader)) / store_->getMinItems())
+									 - sizeof(offset_t) - ALIGN_WIDTH);
+	return min(sizeof(OnPageItemHeader) + adjustAlign(size), off_page_size);
+}
+
 void BTree::writeItem(byte* p, const void* data, size_t size)
 {
 	size_t off_page_size = adjustAlign(((page_size_ - sizeof(LeafPageHeader)) / store_->getMinItems())
@@ -556,7 +1472,7 @@ void BTree::writeItem(byte* p, const void* data, size_t size)
 void BTree::insertInternalItem(page_id_t pid, page_id_t lid, page_id_t rid,
 							void* item, size_t size)
 {
-	void* page = store_->getPage(pid);
+	void* page = writePage(pid);
 	uint32_t index;
 
 	{
@@ -615,10 +1531,11 @@ void BTree::insertInternalItem(page_id_t pid, page_id_t lid, page_id_t rid,
 	}
 
 	size_t need = size + sizeof(page_id_t);
+	assert(need + sizeof(offset_t) <= getPageSpace(page));
 	size_t n = getInternalItemCount(page);
 	for (uint32_t i = n; i > index; --i)
 	{
-		setInternalItemOffset(page, i, getInternalItemOffset(page, i-1));
+		getInternalSlots(page)[i] = getInternalSlots(page)[i-1];
 	}
 
 	setInternalItemCount(page, n+1);
@@ -628,132 +1545,158 @@ void BTree::insertInternalItem(page_id_t pid, page_id_t lid, page_id_t rid,
 	byte* dst = (byte*)page+getInternalItemOffset(page, index);
 	memcpy(dst, &lid, sizeof(page_id_t));
 	memcpy(dst+sizeof(page_id_t), item, size);
+	setKeyHead(page, index);
 
 	setChild(page, index+1, rid);
 }
 
-void BTree::splitLeaf(page_id_t page_id)
+// Splits a full leaf before inserting at index. Sequential keys always
+// go to the end of the rightmost leaf, and an even split would leave a
+// trail of half-empty leaves behind them, so there the split is made near
+// the end and the left page stays almost full. page_id must end path_.
+void BTree::splitLeaf(page_id_t page_id, uint32_t index)
 {
-	void* page = store_->getPage(page_id);
+	void* page = writePage(page_id);
 
 	page_id_t split_page_id = store_->getNewPage();
-	void* split_page = store_->getPage(split_page_id);
+	void* split_page = writePage(split_page_id);
 
-	page_id_t parent = getLeafParent(page);
+	bool append = (getLeafNext(page) == 0 && index >= getLeafItemCount(page));
+	if (page_id == last_leaf_)
+	{
+		last_leaf_ = split_page_id;
+	}
 	setPageType(split_page, BTreePageType::Leaf);
 	setLeafPageId(split_page, split_page_id);
-	if (parent == 0)
+	if (path_.size() == 1)
 	{
 		buildRootPage(BTreePageType::Internal);
-		parent = store_->getRootId();
-		setLeafParent(page, parent);
+		path_.insert(path_.begin(), store_->getRootId());
 	}
-	setLeafParent(split_page, parent);
 	setLeafPrev(split_page, page_id);
 	setLeafNext(split_page, getLeafNext(page));
 	setLeafNext(page, split_page_id);
-	setLeafOffset(split_page, page_size_);
+	if (getLeafNext(split_page) != 0)
+	{
+		setLeafPrev(writePage(getLeafNext(split_page)), split_page_id);
+	}
+	initLeaf(split_page);
 	setLeafItemCount(split_page, 0);
 
-	size_t n = getLeafItemCount(page);
+	// split full keys, so each half can take the longest prefix it shares
+	std::vector<size_t> items;
+	leaf_buf_->clear();
+	expandLeaf(page, &items);
+	size_t n = items.size();
 	uint32_t mid = (n >> 1) & ~0x1;
-	byte* p = (byte*)page + getLeafItemOffset(page, mid);
-	size_t size = getItemSizeOnPage(p);
-
-	void* parent_page = store_->getPage(parent);
-	if (size + sizeof(offset_t) + sizeof(page_id_t) > getPageSpace(parent_page))
+	if (append && n >= 4)
 	{
-		splitInternal(parent);
-		setLeafParent(split_page, getLeafParent(page));
+		mid = min((uint32_t)(n * append_split / 100) & ~0x1, (uint32_t)n - 2);
 	}
+	const byte* p;
+	size_t size = getSeparator(leaf_buf_->getBuffer() + items[mid-2],
+							leaf_buf_->getBuffer() + items[mid], &p);
 
-	for (uint32_t i = mid, j = 0; i < n; ++i, ++j)
+	// the half of the parent left on path_ may still be short of room
+	while (size + sizeof(offset_t) + sizeof(page_id_t) >
+		getPageSpace(store_->getPage(getPathParent(0))))
 	{
-		p = (byte*)page + getLeafItemOffset(page, i);
-		size = getItemSizeOnPage(p);
-		setLeafOffset(split_page, getLeafOffset(split_page)-size);
-		setLeafItemOffset(split_page, j, getLeafOffset(split_page));
-		memcpy((byte*)split_page+getLeafOffset(split_page), p, size);
+		splitInternal(1, append);
 	}
-	setLeafItemCount(split_page, n-mid);
-	setLeafItemCount(page, mid);
 
-	p = (byte*)split_page + getLeafItemOffset(split_page, 0);
-	insertInternalItem(getLeafParent(page), page_id, split_page_id,
-					p, getItemSizeOnPage(p));
+	rebuildLeaf(split_page, items, mid, n, page_size_);
+	rebuildLeaf(page, items, 0, mid, page_size_);
 
-	compactLeafPage(page);
+	insertInternalItem(getPathParent(0), page_id, split_page_id, (void*)p, size);
 }
 
-void BTree::splitInternal(page_id_t page_id)
+// Splits the page level steps above the leaf on path_ around the item in
+// the middle of its bytes, which moves up to the parent; if the split
+// comes from appends along the right edge, around the item at
+// append_split percent of them instead. Separators range from a byte or
+// two to a whole off-page item, so halving the item count could leave
+// one half nearly full. The children that move to the new page are not
+// touched; if the one on path_ is among them, path_ follows it.
+void BTree::splitInternal(size_t level, bool append)
 {
-	void* page = store_->getPage(page_id);
+	page_id_t page_id = path_[path_.size() - 1 - level];
+	void* page = writePage(page_id);
 	page_id_t split_page_id = store_->getNewPage();
-	void* split_page = store_->getPage(split_page_id);
+	void* split_page = writePage(split_page_id);
 
-	page_id_t parent = getInternalParent(page);
 	setPageType(split_page, BTreePageType::Internal);
 	setInternalPageId(split_page, split_page_id);
-	if (parent == 0)
+	if (path_.size() - 1 == level)
 	{
 		buildRootPage(BTreePageType::Internal);
-		parent = store_->getRootId();
-		setInternalParent(page, parent);
+		path_.insert(path_.begin(), store_->getRootId());
 	}
-	setInternalParent(split_page, parent);
 	setInternalOffset(split_page, page_size_);
 	setLastChild(split_page, getLastChild(page));
 	setInternalItemCount(split_page, 0);
 
 	size_t n = getInternalItemCount(page);
-	byte* p = (byte*)page + getInternalItemOffset(page, n >> 1) + sizeof(page_id_t);
+	size_t total = 0;
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		total += getInternalItemBytes(page, i);
+	}
+	size_t target = (append ? total * append_split / 100 : total >> 1);
+	uint32_t mid = 0;
+	for (size_t used = 0; mid + 1 < n; ++mid)
+	{
+		used += getInternalItemBytes(page, mid);
+		if (used > target)
+		{
+			break;
+		}
+	}
+	if (append && n >= 3)
+	{
+		mid = min(mid, (uint32_t)n - 2);
+	}
+	mid = max(mid, (uint32_t)min(n - 1, (size_t)1));
+	byte* p = (byte*)page + getInternalItemOffset(page, mid) + sizeof(page_id_t);
 	size_t size = getItemSizeOnPage(p);
 
-	void* parent_page = store_->getPage(parent);
-	if (size + sizeof(offset_t) + sizeof(page_id_t) > getPageSpace(parent_page))
+	while (size + sizeof(offset_t) + sizeof(page_id_t) >
+		getPageSpace(store_->getPage(getPathParent(level))))
 	{
-		splitInternal(parent);
-		setInternalParent(split_page, getInternalParent(page));
+		splitInternal(level + 1, append);
 	}
+	bool moved = findChild(page, path_[path_.size() - level]) > mid;
 
 	uint32_t i, j;
-	void* cp;
-	for (i = (n >> 1) + 1, j = 0; i < n; ++i, ++j)
+	for (i = mid + 1, j = 0; i < n; ++i, ++j)
 	{
 		p = (byte*)page + getInternalItemOffset(page, i);
-		cp = store_->getPage(*(page_id_t*)p);
-		if (getPageType(cp) == BTreePageType::Internal)
-		{
-			setInternalParent(cp, split_page_id);
-		}
-		else
-		{
-			setLeafParent(cp, split_page_id);
-		}
 		size = getItemSizeOnPage(p+sizeof(page_id_t)) + sizeof(page_id_t);
 		setInternalOffset(split_page, getInternalOffset(split_page)-size);
 		setInternalItemOffset(split_page, j, getInternalOffset(split_page));
 		memcpy((byte*)split_page+getInternalOffset(split_page), p, size);
-	}
-	cp = store_->getPage(getLastChild(page));
-	if (getPageType(cp) == BTreePageType::Internal)
-	{
-		setInternalParent(cp, split_page_id);
-	}
-	else
-	{
-		setLeafParent(cp, split_page_id);
+		setKeyHead(split_page, j);
 	}
 	setInternalItemCount(split_page, j);
-	setInternalItemCount(page, n >> 1);
-	p = (byte*)page + getInternalItemOffset(page, n >> 1);
+	setInternalItemCount(page, mid);
+	p = (byte*)page + getInternalItemOffset(page, mid);
 	setLastChild(page, *(page_id_t*)p);
 
-	p = (byte*)page + getInternalItemOffset(page, n >> 1) + sizeof(page_id_t);
-	insertInternalItem(getInternalParent(page), page_id, split_page_id,
+	p = (byte*)page + getInternalItemOffset(page, mid) + sizeof(page_id_t);
+	insertInternalItem(getPathParent(level), page_id, split_page_id,
 					p, getItemSizeOnPage(p));
 
 	compactInternalPage(page);
+	if (moved)
+	{
+		path_[path_.size() - 1 - level] = split_page_id;
+	}
+}
+
+// Bytes internal item index takes on its page, slot included.
+size_t BTree::getInternalItemBytes(void* page, uint32_t index)
+{
+	byte* p = (byte*)page + getInternalItemOffset(page, index) + sizeof(page_id_t);
+	return getItemSizeOnPage(p) + sizeof(page_id_t) + sizeof(offset_t);
 }
 
 void BTree::compactLeafPage(void* page)
@@ -772,7 +1715,7 @@ void BTree::compactLeafPage(void* page)
 	}
 
 	byte* buffer = data_buf_->getBuffer();
-	offset_t off = page_size_;
+	offset_t off = getLeafEnd(page);
 	for (uint32_t i = 0; i < n; ++i)
 	{
 		size = *(size_t*)buffer;
@@ -786,6 +1729,172 @@ void BTree::compactLeafPage(void* page)
 	setLeafOffset(page, off);
 }
 
+// With prefix_keys_ set, every leaf ends in a trailer holding the
+// prefix shared by all its keys and then its length; keys are stored
+// with the prefix stripped. Only leaves whose keys are all on the page
+// get a nonempty prefix.
+size_t BTree::getLeafPrefix(void* page, const byte** prefix)
+{
+	*prefix = NULL;
+	if (!prefix_keys_)
+	{
+		return 0;
+	}
+	uint32_t size = *(uint32_t*)((byte*)page + page_size_ - sizeof(uint32_t));
+	*prefix = (byte*)page + page_size_ - sizeof(uint32_t) - adjustAlign(size);
+	return size;
+}
+
+// Offset at which the items of a leaf end.
+offset_t BTree::getLeafEnd(void* page)
+{
+	const byte* prefix;
+	size_t size = getLeafPrefix(page, &prefix);
+	return prefix_keys_ ? page_size_ - sizeof(uint32_t) - adjustAlign(size) : page_size_;
+}
+
+void BTree::initLeaf(void* page)
+{
+	setLeafPrefix(page, NULL, 0);
+	setLeafOffset(page, getLeafEnd(page));
+}
+
+void BTree::setLeafPrefix(void* page, const void* prefix, size_t size)
+{
+	if (!prefix_keys_)
+	{
+		return;
+	}
+	*(uint32_t*)((byte*)page + page_size_ - sizeof(uint32_t)) = size;
+	if (size > 0)
+	{
+		memcpy((byte*)page + page_size_ - sizeof(uint32_t) - adjustAlign(size), prefix, size);
+	}
+}
+
+// Appends the items of a leaf to leaf_buf_ with full keys, recording
+// where each starts.
+void BTree::expandLeaf(void* page, std::vector<size_t>* items)
+{
+	const byte* prefix;
+	size_t plen = getLeafPrefix(page, &prefix);
+	size_t n = getLeafItemCount(page);
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		byte* p = (byte*)page + getLeafItemOffset(page, i);
+		items->push_back(leaf_buf_->getSize());
+		if (plen > 0 && (i & 0x1) == 0)
+		{
+			OnPageItemHeader header;
+			header.size_ = 0;
+			setItemType(&header, ItemType::OnPage);
+			setItemLocalDataSize(&header, plen + getItemLocalDataSize(p));
+			leaf_buf_->append(&header, sizeof(header));
+			leaf_buf_->append(prefix, plen);
+			leaf_buf_->append(getItemLocalData(p), getItemLocalDataSize(p));
+		}
+		else
+		{
+			leaf_buf_->append(p, getItemSizeOnPage(p));
+		}
+	}
+}
+
+// Length of the prefix shared by the keys among the expanded items
+// [from, to), at most max_prefix; zero if any of them is off the page.
+size_t BTree::getCommonPrefix(const std::vector<size_t>& items, size_t from, size_t to,
+							size_t max_prefix)
+{
+	if (!prefix_keys_ || to - from < 2)
+	{
+		return 0;
+	}
+	byte* base = leaf_buf_->getBuffer();
+	for (size_t i = from; i < to; i += 2)
+	{
+		if (getItemType(base + items[i]) == ItemType::OffPage)
+		{
+			return 0;
+		}
+	}
+	// keys are sorted, so the first and last share the least
+	const byte* first = base + items[from];
+	const byte* last = base + items[to-2];
+	const byte* a = (const byte*)getItemLocalData(first);
+	const byte* b = (const byte*)getItemLocalData(last);
+	size_t limit = min(min(getItemLocalDataSize(first), getItemLocalDataSize(last)), max_prefix);
+	size_t size = 0;
+	while (size < limit && a[size] == b[size])
+	{
+		++size;
+	}
+	return size;
+}
+
+// Bytes a leaf holding the expanded items [from, to) takes.
+size_t BTree::getLeafSize(const std::vector<size_t>& items, size_t from, size_t to,
+						size_t max_prefix)
+{
+	size_t plen = getCommonPrefix(items, from, to, max_prefix);
+	size_t size = sizeof(LeafPageHeader) + (prefix_keys_ ? sizeof(uint32_t) + adjustAlign(plen) : 0);
+	byte* base = leaf_buf_->getBuffer();
+	for (size_t i = from; i < to; ++i)
+	{
+		size += getItemSizeOnPage(base + items[i]) + sizeof(offset_t);
+		if (((i - from) & 0x1) == 0)
+		{
+			size -= plen;
+		}
+	}
+	return size;
+}
+
+// Lays out the expanded items [from, to) on a leaf, stripping the
+// longest prefix, up to max_prefix, that their keys share.
+void BTree::rebuildLeaf(void* page, const std::vector<size_t>& items, size_t from, size_t to,
+						size_t max_prefix)
+{
+	size_t plen = getCommonPrefix(items, from, to, max_prefix);
+	byte* base = leaf_buf_->getBuffer();
+	if (plen > 0)
+	{
+		setLeafPrefix(page, getItemLocalData(base + items[from]), plen);
+	}
+	else
+	{
+		setLeafPrefix(page, NULL, 0);
+	}
+
+	offset_t off = getLeafEnd(page);
+	for (size_t i = from; i < to; ++i)
+	{
+		byte* p = base + items[i];
+		if (plen > 0 && ((i - from) & 0x1) == 0)
+		{
+			size_t size = getItemLocalDataSize(p) - plen;
+			off -= sizeof(OnPageItemHeader) + size;
+			byte* dst = (byte*)page + off;
+			*(size_t*)dst = 0;
+			setItemType(dst, ItemType::OnPage);
+			setItemLocalDataSize(dst, size);
+			memcpy(dst + sizeof(OnPageItemHeader), (byte*)getItemLocalData(p) + plen, size);
+		}
+		else
+		{
+			size_t size = getItemSizeOnPage(p);
+			off -= size;
+			memcpy((byte*)page + off, p, size);
+		}
+		setLeafItemOffset(page, i - from, off);
+		if (((i - from) & 0x1) == 0)
+		{
+			setKeyHead(page, i - from);
+		}
+	}
+	setLeafItemCount(page, to - from);
+	setLeafOffset(page, off);
+}
+
 void BTree::compactInternalPage(void* page)
 {
 	data_buf_->clear();
@@ -817,31 +1926,275 @@ void BTree::compactInternalPage(void* page)
 }
 
 void BTree::remove(const void* key, size_t ksize)
+{
+	store_->lock();
+	++version_;
+	erase(key, ksize);
+	unlatchAll();
+	store_->unlock();
+}
+
+void BTree::erase(const void* key, size_t ksize)
 {
 	page_id_t page_id;
 	uint32_t i;
-	bool found = rec_search(key, ksize, &page_id, &i);
-	if (!found)
+	if (rec_search(key, ksize, &page_id, &i))
 	{
-		return;
+		removeItem(page_id, i);
 	}
-	removeItem(page_id, i);
 }
 
-void BTree::removeItem(page_id_t page_id, uint32_t index)
+// Removes the pair at index from a leaf that ends path_. Returns true if
+// the leaf underflowed, in which case pages may have been merged.
+bool BTree::removeItem(page_id_t page_id, uint32_t index)
 {
-	void* page = store_->getPage(page_id);
+	void* page = writePage(page_id);
 	setLeafItemCount(page, getLeafItemCount(page)-2);
 	size_t n = getLeafItemCount(page);
 	for (uint32_t i = index; i < n; ++i)
 	{
-		setLeafItemOffset(page, i, getLeafItemOffset(page, i+2));
+		getLeafSlots(page)[i] = getLeafSlots(page)[i+2];
 	}
 	compactLeafPage(page);
+
+	bool underflow = isUnderflow(page);
+	rebalanceLeaf(page_id);
+	return underflow;
+}
+
+// Payload bytes in use on a page, slots included. A page underflows
+// below a quarter of its payload space; min_items keeps any item small
+// enough that two underfull pages always fit in one.
+size_t BTree::getUsedSpace(void* page)
+{
+	return getPayloadSpace(page) - getPageSpace(page);
+}
+
+size_t BTree::getPayloadSpace(void* page)
+{
+	if (getPageType(page) == BTreePageType::Internal)
+	{
+		return page_size_ - sizeof(InternalPageHeader);
+	}
+	return page_size_ - sizeof(LeafPageHeader) - (prefix_keys_ ? sizeof(uint32_t) : 0);
+}
+
+bool BTree::isUnderflow(void* page)
+{
+	return (getUsedSpace(page) << 2) < getPayloadSpace(page);
+}
+
+// Index of child page_id in parent_page, or the item count plus one.
+uint32_t BTree::findChild(void* parent_page, page_id_t page_id)
+{
+	size_t n = getInternalItemCount(parent_page);
+	uint32_t index = 0;
+	while (index <= n && getChild(parent_page, index) != page_id)
+	{
+		++index;
+	}
+	return index;
+}
+
+// Drops separator index and the child left of it from an internal page.
+// Callers first point child index+1 at whatever replaces both children.
+void BTree::removeInternalItem(void* page, uint32_t index)
+{
+	size_t n = getInternalItemCount(page);
+	for (uint32_t i = index; i + 1 < n; ++i)
+	{
+		getInternalSlots(page)[i] = getInternalSlots(page)[i+1];
+	}
+	setInternalItemCount(page, n-1);
+	compactInternalPage(page);
+}
+
+// Puts child and the separator item right of it at index; the page must
+// have room for them.
+void BTree::insertInternalAt(void* page, uint32_t index, page_id_t child,
+							const byte* item, size_t size)
+{
+	size_t n = getInternalItemCount(page);
+	for (uint32_t i = n; i > index; --i)
+	{
+		getInternalSlots(page)[i] = getInternalSlots(page)[i-1];
+	}
+	setInternalItemCount(page, n+1);
+	setInternalOffset(page, getInternalOffset(page) - size - sizeof(page_id_t));
+	setInternalItemOffset(page, index, getInternalOffset(page));
+	byte* dst = (byte*)page + getInternalOffset(page);
+	memcpy(dst, &child, sizeof(page_id_t));
+	memcpy(dst + sizeof(page_id_t), item, size);
+	setKeyHead(page, index);
+}
+
+// Called after a pair left page_id. An underfull leaf is merged with a
+// sibling under the same parent when the two fit in one page; otherwise
+// the pairs of both are split evenly between them.
+void BTree::rebalanceLeaf(page_id_t page_id)
+{
+	void* page = store_->getPage(page_id);
+	if (path_.size() < 2 || !isUnderflow(page))
+	{
+		return;
+	}
+	page_id_t parent = getPathParent(0);
+
+	void* parent_page = store_->getPage(parent);
+	size_t n = getInternalItemCount(parent_page);
+	uint32_t index = findChild(parent_page, page_id);
+	if (index > n)
+	{
+		return;
+	}
+	if (n == 0)
+	{
+		rebalanceInternal(1);
+		return;
+	}
+
+	uint32_t s = (index < n) ? index : index - 1;
+	page_id_t lid = getChild(parent_page, s);
+	page_id_t rid = getChild(parent_page, s+1);
+	void* left = store_->getPage(lid);
+	void* right = store_->getPage(rid);
+
+	// work from full keys so both pages can be rewritten in place
+	std::vector<size_t> items;
+	leaf_buf_->clear();
+	expandLeaf(left, &items);
+	expandLeaf(right, &items);
+	byte* base = leaf_buf_->getBuffer();
+
+	if (getLeafSize(items, 0, items.size(), page_size_) <= page_size_)
+	{
+		left = writePage(lid);
+		rebuildLeaf(left, items, 0, items.size(), page_size_);
+		page_id_t next = getLeafNext(right);
+		setLeafNext(left, next);
+		if (next != 0)
+		{
+			setLeafPrev(writePage(next), lid);
+		}
+
+		parent_page = writePage(parent);
+		setChild(parent_page, s+1, lid);
+		removeInternalItem(parent_page, s);
+		freePage(rid);
+		rebalanceInternal(1);
+		return;
+	}
+
+	// first pair boundary at which the left side holds half the bytes
+	size_t total = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		total += getItemSizeOnPage(base + items[i]) + sizeof(offset_t);
+	}
+	size_t k = 0;
+	size_t used = 0;
+	while (k + 2 < items.size() && (used << 1) < total)
+	{
+		used += getItemSizeOnPage(base + items[k]) + getItemSizeOnPage(base + items[k+1])
+			+ (sizeof(offset_t) << 1);
+		k += 2;
+	}
+	if (k == 0 || getLeafSize(items, 0, k, page_size_) > page_size_
+		|| getLeafSize(items, k, items.size(), page_size_) > page_size_)
+	{
+		return;
+	}
+
+	// the separator changes size; give up if the parent cannot take it
+	byte* old_sep = (byte*)parent_page + getInternalItemOffset(parent_page, s) + sizeof(page_id_t);
+	const byte* sep;
+	size_t sep_size = getSeparator(base + items[k-2], base + items[k], &sep);
+	if (sep_size > getPageSpace(parent_page) + getItemSizeOnPage(old_sep))
+	{
+		return;
+	}
+
+	rebuildLeaf(writePage(lid), items, 0, k, page_size_);
+	rebuildLeaf(writePage(rid), items, k, items.size(), page_size_);
+
+	parent_page = writePage(parent);
+	removeInternalItem(parent_page, s);
+	insertInternalAt(parent_page, s, lid, sep, sep_size);
+}
+
+// Called after a separator left the page level steps above the leaf on
+// path_. An internal root left with a single child hands the root to
+// that child. Any other underfull internal page is merged with a sibling
+// when the two, with the separator between them, fit in one page.
+void BTree::rebalanceInternal(size_t level)
+{
+	page_id_t page_id = path_[path_.size() - 1 - level];
+	void* page = store_->getPage(page_id);
+	if (path_.size() - 1 == level)
+	{
+		if (getInternalItemCount(page) == 0)
+		{
+			setRootId(getLastChild(page));
+			freePage(page_id);
+		}
+		return;
+	}
+	if (!isUnderflow(page))
+	{
+		return;
+	}
+
+	page_id_t parent = getPathParent(level);
+	void* parent_page = store_->getPage(parent);
+	size_t n = getInternalItemCount(parent_page);
+	uint32_t index = findChild(parent_page, page_id);
+	if (index > n)
+	{
+		return;
+	}
+	if (n == 0)
+	{
+		rebalanceInternal(level + 1);
+		return;
+	}
+
+	uint32_t s = (index < n) ? index : index - 1;
+	page_id_t lid = getChild(parent_page, s);
+	page_id_t rid = getChild(parent_page, s+1);
+	void* left = store_->getPage(lid);
+	void* right = store_->getPage(rid);
+	byte* sep = (byte*)parent_page + getInternalItemOffset(parent_page, s) + sizeof(page_id_t);
+	size_t sep_size = getItemSizeOnPage(sep);
+	if (getUsedSpace(left) + getUsedSpace(right) + sep_size + sizeof(page_id_t)
+		+ sizeof(offset_t) > getPayloadSpace(left))
+	{
+		return;
+	}
+
+	// the separator comes down between the two halves
+	left = writePage(lid);
+	size_t ln = getInternalItemCount(left);
+	insertInternalAt(left, ln, getLastChild(left), sep, sep_size);
+	size_t rn = getInternalItemCount(right);
+	for (uint32_t i = 0; i < rn; ++i)
+	{
+		byte* item = (byte*)right + getInternalItemOffset(right, i);
+		insertInternalAt(left, ln + 1 + i, *(page_id_t*)item, item + sizeof(page_id_t),
+						getItemSizeOnPage(item + sizeof(page_id_t)));
+	}
+	setLastChild(left, getLastChild(right));
+
+	parent_page = writePage(parent);
+	setChild(parent_page, s+1, lid);
+	removeInternalItem(parent_page, s);
+	freePage(rid);
+	rebalanceInternal(level + 1);
 }
 
 void BTree::traverse(Iterator* iter)
 {
+	store_->lock();
+
 	page_id_t pid = store_->getRootId();
 	void* page = store_->getPage(pid);
 	while(getPageType(page) == BTreePageType::Internal)
@@ -868,12 +2221,1223 @@ void BTree::traverse(Iterator* iter)
 		}
 		else
 		{
+			store_->releasePages();
 			page = store_->getPage(pid);
 		}
 	}
 
 	deletePtr(kbuf);
 	deletePtr(vbuf);
+
+	store_->unlock();
+}
+
+// Pairs copied out of a leaf are kept in a buffer as their sizes, each a
+// size_t, followed by key and value.
+static void appendPair(Buffer* out, const void* key, size_t ksize, const void* val, size_t vsize)
+{
+	out->append(&ksize, sizeof(ksize));
+	out->append(key, ksize);
+	out->append(&vsize, sizeof(vsize));
+	out->append(val, vsize);
+}
+
+static void deliverPairs(Buffer* pairs, Iterator* sink)
+{
+	const byte* p = pairs->getBuffer();
+	const byte* end = p + pairs->getSize();
+	while (p < end)
+	{
+		size_t ksize, vsize;
+		memcpy(&ksize, p, sizeof(ksize));
+		const byte* key = p + sizeof(ksize);
+		memcpy(&vsize, key + ksize, sizeof(vsize));
+		const byte* val = key + ksize + sizeof(vsize);
+		sink->process(key, ksize, val, vsize);
+		p = val + vsize;
+	}
+}
+
+// Collects the pairs of the ranges of an ordered traverse, a leaf's
+// worth at a time, and hands them over range by range in key order.
+// Scanning runs at most window ranges ahead of the one being handed
+// over, and a range holds at most depth leaves waiting to be handed
+// over, so a slow consumer bounds what is read ahead.
+class ScanQueue {
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::vector<std::deque<Buffer*> > chunks_;
+	std::vector<bool> done_;
+	size_t next_;
+	size_t delivered_;
+	size_t window_;
+	size_t depth_;
+
+public:
+	ScanQueue(size_t ranges, size_t window, size_t depth):
+		chunks_(ranges), done_(ranges, false), next_(0), delivered_(0),
+		window_(window), depth_(depth) {}
+
+	~ScanQueue()
+	{
+		for (size_t r = 0; r < chunks_.size(); ++r)
+		{
+			for (size_t i = 0; i < chunks_[r].size(); ++i)
+			{
+				delete chunks_[r][i];
+			}
+		}
+	}
+
+	// The next range to scan, or false once all are taken.
+	bool take(size_t* range)
+	{
+		std::unique_lock<std::mutex> guard(mutex_);
+		cond_.wait(guard, [this]() {
+			return next_ >= chunks_.size() || next_ < delivered_ + window_;
+		});
+		if (next_ >= chunks_.size())
+		{
+			return false;
+		}
+		*range = next_++;
+		return true;
+	}
+
+	// Waits while range already holds depth chunks. The range being
+	// handed over always drains, and the ones behind it get their turn.
+	void push(size_t range, Buffer* chunk)
+	{
+		std::unique_lock<std::mutex> guard(mutex_);
+		cond_.wait(guard, [this, range]() {
+			return chunks_[range].size() < depth_;
+		});
+		chunks_[range].push_back(chunk);
+		cond_.notify_all();
+	}
+
+	void finish(size_t range)
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		done_[range] = true;
+		cond_.notify_all();
+	}
+
+	// The next chunk of range, NULL once the range is used up.
+	Buffer* pop(size_t range)
+	{
+		std::unique_lock<std::mutex> guard(mutex_);
+		cond_.wait(guard, [this, range]() {
+			return !chunks_[range].empty() || done_[range];
+		});
+		if (chunks_[range].empty())
+		{
+			delivered_ = range + 1;
+			cond_.notify_all();
+			return NULL;
+		}
+		Buffer* chunk = chunks_[range].front();
+		chunks_[range].pop_front();
+		cond_.notify_all();
+		return chunk;
+	}
+};
+
+// Hands every pair to iter in key order, like traverse, with threads
+// workers scanning ranges of the tree ahead of the calling thread, which
+// delivers. The pairs are those of the moment each leaf is read: pairs
+// written meanwhile may or may not show up.
+void BTree::traverse(Iterator* iter, size_t threads)
+{
+	threads = max(threads, (size_t)1);
+	ScanRange all;
+	all.has_start_ = false;
+	all.has_end_ = false;
+	std::vector<ScanRange> ranges;
+	partition(all, threads * scan_parts, &ranges);
+
+	ScanQueue queue(ranges.size(), threads * 2, scan_queued_leaves);
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([this, &queue, &ranges]() {
+			size_t r;
+			while (queue.take(&r))
+			{
+				scanRange(ranges[r], NULL, &queue, r);
+				queue.finish(r);
+			}
+		}));
+	}
+
+	for (size_t r = 0; r < ranges.size(); ++r)
+	{
+		Buffer* chunk;
+		while ((chunk = queue.pop(r)) != NULL)
+		{
+			deliverPairs(chunk, iter);
+			delete chunk;
+		}
+	}
+	for (size_t t = 0; t < workers.size(); ++t)
+	{
+		workers[t].join();
+	}
+}
+
+// Scans [start, end) with threads workers; start or end NULL leaves that
+// side open. The range is cut into pieces at separators of the upper
+// levels, which the workers take one at a time; worker t hands the pairs
+// of its pieces to sinks[t], in key order within a piece. No lock or
+// latch is held while a sink runs.
+void BTree::scan(const void* start, size_t ssize, const void* end, size_t esize,
+				Iterator** sinks, size_t threads)
+{
+	threads = max(threads, (size_t)1);
+	ScanRange range;
+	range.has_start_ = (start != NULL);
+	range.has_end_ = (end != NULL);
+	if (start)
+	{
+		range.start_.assign((const char*)start, ssize);
+	}
+	if (end)
+	{
+		range.end_.assign((const char*)end, esize);
+	}
+	std::vector<ScanRange> ranges;
+	partition(range, threads * scan_parts, &ranges);
+
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < threads; ++t)
+	{
+		Iterator* sink = sinks[t];
+		workers.push_back(std::thread([this, &next, &ranges, sink]() {
+			size_t r;
+			while ((r = next.fetch_add(1)) < ranges.size())
+			{
+				scanRange(ranges[r], sink, NULL, r);
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); ++t)
+	{
+		workers[t].join();
+	}
+}
+
+// Cuts range into about parts ranges at separators, taken level by level
+// from the root down until there are enough. Leaves are never read.
+void BTree::partition(const ScanRange& range, size_t parts, std::vector<ScanRange>* ranges)
+{
+	std::vector<std::string> seps;
+	std::vector<std::string> page_seps;
+	Buffer buf;
+
+	store_->lock();
+	std::vector<page_id_t> level(1, store_->getRootId());
+	while (seps.size() + 1 < parts && !level.empty() &&
+		getPageType(store_->getPage(level[0])) == BTreePageType::Internal)
+	{
+		std::vector<page_id_t> below;
+		for (size_t p = 0; p < level.size(); ++p)
+		{
+			void* page = store_->getPage(level[p]);
+			uint32_t n = getInternalItemCount(page);
+			page_seps.resize(n);
+			for (uint32_t i = 0; i < n; ++i)
+			{
+				getItem(page, i, &buf);
+				page_seps[i].assign((const char*)buf.getBuffer(), buf.getSize());
+			}
+			// child i holds the keys from separator i-1 up to separator i
+			for (uint32_t i = 0; i <= n; ++i)
+			{
+				bool above_start = (i == n || !range.has_start_ ||
+					compareKeys(page_seps[i].data(), page_seps[i].size(),
+								range.start_.data(), range.start_.size()) > 0);
+				bool below_end = (i == 0 || !range.has_end_ ||
+					compareKeys(page_seps[i-1].data(), page_seps[i-1].size(),
+								range.end_.data(), range.end_.size()) < 0);
+				if (above_start && below_end)
+				{
+					below.push_back(getChild(page, i));
+					if (i < n && (!range.has_end_ ||
+						compareKeys(page_seps[i].data(), page_seps[i].size(),
+									range.end_.data(), range.end_.size()) < 0))
+					{
+						seps.push_back(page_seps[i]);
+					}
+				}
+			}
+			store_->releasePages();
+		}
+		level.swap(below);
+	}
+	store_->unlock();
+
+	std::sort(seps.begin(), seps.end(), [this](const std::string& a, const std::string& b) {
+		return compareKeys(a.data(), a.size(), b.data(), b.size()) < 0;
+	});
+
+	// every range ends where the next starts
+	ScanRange part = range;
+	size_t cuts = min(seps.size(), parts - 1);
+	for (size_t c = 0; c < cuts; ++c)
+	{
+		part.end_ = seps[(c + 1) * seps.size() / (cuts + 1)];
+		part.has_end_ = true;
+		ranges->push_back(part);
+		part.start_ = part.end_;
+		part.has_start_ = true;
+	}
+	part.end_ = range.end_;
+	part.has_end_ = range.has_end_;
+	ranges->push_back(part);
+}
+
+// Hands the pairs of range to sink a leaf at a time, or with sink NULL
+// queues each leaf's pairs as range r of queue; each leaf is found from
+// the root again, from the separator bounding the one before.
+void BTree::scanRange(const ScanRange& range, Iterator* sink, ScanQueue* queue, size_t r)
+{
+	Buffer from;
+	Buffer pairs;
+	from.append(range.start_.data(), range.start_.size());
+	bool has_from = range.has_start_;
+	bool more = true;
+	while (more)
+	{
+		Buffer* out = (sink ? &pairs : new Buffer());
+		if (!concurrent_ || !sharedScanLeaf(&from, has_from, range, out, &more))
+		{
+			scanLeaf(&from, has_from, range, out, &more);
+		}
+		has_from = true;
+		if (sink)
+		{
+			deliverPairs(out, sink);
+		}
+		else if (out->getSize() > 0)
+		{
+			queue->push(r, out);
+		}
+		else
+		{
+			delete out;
+		}
+	}
+}
+
+// Copies the pairs of the leaf from belongs in, from there on and below
+// the end of range, to out; with has_from false the first leaf is read
+// whole. more tells whether the range goes on past the leaf, and from
+// then holds the separator the next leaf starts at.
+void BTree::scanLeaf(Buffer* from, bool has_from, const ScanRange& range,
+					Buffer* out, bool* more)
+{
+	Buffer fence;
+	Buffer key;
+	Buffer val;
+	bool bounded = false;
+	out->clear();
+
+	store_->lock();
+
+	page_id_t cur = store_->getRootId();
+	void* page = store_->getPage(cur);
+	uint32_t i;
+	while (getPageType(page) == BTreePageType::Internal)
+	{
+		i = 0;
+		if (has_from && search(page, from->getBuffer(), from->getSize(), &i))
+		{
+			++i;
+		}
+		if (i < getInternalItemCount(page))
+		{
+			getItem(page, i, &fence);
+			bounded = true;
+		}
+		cur = getChild(page, i);
+		page = store_->getPage(cur);
+	}
+
+	i = 0;
+	if (has_from)
+	{
+		search(page, from->getBuffer(), from->getSize(), &i);
+	}
+	bool ended = false;
+	for (; i < getLeafItemCount(page); i += 2)
+	{
+		getItem(page, i, &key);
+		if (range.has_end_ && compareKeys(key.getBuffer(), key.getSize(),
+										range.end_.data(), range.end_.size()) >= 0)
+		{
+			ended = true;
+			break;
+		}
+		getItem(page, i+1, &val);
+		appendPair(out, key.getBuffer(), key.getSize(), val.getBuffer(), val.getSize());
+	}
+
+	store_->unlock();
+
+	*more = (!ended && bounded && (!range.has_end_ ||
+		compareKeys(fence.getBuffer(), fence.getSize(),
+					range.end_.data(), range.end_.size()) < 0));
+	if (*more)
+	{
+		from->clear();
+		from->append(fence.getBuffer(), fence.getSize());
+	}
+}
+
+// scanLeaf without the storage lock, latching pages as sharedGet does.
+// Returns false if it kept being turned away and should be run under
+// the lock instead.
+bool BTree::sharedScanLeaf(Buffer* from, bool has_from, const ScanRange& range,
+						Buffer* out, bool* more)
+{
+	Buffer scratch;
+	Buffer fence;
+	Buffer item;
+	Buffer key;
+	Buffer val;
+	SearchState state(&scratch);
+	for (uint32_t attempt = 0; attempt < max_shared_attempts; ++attempt)
+	{
+		if (state.missed_)
+		{
+			if (store_->pin(state.miss_))
+			{
+				store_->unpin(state.miss_);
+			}
+			state.missed_ = false;
+		}
+		else if (attempt > 0)
+		{
+			std::this_thread::yield();
+		}
+
+		bool bounded = false;
+		out->clear();
+		page_id_t cur = root_.load(std::memory_order_acquire);
+		void* page = latchPage(cur, &state);
+		if (page && cur != root_.load(std::memory_order_acquire))
+		{
+			unlatchPage(cur);
+			continue;
+		}
+
+		uint32_t i;
+		while (page && getPageType(page) == BTreePageType::Internal)
+		{
+			i = 0;
+			if (has_from && search(page, from->getBuffer(), from->getSize(), &i, &state))
+			{
+				++i;
+			}
+			if (!state.missed_ && i < getInternalItemCount(page))
+			{
+				bounded = readCached(getItemPointer(page, i), &fence, &state);
+			}
+			void* child_page = NULL;
+			page_id_t child = 0;
+			if (!state.missed_)
+			{
+				child = getChild(page, i);
+				child_page = latchPage(child, &state);
+			}
+			unlatchPage(cur);
+			page = child_page;
+			cur = child;
+		}
+		if (page == NULL)
+		{
+			continue;
+		}
+
+		i = 0;
+		if (has_from)
+		{
+			search(page, from->getBuffer(), from->getSize(), &i, &state);
+		}
+		const byte* prefix;
+		size_t plen = getLeafPrefix(page, &prefix);
+		bool ended = false;
+		for (; !state.missed_ && i < getLeafItemCount(page); i += 2)
+		{
+			if (!readCached(getItemPointer(page, i), &item, &state))
+			{
+				break;
+			}
+			key.clear();
+			key.append(prefix, plen);
+			key.append(item.getBuffer(), item.getSize());
+			if (range.has_end_ && compareKeys(key.getBuffer(), key.getSize(),
+											range.end_.data(), range.end_.size()) >= 0)
+			{
+				ended = true;
+				break;
+			}
+			if (!readCached(getItemPointer(page, i+1), &val, &state))
+			{
+				break;
+			}
+			appendPair(out, key.getBuffer(), key.getSize(), val.getBuffer(), val.getSize());
+		}
+		unlatchPage(cur);
+
+		if (!state.missed_)
+		{
+			*more = (!ended && bounded && (!range.has_end_ ||
+				compareKeys(fence.getBuffer(), fence.getSize(),
+							range.end_.data(), range.end_.size()) < 0));
+			if (*more)
+			{
+				from->clear();
+				from->append(fence.getBuffer(), fence.getSize());
+			}
+			return true;
+		}
+	}
+	out->clear();
+	return false;
+}
+
+Cursor* BTree::newCursor()
+{
+	return new Cursor(this);
+}
+
+Cursor::Cursor(BTree* tree):
+	tree_(tree), store_(tree->store_), index_(0), version_(0), valid_(false),
+	key_(NULL), val_(NULL), start_(NULL), end_(NULL),
+	has_start_(false), has_end_(false)
+{
+	key_ = new Buffer();
+	val_ = new Buffer();
+	start_ = new Buffer();
+	end_ = new Buffer();
+}
+
+Cursor::~Cursor()
+{
+	leaf_.reset();
+	deletePtr(key_);
+	deletePtr(val_);
+	deletePtr(start_);
+	deletePtr(end_);
+}
+
+// Limits the cursor to keys in [start, end); a NULL bound is open.
+void Cursor::setRange(const void* start, size_t ssize, const void* end, size_t esize)
+{
+	has_start_ = (start != NULL);
+	start_->clear();
+	if (has_start_)
+	{
+		start_->append(start, ssize);
+	}
+	has_end_ = (end != NULL);
+	end_->clear();
+	if (has_end_)
+	{
+		end_->append(end, esize);
+	}
+	invalidate();
+}
+
+void Cursor::invalidate()
+{
+	valid_ = false;
+	leaf_.reset();
+}
+
+void Cursor::moveTo(page_id_t page_id, uint32_t index)
+{
+	leaf_ = PageHandle(store_, page_id);
+	index_ = index;
+	valid_ = leaf_.valid();
+}
+
+// Finds the first pair whose key is not less than key.
+void Cursor::position(const void* key, size_t ksize)
+{
+	page_id_t page_id;
+	uint32_t index;
+	tree_->rec_search(key, ksize, &page_id, &index);
+	moveTo(page_id, index);
+	skipForward();
+}
+
+void Cursor::skipForward()
+{
+	while (valid_ && index_ >= getLeafItemCount(leaf_.get()))
+	{
+		page_id_t next = getLeafNext(leaf_.get());
+		if (next == 0)
+		{
+			invalidate();
+			return;
+		}
+		moveTo(next, 0);
+	}
+}
+
+void Cursor::stepBack()
+{
+	while (valid_)
+	{
+		if (index_ >= 2)
+		{
+			index_ -= 2;
+			return;
+		}
+		page_id_t prev = getLeafPrev(leaf_.get());
+		if (prev == 0)
+		{
+			invalidate();
+			return;
+		}
+		moveTo(prev, 0);
+		if (valid_)
+		{
+			index_ = getLeafItemCount(leaf_.get());
+		}
+	}
+}
+
+// Copies out the pair under the cursor, or invalidates it when the pair
+// lies outside the range.
+void Cursor::load()
+{
+	if (!valid_)
+	{
+		return;
+	}
+	tree_->getItem(leaf_.get(), index_, key_);
+	tree_->getItem(leaf_.get(), index_ + 1, val_);
+	version_ = tree_->version_;
+	if ((has_end_ && tree_->compareKeys(key_->getBuffer(), key_->getSize(),
+								end_->getBuffer(), end_->getSize()) >= 0)
+		|| (has_start_ && tree_->compareKeys(key_->getBuffer(), key_->getSize(),
+								start_->getBuffer(), start_->getSize()) < 0))
+	{
+		invalidate();
+	}
+}
+
+void Cursor::seek(const void* key, size_t ksize)
+{
+	store_->lock();
+	if (has_start_ && tree_->compareKeys(key, ksize, start_->getBuffer(), start_->getSize()) < 0)
+	{
+		key = start_->getBuffer();
+		ksize = start_->getSize();
+	}
+	position(key, ksize);
+	load();
+	store_->unlock();
+}
+
+void Cursor::seekToFirst()
+{
+	if (has_start_)
+	{
+		seek(start_->getBuffer(), start_->getSize());
+		return;
+	}
+
+	store_->lock();
+	page_id_t pid = store_->getRootId();
+	void* page = store_->getPage(pid);
+	while (getPageType(page) == BTreePageType::Internal)
+	{
+		pid = tree_->getChild(page, 0);
+		page = store_->getPage(pid);
+	}
+	moveTo(pid, 0);
+	skipForward();
+	load();
+	store_->unlock();
+}
+
+void Cursor::seekToLast()
+{
+	store_->lock();
+	if (has_end_)
+	{
+		position(end_->getBuffer(), end_->getSize());
+	}
+	else
+	{
+		valid_ = false;
+	}
+	if (!valid_)
+	{
+		page_id_t pid = store_->getRootId();
+		void* page = store_->getPage(pid);
+		while (getPageType(page) == BTreePageType::Internal)
+		{
+			pid = getLastChild(page);
+			page = store_->getPage(pid);
+		}
+		moveTo(pid, getLeafItemCount(page));
+	}
+	stepBack();
+	load();
+	store_->unlock();
+}
+
+void Cursor::next()
+{
+	if (!valid_)
+	{
+		return;
+	}
+
+	store_->lock();
+	if (version_ != tree_->version_)
+	{
+		position(key_->getBuffer(), key_->getSize());
+		if (valid_ && tree_->compare(leaf_.get(), index_,
+									key_->getBuffer(), key_->getSize()) == 0)
+		{
+			index_ += 2;
+			skipForward();
+		}
+	}
+	else
+	{
+		index_ += 2;
+		skipForward();
+	}
+	load();
+	store_->unlock();
+}
+
+void Cursor::prev()
+{
+	if (!valid_)
+	{
+		return;
+	}
+
+	store_->lock();
+	if (version_ != tree_->version_)
+	{
+		position(key_->getBuffer(), key_->getSize());
+		if (!valid_)
+		{
+			seekToLast();
+			store_->unlock();
+			return;
+		}
+	}
+	stepBack();
+	load();
+	store_->unlock();
+}
+
+// Streams the records of one spilled run back in order.
+class BulkLoader::RunReader {
+private:
+	File file_;
+	file_offset_t off_;
+	byte* buf_;
+	size_t used_;
+	size_t pos_;
+	Buffer* rec_;
+	size_t run_;
+
+	bool read(size_t size);
+
+public:
+	RunReader(const std::string& name, size_t run);
+	~RunReader();
+
+	bool open();
+	bool next();
+
+	inline size_t getRun() { return run_; }
+	inline size_t keySize() { return ((RecordHeader*)rec_->getBuffer())->ksize_; }
+	inline size_t valueSize() { return ((RecordHeader*)rec_->getBuffer())->vsize_; }
+	inline const byte* key() { return rec_->getBuffer() + sizeof(RecordHeader); }
+	inline const byte* value() { return key() + keySize(); }
+};
+
+BulkLoader::RunReader::RunReader(const std::string& name, size_t run):
+	file_(name.c_str()), off_(0), buf_(NULL), used_(0), pos_(0),
+	rec_(NULL), run_(run)
+{
+	buf_ = new byte[BulkLoader::run_buffer];
+	rec_ = new Buffer();
+}
+
+BulkLoader::RunReader::~RunReader()
+{
+	deleteArray(buf_);
+	deletePtr(rec_);
+}
+
+bool BulkLoader::RunReader::open()
+{
+	return file_.open();
+}
+
+// Appends the next size bytes of the run to rec_.
+bool BulkLoader::RunReader::read(size_t size)
+{
+	while (size > 0)
+	{
+		if (pos_ == used_)
+		{
+			used_ = file_.read(off_, buf_, BulkLoader::run_buffer);
+			off_ += used_;
+			pos_ = 0;
+			if (used_ == 0)
+			{
+				return false;
+			}
+		}
+		size_t n = min(size, used_ - pos_);
+		rec_->append(buf_ + pos_, n);
+		pos_ += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool BulkLoader::RunReader::next()
+{
+	rec_->clear();
+	if (!read(sizeof(RecordHeader)))
+	{
+		return false;
+	}
+	return read(keySize() + valueSize());
+}
+
+BulkLoader::BulkLoader(BTree* tree, double fill_factor, size_t sort_memory):
+	tree_(tree), store_(tree->store_), page_size_(tree->page_size_),
+	fill_factor_(fill_factor), sort_memory_(sort_memory),
+	records_(NULL), sorted_(true), failed_(false)
+{
+	if (fill_factor_ <= 0 || fill_factor_ > 1)
+	{
+		fill_factor_ = 1;
+	}
+	records_ = new Buffer();
+}
+
+BulkLoader::~BulkLoader()
+{
+	deletePtr(records_);
+	for (size_t i = 0; i < runs_.size(); ++i)
+	{
+		File(runs_[i].c_str()).remove();
+	}
+	for (size_t i = 0; i < open_.size(); ++i)
+	{
+		deleteArray(open_[i]);
+	}
+	for (size_t i = 0; i < staged_.size(); ++i)
+	{
+		deleteArray(staged_[i].second);
+	}
+	for (size_t i = 0; i < spare_.size(); ++i)
+	{
+		deleteArray(spare_[i]);
+	}
+}
+
+void BulkLoader::add(const void* key, size_t ksize, const void* val, size_t vsize)
+{
+	RecordHeader h;
+	h.ksize_ = ksize;
+	h.vsize_ = vsize;
+	if (!offsets_.empty() && records_->getSize() + sizeof(h) + ksize + vsize > sort_memory_
+		&& !spill())
+	{
+		// no room for runs on disk: keep sorting in memory
+		sort_memory_ = (size_t)-1;
+	}
+
+	offsets_.push_back(records_->getSize());
+	records_->append(&h, sizeof(h));
+	records_->append(key, ksize);
+	records_->append(val, vsize);
+	if (sorted_ && offsets_.size() > 1)
+	{
+		sorted_ = !lessRecord(offsets_.back(), offsets_[offsets_.size() - 2]);
+	}
+}
+
+bool BulkLoader::lessRecord(size_t a, size_t b)
+{
+	RecordHeader ha, hb;
+	memcpy(&ha, records_->getBuffer() + a, sizeof(ha));
+	memcpy(&hb, records_->getBuffer() + b, sizeof(hb));
+	return tree_->compareKeys(records_->getBuffer() + a + sizeof(ha), ha.ksize_,
+					records_->getBuffer() + b + sizeof(hb), hb.ksize_) < 0;
+}
+
+// Orders the current run by key, keeping only the last pair added for
+// each key. Input that arrived sorted is not sorted again.
+void BulkLoader::sortRun()
+{
+	if (!sorted_)
+	{
+		std::stable_sort(offsets_.begin(), offsets_.end(),
+			[this](size_t a, size_t b) { return lessRecord(a, b); });
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < offsets_.size(); ++i)
+	{
+		if (i + 1 < offsets_.size() && !lessRecord(offsets_[i], offsets_[i+1]))
+		{
+			continue;
+		}
+		offsets_[n++] = offsets_[i];
+	}
+	offsets_.resize(n);
+	sorted_ = true;
+}
+
+// Writes the current run, sorted, to a temporary file next to the
+// database. Returns false, keeping the run in memory, if the file
+// cannot be created.
+bool BulkLoader::spill()
+{
+	std::string name = std::string(store_->getFilename()) + "-sort" + std::to_string(runs_.size());
+	File f(name.c_str());
+	if (!f.create())
+	{
+		return false;
+	}
+
+	sortRun();
+	Buffer out;
+	file_offset_t off = 0;
+	for (size_t i = 0; i < offsets_.size(); ++i)
+	{
+		RecordHeader h;
+		memcpy(&h, records_->getBuffer() + offsets_[i], sizeof(h));
+		out.append(records_->getBuffer() + offsets_[i], sizeof(h) + h.ksize_ + h.vsize_);
+		if (out.getSize() >= BulkLoader::run_buffer || i + 1 == offsets_.size())
+		{
+			if (f.write(off, out.getBuffer(), out.getSize()) != out.getSize())
+			{
+				failed_ = true;
+			}
+			off += out.getSize();
+			out.clear();
+		}
+	}
+	f.close();
+	runs_.push_back(name);
+
+	records_->clear();
+	offsets_.clear();
+	return true;
+}
+
+// Merges the spilled runs into the tree. Among equal keys the one from
+// the latest run wins.
+bool BulkLoader::merge()
+{
+	auto after = [this](RunReader* a, RunReader* b) {
+		int32_t r = tree_->compareKeys(a->key(), a->keySize(), b->key(), b->keySize());
+		return r != 0 ? r > 0 : a->getRun() < b->getRun();
+	};
+	std::priority_queue<RunReader*, std::vector<RunReader*>, decltype(after)> heap(after);
+	bool ok = true;
+	for (size_t i = 0; i < runs_.size(); ++i)
+	{
+		RunReader* reader = new RunReader(runs_[i], i);
+		if (!reader->open())
+		{
+			ok = false;
+		}
+		if (ok && reader->next())
+		{
+			heap.push(reader);
+		}
+		else
+		{
+			delete reader;
+		}
+	}
+
+	Buffer last;
+	bool has_last = false;
+	while (!heap.empty())
+	{
+		RunReader* reader = heap.top();
+		heap.pop();
+		if (ok && (!has_last || tree_->compareKeys(reader->key(), reader->keySize(),
+										last.getBuffer(), last.getSize()) != 0))
+		{
+			addPair(reader->key(), reader->keySize(), reader->value(), reader->valueSize());
+			last.clear();
+			last.append(reader->key(), reader->keySize());
+			has_last = true;
+		}
+		if (reader->next())
+		{
+			heap.push(reader);
+		}
+		else
+		{
+			delete reader;
+		}
+	}
+
+	for (size_t i = 0; i < runs_.size(); ++i)
+	{
+		File(runs_[i].c_str()).remove();
+	}
+	runs_.clear();
+	return ok;
+}
+
+// Sorts whatever is left, builds the tree from everything added and
+// makes it the root. Returns false, leaving the tree untouched, if the
+// tree was not empty or a run could not be written or read back.
+bool BulkLoader::finish()
+{
+	store_->lock();
+
+	page_id_t old_root = store_->getRootId();
+	void* root = store_->getPage(old_root);
+	if (getPageType(root) != BTreePageType::Leaf || getLeafItemCount(root) != 0)
+	{
+		store_->unlock();
+		return false;
+	}
+
+	if (!runs_.empty() && !offsets_.empty() && !spill())
+	{
+		failed_ = true;
+	}
+	bool ok = !failed_;
+	if (runs_.empty())
+	{
+		sortRun();
+		for (size_t i = 0; i < offsets_.size(); ++i)
+		{
+			RecordHeader h;
+			memcpy(&h, records_->getBuffer() + offsets_[i], sizeof(h));
+			const byte* key = records_->getBuffer() + offsets_[i] + sizeof(h);
+			addPair(key, h.ksize_, key + h.ksize_, h.vsize_);
+		}
+	}
+	else if (ok)
+	{
+		ok = merge();
+	}
+	records_->clear();
+	offsets_.clear();
+
+	if (ok && !open_.empty())
+	{
+		page_id_t root_id = finishLevels();
+		writeStaged();
+		// the new pages must be on disk before the header points at them
+		store_->syncFile();
+		tree_->setRootId(root_id);
+		tree_->freePage(old_root);
+		++tree_->version_;
+	}
+
+	tree_->unlatchAll();
+	store_->unlock();
+	store_->commit();
+	return ok;
+}
+
+// Appends a pair to the open leaf, starting a new leaf once the fill
+// factor is reached. A new leaf's first key becomes its separator.
+void BulkLoader::addPair(const void* key, size_t ksize, const void* val, size_t vsize)
+{
+	size_t key_size = tree_->getItemSize(ksize);
+	size_t data_size = key_size + tree_->getItemSize(vsize);
+	size_t budget = (page_size_ - sizeof(LeafPageHeader)) * fill_factor_;
+	page_id_t fresh = 0;
+	size_t sep_size = ksize;
+
+	if (open_.empty())
+	{
+		open_.push_back(newPage(store_->reservePage(), BTreePageType::Leaf));
+	}
+	else
+	{
+		byte* leaf = open_[0];
+		size_t n = getLeafItemCount(leaf);
+		size_t used = page_size_ - getLeafOffset(leaf) + n * sizeof(offset_t);
+		if (n > 0 && used + data_size + (sizeof(offset_t) << 1) > budget)
+		{
+			sep_size = tree_->getSeparatorSize(leaf + tree_->getLeafItemOffset(leaf, n-2), key, ksize);
+			fresh = store_->reservePage();
+			page_id_t prev = getLeafPageId(leaf);
+			closePage(0, fresh);
+			open_[0] = newPage(fresh, BTreePageType::Leaf);
+			setLeafPrev(open_[0], prev);
+		}
+	}
+
+	byte* leaf = open_[0];
+	size_t n = getLeafItemCount(leaf);
+	setLeafItemCount(leaf, n+2);
+	setLeafOffset(leaf, getLeafOffset(leaf)-data_size);
+	tree_->setLeafItemOffset(leaf, n, getLeafOffset(leaf));
+	tree_->setLeafItemOffset(leaf, n+1, getLeafOffset(leaf)+key_size);
+	tree_->writeItem(leaf + tree_->getLeafItemOffset(leaf, n), key, ksize);
+	tree_->writeItem(leaf + tree_->getLeafItemOffset(leaf, n+1), val, vsize);
+	tree_->setKeyHead(leaf, n);
+
+	if (fresh != 0)
+	{
+		const byte* sep = leaf + tree_->getLeafItemOffset(leaf, 0);
+		size_t ssize = getItemSizeOnPage(sep);
+		if (sep_size < ksize && tree_->isOnPage(sep_size))
+		{
+			ssize = tree_->buildSeparator(key, sep_size, &sep);
+		}
+		addChild(1, fresh, sep, ssize);
+	}
+}
+
+// Adds child to the open page of level, separated from its left sibling
+// by sep. A full page is closed and the separator moves up a level.
+void BulkLoader::addChild(size_t level, page_id_t child, const byte* sep, size_t ssize)
+{
+	byte* page = open_[level];
+	size_t n = getInternalItemCount(page);
+	size_t used = page_size_ - getInternalOffset(page) + n * sizeof(offset_t);
+	size_t need = sizeof(page_id_t) + ssize;
+	size_t budget = (page_size_ - sizeof(InternalPageHeader)) * fill_factor_;
+
+	if (n > 0 && used + need + sizeof(offset_t) > budget)
+	{
+		page_id_t fresh = store_->reservePage();
+		closePage(level, 0);
+		open_[level] = newPage(fresh, BTreePageType::Internal);
+		setLastChild(open_[level], child);
+		addChild(level + 1, fresh, sep, ssize);
+		return;
+	}
+
+	page_id_t left = getLastChild(page);
+	setInternalItemCount(page, n+1);
+	setInternalOffset(page, getInternalOffset(page)-need);
+	tree_->setInternalItemOffset(page, n, getInternalOffset(page));
+	memcpy(page + getInternalOffset(page), &left, sizeof(page_id_t));
+	memcpy(page + getInternalOffset(page) + sizeof(page_id_t), sep, ssize);
+	tree_->setKeyHead(page, n);
+	setLastChild(page, child);
+}
+
+// Hands the open page of level to the writer. Its parent is the open
+// page one level up, which is started here for the first page of a level.
+void BulkLoader::closePage(size_t level, page_id_t next)
+{
+	byte* page = open_[level];
+	if (level + 1 == open_.size())
+	{
+		byte* parent = newPage(store_->reservePage(), BTreePageType::Internal);
+		setLastChild(parent, getPageId(page));
+		open_.push_back(parent);
+	}
+
+	if (getPageType(page) == BTreePageType::Leaf)
+	{
+		setLeafNext(page, next);
+	}
+	open_[level] = NULL;
+	stagePage(page);
+}
+
+// Closes the remaining open pages bottom-up; the topmost is the root.
+page_id_t BulkLoader::finishLevels()
+{
+	size_t top = open_.size() - 1;
+	for (size_t level = 0; level < top; ++level)
+	{
+		closePage(level, 0);
+	}
+	page_id_t root_id = getPageId(open_[top]);
+	stagePage(open_[top]);
+	open_.clear();
+	return root_id;
+}
+
+byte* BulkLoader::newPage(page_id_t page_id, BTreePageType type)
+{
+	byte* page;
+	if (spare_.empty())
+	{
+		page = new byte[page_size_];
+	}
+	else
+	{
+		page = spare_.back();
+		spare_.pop_back();
+	}
+	zeroMemory(page, page_size_);
+	setPageType(page, type);
+	if (type == BTreePageType::Internal)
+	{
+		setInternalPageId(page, page_id);
+		setInternalOffset(page, page_size_);
+	}
+	else
+	{
+		setLeafPageId(page, page_id);
+		tree_->initLeaf(page);
+	}
+	return page;
+}
+
+void BulkLoader::stagePage(byte* page)
+{
+	staged_.push_back(std::make_pair(getPageId(page), page));
+	if (staged_.size() >= BulkLoader::write_batch)
+	{
+		writeStaged();
+	}
+}
+
+// Writes the staged pages in page order, then commits so that overflow
+// pages written through the cache so far are logged and may be evicted.
+void BulkLoader::writeStaged()
+{
+	std::sort(staged_.begin(), staged_.end());
+	std::vector<page_id_t> ids;
+	std::vector<void*> pages;
+	for (size_t i = 0; i < staged_.size(); ++i)
+	{
+		ids.push_back(staged_[i].first);
+		pages.push_back(staged_[i].second);
+	}
+	if (!ids.empty())
+	{
+		store_->writePages(&ids[0], &pages[0], ids.size());
+	}
+	for (size_t i = 0; i < staged_.size(); ++i)
+	{
+		spare_.push_back(staged_[i].second);
+	}
+	staged_.clear();
+
+	store_->commit();
+	store_->releasePages();
 }
 
 NAMESPACE_END
\ No newline at end of file
@@ -1,7 +1,12 @@
 #ifndef _BTREE_H_
 #define _BTREE_H_
 
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
 #include "common.h"
+#include "storage.h"
 
 NAMESPACE_BEGIN
 
@@ -12,10 +17,17 @@ enum BTreePageType {
 	Leaf = 1
 };
 
+// Pages do not know their parent; operations that climb the tree use
+// the path their descent left in BTree::path_. The field that used to
+// hold the parent is kept, unused, for the v1 page layout: dropping it
+// would move every later field and shrink InternalPageHeader from 32 to
+// 24 bytes (LeafPageHeader stays 32 either way), so internal pages of
+// existing files would no longer read without a format version bump and
+// a conversion in Storage::upgradeFile.
 struct InternalPageHeader {
 	BTreePageType type_;
 	page_id_t page_id_;
-	page_id_t parent_id_;
+	page_id_t unused_;
 	offset_t hoff_;
 	page_id_t last_child_id_;
 	size_t item_count_;
@@ -24,34 +36,161 @@ struct InternalPageHeader {
 struct LeafPageHeader {
 	BTreePageType type_;
 	page_id_t page_id_;
-	page_id_t parent_id_;
+	page_id_t unused_;
 	page_id_t prev_;
 	page_id_t next_;
 	offset_t hoff_;
 	size_t item_count_;
 };
 
-class Buffer;
-class Storage;
-
 typedef void (*iterfunc)(const void* data, size_t size);
 
+class Cursor;
+class WriteBatch;
+class ScanQueue;
+
+// Per-call scratch of a search. Lookups that run without the storage
+// lock carry their own, and as they must not wait for that lock while
+// holding latches they only read cached pages: a page that is not cached
+// is left in miss_ for the caller to load before it starts over.
+struct SearchState {
+	Buffer* buf_;
+	bool missed_;
+	page_id_t miss_;
+
+	SearchState(Buffer* buf): buf_(buf), missed_(false), miss_(0) {}
+};
+
+// One page on the path of a multiGet descent. Keys sorting below fence_,
+// a copy of the nearest separator bounding the page from above, belong
+// under it; fence_ is NULL where no separator bounds it.
+struct DescentStep {
+	page_id_t page_id_;
+	Buffer* fence_;
+};
+
+// A key range [start_, end_) of a parallel scan; a side whose has_ flag
+// is false is open.
+struct ScanRange {
+	std::string start_;
+	std::string end_;
+	bool has_start_;
+	bool has_end_;
+};
+
 class BTree : public DBInterface {
+private:
+	static const uint32_t latch_count = 1024;
+	static const uint32_t latch_exclusive = 0x80000000;
+	static const uint32_t latch_pending = 0x40000000;
+	static const uint32_t max_shared_attempts = 64;
+	// percent of the items a split from appends leaves on the left page
+	static const uint32_t append_split = 90;
+	// lookups of a multiGet in flight together, their pages prefetched
+	static const uint32_t multiget_group = 8;
+	// key ranges a parallel scan makes per thread, so threads done early
+	// take over work from the others
+	static const uint32_t scan_parts = 4;
+	// leaves an ordered traverse keeps queued per range before the worker
+	// scanning it waits for the caller to catch up
+	static const uint32_t scan_queued_leaves = 16;
+
 private:
 	Storage* store_;
 	size_t page_size_;
 	Buffer* data_buf_;
 	Buffer* cmp_buf_;
 	Buffer* split_buf_;
+	// expanded leaf items, while a leaf's prefix is being changed
+	Buffer* leaf_buf_;
+	// the separator a split or redistribution hands to the parent
+	Buffer* sep_buf_;
+	bool prefix_keys_;
+	KeyOrder key_order_;
+	KeyComparator comparator_;
+	// slots carry key heads; offsets are then the lower 16 bits
+	bool key_heads_;
+	offset_t offset_mask_;
+	// bumped by every put and remove; cursors reposition when it moves
+	uint64_t version_;
+	// concurrent reads: lookups latch the pages on their path instead of
+	// taking the storage lock. Pages hash to latch_count latches, each a
+	// reader count plus the exclusive and pending bits of the writer,
+	// which keeps the latches it takes in held_ until its operation ends.
+	bool concurrent_;
+	std::atomic<page_id_t> root_;
+	std::atomic<uint32_t>* latches_;
+	std::vector<uint32_t> held_;
+	// the rightmost leaf, or 0 if not known; put goes straight to it for
+	// keys at or past its first key
+	page_id_t last_leaf_;
+	// pages from the root down to the leaf of the last rec_search; splits
+	// and merges find parents here, and keep it current as pages move
+	std::vector<page_id_t> path_;
+
+	inline offset_t getLeafItemOffset(void* page, uint32_t index);
+	inline void setLeafItemOffset(void* page, uint32_t index, offset_t off);
+	inline offset_t getInternalItemOffset(void* page, uint32_t index);
+	inline void setInternalItemOffset(void* page, uint32_t index, offset_t off);
+	inline page_id_t getChild(void* page, uint32_t i);
+	inline void setChild(void* page, uint32_t i, page_id_t page_id);
+	inline byte* getItemPointer(void* page, uint32_t index);
+	void setKeyHead(void* page, uint32_t index);
+	uint32_t findChild(void* parent_page, page_id_t page_id);
+	inline page_id_t getPathParent(size_t level)
+	{
+		return path_[path_.size() - 2 - level];
+	}
+
+	inline std::atomic<uint32_t>& getLatch(page_id_t page_id)
+	{
+		return latches_[page_id & (latch_count - 1)];
+	}
+	bool tryLatchShared(page_id_t page_id);
+	void unlatchShared(page_id_t page_id);
+	void latchExclusive(page_id_t page_id);
+	void unlatchAll();
+	void* latchPage(page_id_t page_id, SearchState* state);
+	void unlatchPage(page_id_t page_id);
+	void* writePage(page_id_t page_id);
+	void freePage(page_id_t page_id);
+	void setRootId(page_id_t page_id);
+	bool sharedGet(const void* key, size_t ksize, Buffer* val, ValueView* view, bool* found);
 
 	void buildRootPage(BTreePageType type);
-	void get(const void* key, size_t ksize);
 	bool rec_search(const void* key, size_t ksize, page_id_t* page_id, uint32_t* index);
-	bool search(void* page, const void* key, size_t ksize, uint32_t* index);
+	bool searchForPut(const void* key, size_t ksize, page_id_t* page_id, uint32_t* index);
+	page_id_t findLeaf(const void* key, size_t ksize, Buffer* fence, bool* bounded);
+	page_id_t descend(const void* key, size_t ksize, std::vector<DescentStep>* steps,
+					std::vector<Buffer*>* fences);
+	bool isBelowFence(const DescentStep& step, const void* key, size_t ksize);
+	void partition(const ScanRange& range, size_t parts, std::vector<ScanRange>* ranges);
+	void scanRange(const ScanRange& range, Iterator* sink, ScanQueue* queue, size_t r);
+	void scanLeaf(Buffer* from, bool has_from, const ScanRange& range,
+				Buffer* out, bool* more);
+	bool sharedScanLeaf(Buffer* from, bool has_from, const ScanRange& range,
+				Buffer* out, bool* more);
+	bool search(void* page, const void* key, size_t ksize, uint32_t* index,
+				SearchState* state = NULL);
+	template<class T>
+	bool searchInteger(void* page, const void* key, int32_t step, int32_t right,
+						uint32_t* index, SearchState* state);
 	void getItem(page_id_t page_id, uint32_t index, Buffer* buf);
 	void getItem(void* page, uint32_t index, Buffer* buf);
+	void readItem(const byte* p, Buffer* buf);
+	void appendItem(const byte* p, Buffer* buf);
+	bool readCached(const byte* p, Buffer* buf, SearchState* state);
+	byte* findValue(const void* key, size_t ksize, page_id_t* page_id);
 	int32_t compare(void* page, uint32_t index, const void* key, size_t ksize);
+	int32_t compareItem(const byte* p, const void* key, size_t ksize,
+						SearchState* state = NULL);
+	inline int32_t compareKeys(const void* a, size_t asize, const void* b, size_t bsize)
+	{
+		return comparator_(a, asize, b, bsize);
+	}
 
+	void insert(const void* key, size_t ksize, const void* val, size_t vsize);
+	void erase(const void* key, size_t ksize);
 	bool modifyLeafItem(page_id_t page_id, uint32_t index, const void* val, size_t vsize);
 	bool insertLeafItem(page_id_t page_id, uint32_t index,
 						const void* key, size_t ksize,
@@ -59,24 +198,173 @@ private:
 	void insertInternalItem(page_id_t pid, page_id_t lid, page_id_t rid,
 						void* item, size_t size);
 
-	void splitLeaf(page_id_t page_id);
-	void splitInternal(page_id_t page_id);
+	void splitLeaf(page_id_t page_id, uint32_t index);
+	void splitInternal(size_t level, bool append);
+	size_t getInternalItemBytes(void* page, uint32_t index);
 	void compactLeafPage(void* page);
 	void compactInternalPage(void* page);
-	void removeItem(page_id_t page_id, uint32_t index);
+	size_t getLeafPrefix(void* page, const byte** prefix);
+	offset_t getLeafEnd(void* page);
+	void initLeaf(void* page);
+	void setLeafPrefix(void* page, const void* prefix, size_t size);
+	void expandLeaf(void* page, std::vector<size_t>* items);
+	size_t getCommonPrefix(const std::vector<size_t>& items, size_t from, size_t to,
+						size_t max_prefix);
+	size_t getLeafSize(const std::vector<size_t>& items, size_t from, size_t to,
+						size_t max_prefix);
+	void rebuildLeaf(void* page, const std::vector<size_t>& items, size_t from, size_t to,
+						size_t max_prefix);
+	bool removeItem(page_id_t page_id, uint32_t index);
+	void rebalanceLeaf(page_id_t page_id);
+	void rebalanceInternal(size_t level);
+	void removeInternalItem(void* page, uint32_t index);
+	void insertInternalAt(void* page, uint32_t index, page_id_t child,
+						const byte* item, size_t size);
+	size_t getUsedSpace(void* page);
+	size_t getPayloadSpace(void* page);
+	bool isUnderflow(void* page);
 	void writeItem(byte* p, const void* data, size_t size);
+	size_t getItemSize(size_t size);
+	bool isOnPage(size_t size);
+	size_t getSeparatorSize(const byte* left, const void* right, size_t rsize);
+	size_t getSeparator(const byte* left, const byte* right, const byte** sep);
+	size_t buildSeparator(const void* key, size_t size, const byte** sep);
+
+	friend class Cursor;
+	friend class BulkLoader;
 
 public:
-	BTree(Storage* store);
+	// comparator is only used, and then required, by KeyOrder::Custom trees
+	BTree(Storage* store, KeyComparator comparator = NULL);
 	~BTree();
 
+	// Lets get run alongside other lookups and the one writer at a time,
+	// which only holds up lookups passing through the pages it changes.
+	// Set it before the tree is shared between threads.
+	void setConcurrentReads(bool on);
+
 	size_t get(const void* key, size_t ksize,
 		void* buf, size_t size);
 	size_t get(const void* key, size_t ksize, void** val);
+	bool get(const void* key, size_t ksize, ValueView* view);
 	void put(const void* key, size_t ksize, const void* val, size_t vsize);
 	void remove(const void* key, size_t ksize);
+	void write(const WriteBatch* batch);
+	void multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+				Buffer* vals, bool* found);
 
 	void traverse(Iterator* iter);
+	void traverse(Iterator* iter, size_t threads);
+	void scan(const void* start, size_t ssize, const void* end, size_t esize,
+			Iterator** sinks, size_t threads);
+	Cursor* newCursor();
+};
+
+// Ordered iteration over a BTree, optionally bounded to [start, end).
+// The cursor pins its current leaf and copies out the current pair; each
+// call takes the storage lock only for its own duration. If the tree was
+// modified in between, the cursor finds its place again by key.
+class Cursor {
+private:
+	BTree* tree_;
+	Storage* store_;
+	PageHandle leaf_;
+	uint32_t index_;
+	uint64_t version_;
+	bool valid_;
+
+	Buffer* key_;
+	Buffer* val_;
+	Buffer* start_;
+	Buffer* end_;
+	bool has_start_;
+	bool has_end_;
+
+	void position(const void* key, size_t ksize);
+	void moveTo(page_id_t page_id, uint32_t index);
+	void skipForward();
+	void stepBack();
+	void load();
+	void invalidate();
+
+public:
+	Cursor(BTree* tree);
+	~Cursor();
+
+	void setRange(const void* start, size_t ssize, const void* end, size_t esize);
+
+	void seek(const void* key, size_t ksize);
+	void seekToFirst();
+	void seekToLast();
+	void next();
+	void prev();
+
+	inline bool valid() { return valid_; }
+	inline const void* key() { return key_->getBuffer(); }
+	inline size_t keySize() { return key_->getSize(); }
+	inline const void* value() { return val_->getBuffer(); }
+	inline size_t valueSize() { return val_->getSize(); }
+};
+
+// Builds a B-tree bottom-up from pairs given in any order. Pairs are
+// sorted in memory, spilling sorted runs to temporary files once the
+// sort memory fills, and then merged; a key added twice keeps its last
+// value. Leaves are packed to the fill factor in key order and the
+// internal levels are built over them as the leaves go out, so every
+// tree page is written once, straight to the data file, in page order.
+// The tree must be empty when finish is called.
+class BulkLoader {
+private:
+	static const size_t default_sort_memory = (size_t)64 << 20;
+	static const size_t write_batch = 256;
+	static const size_t run_buffer = (size_t)1 << 20;
+
+	struct RecordHeader {
+		size_t ksize_;
+		size_t vsize_;
+	};
+
+	class RunReader;
+
+	BTree* tree_;
+	Storage* store_;
+	size_t page_size_;
+	double fill_factor_;
+	size_t sort_memory_;
+
+	// unsorted pairs of the current run, as RecordHeader, key, value
+	Buffer* records_;
+	std::vector<size_t> offsets_;
+	bool sorted_;
+	std::vector<std::string> runs_;
+	bool failed_;
+
+	// one page under construction per level, leaves at level 0
+	std::vector<byte*> open_;
+	// built pages not yet written, and spare page buffers
+	std::vector<std::pair<page_id_t, byte*> > staged_;
+	std::vector<byte*> spare_;
+
+	bool lessRecord(size_t a, size_t b);
+	void sortRun();
+	bool spill();
+	bool merge();
+
+	void addPair(const void* key, size_t ksize, const void* val, size_t vsize);
+	void addChild(size_t level, page_id_t child, const byte* sep, size_t ssize);
+	void closePage(size_t level, page_id_t next);
+	page_id_t finishLevels();
+	byte* newPage(page_id_t page_id, BTreePageType type);
+	void stagePage(byte* page);
+	void writeStaged();
+
+public:
+	BulkLoader(BTree* tree, double fill_factor = 1.0,
+			size_t sort_memory = default_sort_memory);
+	~BulkLoader();
+
+	void add(const void* key, size_t ksize, const void* val, size_t vsize);
+	bool finish();
 };
 
 NAMESPACE_END
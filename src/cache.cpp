@@ -79,18 +79,6 @@ HashNode** HashTable::findPos(page_id_t page_id, hash_t h)
 	return pos;
 }
 
-hash_t HashTable::hashFunc(page_id_t page_id)
-{
-	hash_t h = page_id;
-	h *= 0x1b873593;
-	h ^= h >> 16;
-    h *= 0x85ebca6b;
-    h ^= h >> 13;
-    h *= 0xc2b2ae35;
-    h ^= h >> 16;
-    return h;
-}
-
 LruNode* HashTable::get(page_id_t page_id)
 {
 	hash_t h = HashTable::hashFunc(page_id);
@@ -140,58 +128,228 @@ void HashTable::del(page_id_t page_id)
 	}
 }
 
-Cache::Cache(size_t cache_size):
-	hash_table_(NULL), list_(NULL), free_list_(NULL), nodes_(NULL),
-	cache_size_(cache_size), sync_(NULL)
+// Keeps the load factor at or below one half.
+PageTable::PageTable(size_t capacity):
+	slots_(NULL), mask_(0), used_(0)
+{
+	size_t size = 16;
+	while (size < (capacity << 1))
+	{
+		size <<= 1;
+	}
+	slots_ = new PageSlot[size];
+	zeroMemory(slots_, size * sizeof(PageSlot));
+	mask_ = size - 1;
+}
+
+PageTable::~PageTable()
+{
+	deleteArray(slots_);
+}
+
+void PageTable::resize(size_t size)
+{
+	PageSlot* old = slots_;
+	size_t old_size = mask_ + 1;
+	slots_ = new PageSlot[size];
+	zeroMemory(slots_, size * sizeof(PageSlot));
+	mask_ = size - 1;
+	used_ = 0;
+	for (size_t i = 0; i < old_size; ++i)
+	{
+		if (old[i].node_)
+		{
+			set(old[i].page_id_, old[i].node_);
+		}
+	}
+	deleteArray(old);
+}
+
+void PageTable::set(page_id_t page_id, LruNode* node)
+{
+	if ((used_ + 1) << 1 > mask_ + 1)
+	{
+		resize((mask_ + 1) << 1);
+	}
+
+	size_t i = HashTable::hashFunc(page_id) & mask_;
+	while (slots_[i].node_ && slots_[i].page_id_ != page_id)
+	{
+		i = (i + 1) & mask_;
+	}
+	if (!slots_[i].node_)
+	{
+		++used_;
+	}
+	slots_[i].page_id_ = page_id;
+	slots_[i].node_ = node;
+}
+
+void PageTable::del(page_id_t page_id)
+{
+	size_t i = HashTable::hashFunc(page_id) & mask_;
+	while (slots_[i].node_ && slots_[i].page_id_ != page_id)
+	{
+		i = (i + 1) & mask_;
+	}
+	if (!slots_[i].node_)
+	{
+		return;
+	}
+
+	// move back every later entry of the run whose home slot does not lie
+	// cyclically in (i, j], so lookups never stop at the hole
+	size_t j = i;
+	while (true)
+	{
+		j = (j + 1) & mask_;
+		if (!slots_[j].node_)
+		{
+			break;
+		}
+		size_t k = HashTable::hashFunc(slots_[j].page_id_) & mask_;
+		bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+		if (!stays)
+		{
+			slots_[i] = slots_[j];
+			i = j;
+		}
+	}
+	slots_[i].node_ = NULL;
+	--used_;
+}
+
+// shard_count is rounded down to a power of two and the frames are split
+// evenly among the shards. Shards are picked by the high bits of the
+// page hash, since each shard's table buckets by the low ones.
+Cache::Cache(size_t cache_size, size_t shard_count, CachePolicy policy):
+	shards_(NULL), shard_count_(1), shard_shift_(32), cache_size_(cache_size),
+	policy_(policy), dirty_count_(0), held_count_(0), next_shard_(0), sync_(NULL)
 {
-	hash_table_ = new HashTable();
-	list_ = new LruList();
-	free_list_ = new LruList();
-	nodes_ = new LruNode[cache_size];
-	for (size_t i = 0; i < cache_size; ++i)
+	while ((shard_count_ << 1) <= min(shard_count, cache_size))
+	{
+		shard_count_ <<= 1;
+		--shard_shift_;
+	}
+
+	shards_ = new CacheShard[shard_count_];
+	for (size_t s = 0; s < shard_count_; ++s)
 	{
-		free_list_->pushBack(&nodes_[i]);
+		CacheShard* shard = &shards_[s];
+		shard->capacity_ = cache_size / shard_count_ + (s < cache_size % shard_count_ ? 1 : 0);
+		shard->size_ = 0;
+		shard->page_table_ = new PageTable(shard->capacity_);
+		shard->policy_ = ReplacementPolicy::create(policy, shard->capacity_);
+		shard->free_list_ = new LruList();
+		shard->nodes_ = new LruNode[shard->capacity_];
+		for (size_t i = 0; i < shard->capacity_; ++i)
+		{
+			shard->free_list_->pushBack(&shard->nodes_[i]);
+		}
 	}
 }
 
 Cache::~Cache()
 {
-	deletePtr(hash_table_);
-	LruNode* cur = NULL;
-	while(sync_ && (cur = list_->getHead()))
+	for (size_t s = 0; s < shard_count_; ++s)
 	{
-		sync_->syncCache(cur->page_id_, cur->page_);
-		list_->popFront();
+		CacheShard* shard = &shards_[s];
+		deletePtr(shard->page_table_);
+		LruNode* cur = shard->policy_->coldest();
+		while(sync_ && cur)
+		{
+			sync_->syncCache(cur->page_id_, cur->page_, cur->dirty_);
+			cur = shard->policy_->warmer(cur);
+		}
+		deletePtr(shard->policy_);
+		deletePtr(shard->free_list_);
+		deleteArray(shard->nodes_);
+		for (size_t i = 0; i < shard->extra_.size(); ++i)
+		{
+			deletePtr(shard->extra_[i]);
+		}
 	}
-	deletePtr(list_);
-	deletePtr(free_list_);
-	deleteArray(nodes_);
+	deleteArray(shards_);
 }
 
-void Cache::promote(LruNode* node)
+CacheShard* Cache::getShard(page_id_t page_id)
 {
-	list_->remove(node);
-	list_->pushFront(node);
+	if (shard_count_ == 1)
+	{
+		return shards_;
+	}
+	return &shards_[HashTable::hashFunc(page_id) >> shard_shift_];
 }
 
-void Cache::release()
+// Evicts the page the policy picks. Returns false if every page of the
+// shard is pinned or pending. A dirty victim is written back with the
+// shard unlocked; meanwhile it stays in the page table, pinned, so
+// lookups still find it, and if one of them keeps it pinned the page
+// stays cached.
+bool Cache::release(CacheShard* shard, std::unique_lock<std::mutex>& guard)
 {
-	LruNode* node = list_->getTail();
-	list_->popBack();
+	LruNode* node = shard->policy_->victim();
+	if (!node)
+	{
+		return false;
+	}
+	if (node->dirty_)
+	{
+		node->dirty_ = false;
+		--dirty_count_;
+		if (sync_)
+		{
+			node->writing_ = true;
+			++node->pin_count_;
+			guard.unlock();
+			sync_->writeBack(node->page_id_, node->page_);
+			guard.lock();
+			--node->pin_count_;
+			node->writing_ = false;
+			if (!isEvictable(node) || node->dirty_)
+			{
+				shard->policy_->insert(node);
+				return true;
+			}
+		}
+	}
 	if (sync_)
 	{
-		sync_->syncCache(node->page_id_, node->page_);
+		sync_->syncCache(node->page_id_, node->page_, false);
+	}
+	shard->page_table_->del(node->page_id_);
+	shard->free_list_->pushBack(node);
+	--shard->size_;
+	return true;
+}
+
+void Cache::pin(CacheShard* shard, LruNode* node, PinMode mode)
+{
+	if (mode == PinMode::Pin)
+	{
+		++node->pin_count_;
+	}
+	else if (mode == PinMode::Hold && !node->held_)
+	{
+		node->held_ = true;
+		++node->pin_count_;
+		shard->held_.push_back(node);
+		++held_count_;
 	}
-	hash_table_->del(node->page_id_);
-	free_list_->pushBack(node);
 }
 
-void* Cache::get(page_id_t page_id)
+void* Cache::get(page_id_t page_id, PinMode mode)
 {
-	LruNode* node = hash_table_->get(page_id);
+	CacheShard* shard = getShard(page_id);
+	std::lock_guard<std::mutex> guard(shard->lock_);
+	LruNode* node = shard->page_table_->get(page_id);
 	if (node)
 	{
-		promote(node);
+		if (!node->writing_)
+		{
+			shard->policy_->access(node);
+		}
+		pin(shard, node, mode);
 		return node->page_;
 	}
 	else
@@ -200,42 +358,185 @@ void* Cache::get(page_id_t page_id)
 	}
 }
 
-void Cache::put(page_id_t page_id, void* page)
+// A shard whose pages are all pinned grows past its capacity rather than
+// evict one of them, and shrinks back as pins go away.
+void Cache::put(page_id_t page_id, void* page, PinMode mode)
 {
-	LruNode* node = hash_table_->get(page_id);
+	CacheShard* shard = getShard(page_id);
+	std::unique_lock<std::mutex> guard(shard->lock_);
+	LruNode* node = shard->page_table_->get(page_id);
+	while (!node && shard->size_ >= shard->capacity_ && release(shard, guard))
+	{
+		// the shard may have been unlocked for a write back
+		node = shard->page_table_->get(page_id);
+	}
 	if (node)
 	{
 		node->page_ = page;
-		promote(node);
+		if (!node->writing_)
+		{
+			shard->policy_->access(node);
+		}
 	}
 	else
 	{
-		if (free_list_->getHead() == NULL)
+		node = shard->free_list_->getHead();
+		if (node)
+		{
+			shard->free_list_->popFront();
+		}
+		else
 		{
-			release();
+			node = new LruNode();
+			shard->extra_.push_back(node);
 		}
-		node = free_list_->getHead();
-		free_list_->popFront();
 		node->page_id_ = page_id;
 		node->page_ = page;
-		list_->pushFront(node);
-		hash_table_->set(page_id, node);
+		node->dirty_ = false;
+		node->pending_ = false;
+		node->pin_count_ = 0;
+		node->held_ = false;
+		node->writing_ = false;
+		shard->policy_->insert(node);
+		shard->page_table_->set(page_id, node);
+		++shard->size_;
+	}
+	pin(shard, node, mode);
+}
+
+void Cache::unpin(page_id_t page_id)
+{
+	CacheShard* shard = getShard(page_id);
+	std::lock_guard<std::mutex> guard(shard->lock_);
+	LruNode* node = shard->page_table_->get(page_id);
+	if (node && node->pin_count_ > 0)
+	{
+		--node->pin_count_;
+	}
+}
+
+void Cache::releaseHeld()
+{
+	for (size_t s = 0; s < shard_count_ && held_count_ > 0; ++s)
+	{
+		CacheShard* shard = &shards_[s];
+		std::lock_guard<std::mutex> guard(shard->lock_);
+		held_count_ -= shard->held_.size();
+		for (size_t i = 0; i < shard->held_.size(); ++i)
+		{
+			// skip frames deleted and reused since they were held
+			LruNode* node = shard->held_[i];
+			if (node->held_)
+			{
+				node->held_ = false;
+				--node->pin_count_;
+			}
+		}
+		shard->held_.clear();
 	}
 }
 
 void Cache::del(page_id_t page_id)
 {
-	LruNode* node = hash_table_->get(page_id);
-	if (node)
+	CacheShard* shard = getShard(page_id);
+	std::lock_guard<std::mutex> guard(shard->lock_);
+	LruNode* node = shard->page_table_->get(page_id);
+	// a page being written back leaves once the write is done
+	if (node && !node->writing_)
 	{
-		list_->remove(node);
+		shard->policy_->remove(node);
+		if (node->dirty_)
+		{
+			--dirty_count_;
+		}
 		if (sync_)
 		{
-			sync_->syncCache(node->page_id_, node->page_);
+			sync_->syncCache(node->page_id_, node->page_, node->dirty_);
+		}
+		shard->free_list_->pushBack(node);
+		shard->page_table_->del(page_id);
+		--shard->size_;
+	}
+}
+// Flags a cached page as modified. With pending set the page also joins
+// the operation in progress; returns true if it was not part of it yet.
+bool Cache::markDirty(page_id_t page_id, bool pending)
+{
+	CacheShard* shard = getShard(page_id);
+	std::lock_guard<std::mutex> guard(shard->lock_);
+	LruNode* node = shard->page_table_->get(page_id);
+	if (!node)
+	{
+		return false;
+	}
+	if (!node->dirty_)
+	{
+		node->dirty_ = true;
+		++dirty_count_;
+	}
+	if (pending && !node->pending_)
+	{
+		node->pending_ = true;
+		return true;
+	}
+	return false;
+}
+
+void Cache::clearPending(page_id_t page_id)
+{
+	CacheShard* shard = getShard(page_id);
+	std::lock_guard<std::mutex> guard(shard->lock_);
+	LruNode* node = shard->page_table_->get(page_id);
+	if (node)
+	{
+		node->pending_ = false;
+	}
+}
+
+// Hands out up to max dirty pages, coldest first, and marks them clean;
+// the caller owns writing them back. Pages are visited in the policy's
+// eviction order, and scanning stops as soon as the reserve coldest pages are clean and at most max_dirty pages are dirty.
+// Pending pages are skipped: they must not reach the disk before their
+// operation is logged. The reserve is split among the shards, and
+// successive calls start from successive shards.
+size_t Cache::takeDirty(page_id_t* ids, void** pages, size_t max,
+					size_t reserve, size_t max_dirty)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < shard_count_ && n < max; ++i)
+	{
+		CacheShard* shard = &shards_[(next_shard_ + i) & (shard_count_ - 1)];
+		size_t share = (reserve * shard->capacity_ + cache_size_ - 1) / cache_size_;
+		n += takeDirty(shard, ids + n, pages + n, max - n, share, max_dirty);
+	}
+	next_shard_ = (next_shard_ + 1) & (shard_count_ - 1);
+	return n;
+}
+
+size_t Cache::takeDirty(CacheShard* shard, page_id_t* ids, void** pages,
+					size_t max, size_t reserve, size_t max_dirty)
+{
+	std::lock_guard<std::mutex> guard(shard->lock_);
+	size_t n = 0;
+	size_t scanned = 0;
+	for (LruNode* node = shard->policy_->coldest(); node && n < max;
+		node = shard->policy_->warmer(node))
+	{
+		if (scanned >= reserve && dirty_count_ <= max_dirty)
+		{
+			break;
+		}
+		if (node->dirty_ && !node->pending_)
+		{
+			ids[n] = node->page_id_;
+			pages[n] = node->page_;
+			node->dirty_ = false;
+			--dirty_count_;
+			++n;
 		}
-		free_list_->pushBack(node);
-		hash_table_->del(page_id);
+		++scanned;
 	}
+	return n;
 }
 
 NAMESPACE_END
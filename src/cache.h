@@ -1,6 +1,9 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
+#include <mutex>
+#include <atomic>
+#include <vector>
 #include "common.h"
 
 NAMESPACE_BEGIN
@@ -10,8 +13,25 @@ struct LruNode {
 	LruNode* next_;
 	page_id_t page_id_;
 	void* page_;
+	bool dirty_;
+	// modified by the operation in progress; stays cached until committed
+	bool pending_;
+	// pins from PageHandles plus one while the operation in progress
+	// holds the page (held_); a pinned page is never evicted
+	uint32_t pin_count_;
+	bool held_;
+	// evicted and being written back; out of the replacement policy
+	bool writing_;
+	// replacement policy state: CLOCK reference bit, 2Q queue
+	bool referenced_;
+	uint8_t queue_;
 };
 
+inline bool isEvictable(const LruNode* node)
+{
+	return !node->pending_ && node->pin_count_ == 0;
+}
+
 class LruList {
 private:
 	LruNode* head_;
@@ -136,7 +156,17 @@ struct HashNodeBlock {
 class HashTable {
 public:
 	static const size_t default_size = 64;
-	static hash_t hashFunc(page_id_t page_id);
+	static inline hash_t hashFunc(page_id_t page_id)
+	{
+		hash_t h = page_id;
+		h *= 0x1b873593;
+		h ^= h >> 16;
+		h *= 0x85ebca6b;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35;
+		h ^= h >> 16;
+		return h;
+	}
 
 private:
 	HashNode** buckets_;
@@ -161,33 +191,138 @@ public:
 	void del(page_id_t page_id);
 };
 
+// Open-addressing map from page id to cache frame, on the path of every
+// cache lookup. Slots sit in one flat array and are probed linearly, so
+// a hit usually touches a single cache line; deletion shifts later
+// entries back instead of leaving tombstones. The table is sized once for
+// the shard and only grows if the shard overcommits.
+struct PageSlot {
+	page_id_t page_id_;
+	LruNode* node_;
+};
+
+class PageTable {
+private:
+	PageSlot* slots_;
+	size_t mask_;
+	size_t used_;
+
+	void resize(size_t size);
+
+public:
+	PageTable(size_t capacity);
+	~PageTable();
+
+	inline LruNode* get(page_id_t page_id)
+	{
+		size_t i = HashTable::hashFunc(page_id) & mask_;
+		while (slots_[i].node_)
+		{
+			if (slots_[i].page_id_ == page_id)
+			{
+				return slots_[i].node_;
+			}
+			i = (i + 1) & mask_;
+		}
+		return NULL;
+	}
+
+	void set(page_id_t page_id, LruNode* node);
+	void del(page_id_t page_id);
+};
+
+// Decides which page of a shard to evict. The cache reports every page
+// entering, being accessed and being deleted; victim() detaches and
+// returns the page to evict next, or NULL if no page may be evicted (see
+// isEvictable). coldest() and warmer() walk the cached pages from
+// the next victim onwards, for write back.
+class ReplacementPolicy {
+public:
+	static ReplacementPolicy* create(CachePolicy policy, size_t capacity);
+
+	virtual ~ReplacementPolicy() {}
+
+	virtual void insert(LruNode* node) = 0;
+	virtual void access(LruNode* node) = 0;
+	virtual void remove(LruNode* node) = 0;
+	virtual LruNode* victim() = 0;
+
+	virtual LruNode* coldest() = 0;
+	virtual LruNode* warmer(LruNode* node) = 0;
+};
+
+// Called for every page leaving the cache; dirty tells whether the page
+// was modified since it was loaded and has to be written back. Pages
+// evicted to make room are written back first through writeBack, with
+// the shard unlocked, and then leave clean.
 class CacheSynchronizer {
 protected:
-	virtual void syncCache(page_id_t page_id, void* page) = 0;
+	virtual void syncCache(page_id_t page_id, void* page, bool dirty) = 0;
+	virtual void writeBack(page_id_t page_id, void* page) = 0;
 	friend class Cache;
 };
 
-class Cache {
-private:
-	HashTable* hash_table_;
-	LruList* list_;
+// One partition of the cache. A page always maps to the same shard, and
+// each shard has its own lock, replacement list and share of the frames,
+// so threads working on different pages rarely contend.
+struct CacheShard {
+	std::mutex lock_;
+	PageTable* page_table_;
+	ReplacementPolicy* policy_;
 	LruList* free_list_;
 	LruNode* nodes_;
+	size_t capacity_;
+	size_t size_;
+	// frames allocated beyond capacity_ while everything was pinned
+	std::vector<LruNode*> extra_;
+	std::vector<LruNode*> held_;
+};
+
+// How get and put pin the page they return. Held pages are unpinned in
+// bulk by releaseHeld; pinned ones one at a time by unpin.
+enum PinMode {
+	NoPin = 0,
+	Hold = 1,
+	Pin = 2
+};
+
+class Cache {
+private:
+	CacheShard* shards_;
+	size_t shard_count_;
+	uint32_t shard_shift_;
 	size_t cache_size_;
+	CachePolicy policy_;
+	std::atomic<size_t> dirty_count_;
+	std::atomic<size_t> held_count_;
+	size_t next_shard_;
 	CacheSynchronizer* sync_;
 
-	void promote(LruNode* node);
-	void release();
+	inline CacheShard* getShard(page_id_t page_id);
+	bool release(CacheShard* shard, std::unique_lock<std::mutex>& guard);
+	void pin(CacheShard* shard, LruNode* node, PinMode mode);
+	size_t takeDirty(CacheShard* shard, page_id_t* ids, void** pages,
+					size_t max, size_t reserve, size_t max_dirty);
 
 public:
-	Cache(size_t cache_size);
+	Cache(size_t cache_size, size_t shard_count = 1,
+		CachePolicy policy = CachePolicy::LRU);
 	~Cache();
 
-	void* get(page_id_t page_id);
-	void put(page_id_t page_id, void* page);
+	void* get(page_id_t page_id, PinMode mode = PinMode::NoPin);
+	void put(page_id_t page_id, void* page, PinMode mode = PinMode::NoPin);
+	void unpin(page_id_t page_id);
+	void releaseHeld();
 	void del(page_id_t page_id);
+	bool markDirty(page_id_t page_id, bool pending = false);
+	void clearPending(page_id_t page_id);
+	size_t takeDirty(page_id_t* ids, void** pages, size_t max,
+					size_t reserve, size_t max_dirty);
 
 	inline size_t getCacheSize() { return cache_size_; }
+	inline size_t getShardCount() { return shard_count_; }
+	inline CachePolicy getPolicy() { return policy_; }
+	inline size_t getDirtyCount() { return dirty_count_; }
 	inline void setCacheSync(CacheSynchronizer* sync) { sync_ = sync; }
 };
 
@@ -1,3 +1,4 @@
+#include "batch.h"
 #include "file.h"
 #include "storage.h"
 #include "btree.h"
@@ -16,29 +17,68 @@ DB::~DB()
 }
 
 bool DB::open(const char* filename)
+{
+	return open(DBConfig(filename));
+}
+
+bool DB::open(const DBConfig& config)
 {
 	if (store_)
 	{
 		return false;
 	}
 
-	File f(filename);
+	File f(config.filename_);
 	if (!f.exist())
 	{
-		return false;
+		f.close();
+		return config.create_ ? create(config) : false;
 	}
 	f.close();
 
-	store_ = new Storage(filename);
-	if (!store_->valid())
+	store_ = new Storage(config.filename_);
+	if (!store_->valid() || !attach(config))
+	{
+		close();
+		return false;
+	}
+	configure(config);
+	return true;
+}
+
+bool DB::create(const DBConfig& config)
+{
+	if (store_)
 	{
-		deletePtr(store_);
 		return false;
 	}
 
+	store_ = new Storage(config);
+	if (!store_->valid() || !attach(config))
+	{
+		close();
+		return false;
+	}
+	configure(config);
+	return true;
+}
+
+// Puts the index matching the file type on top of the opened storage. A
+// tree created with a custom comparator cannot be opened without one,
+// and key heads cannot address pages over 64KB.
+bool DB::attach(const DBConfig& config)
+{
 	if (store_->getType() == DBType::BTreeDB)
 	{
-		db_ = new BTree(store_);
+		if (store_->getKeyOrder() == KeyOrder::Custom && !config.comparator_)
+		{
+			return false;
+		}
+		if (store_->getKeyHeads() && store_->getPageSize() > DBConfig::max_key_heads_page_size)
+		{
+			return false;
+		}
+		db_ = new BTree(store_, config.comparator_);
 	}
 	else if (store_->getType() == DBType::HashDB)
 	{
@@ -48,71 +88,70 @@ bool DB::open(const char* filename)
 	{
 		return false;
 	}
-
 	return true;
 }
 
-bool DB::open(const DBConfig& config)
+// Applies the runtime-only settings of config to an opened database.
+void DB::configure(const DBConfig& config)
 {
-	if (store_)
+	if (config.durability_ != Durability::NoLog)
 	{
-		return false;
+		store_->openLog(config.durability_, config.group_window_);
 	}
-
-	if (!config.create_)
+	store_->setCachePolicy(config.cache_policy_);
+	if (config.concurrent_reads_ && store_->getType() == DBType::BTreeDB)
 	{
-		return open(config.filename_);
+		((BTree*)db_)->setConcurrentReads(true);
 	}
-
-	File f(config.filename_);
-	if (!f.exist())
+	if (config.flush_interval_ > 0)
 	{
-		f.close();
-		return create(config);
+		store_->startFlusher(config.flush_interval_, config.max_dirty_ratio_);
 	}
-	f.close();
-
-	return open(config.filename_);
 }
 
-bool DB::create(const DBConfig& config)
+size_t DB::get(const void* key, size_t ksize, void* buf, size_t buf_size)
 {
-	if (store_)
+	if (db_)
 	{
-		return false;
+		return db_->get(key, ksize, buf, buf_size);
 	}
-
-	store_ = new Storage(config);
-	if (!store_->valid())
+	else
 	{
-		deletePtr(store_);
-		return false;
+		return 0;
 	}
+}
 
-	if (store_->getType() == DBType::BTreeDB)
-	{
-		db_ = new BTree(store_);
-	}
-	else if (store_->getType() == DBType::HashDB)
+// Looks key up without copying on-page values; see ValueView.
+bool DB::get(const void* key, size_t ksize, ValueView* view)
+{
+	if (db_)
 	{
-		db_ = new Hash(store_);
+		return db_->get(key, ksize, view);
 	}
 	else
 	{
+		view->reset();
 		return false;
 	}
-	return true;
 }
 
-size_t DB::get(const void* key, size_t ksize, void* buf, size_t buf_size)
+// Looks count keys up at once: value i goes to vals[i], and found[i]
+// tells whether key i is there. Cheaper than as many gets, as the
+// lookups share their way down and overlap their cache misses.
+void DB::multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+				Buffer* vals, bool* found)
 {
 	if (db_)
 	{
-		return db_->get(key, ksize, buf, buf_size);
+		db_->multiGet(count, keys, ksizes, vals, found);
 	}
 	else
 	{
-		return 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			vals[i].clear();
+			found[i] = false;
+		}
 	}
 }
 
@@ -120,7 +159,8 @@ void DB::put(const void* key, size_t ksize, const void* val, size_t vsize)
 {
 	if (db_)
 	{
-		return db_->put(key, ksize, val, vsize);
+		db_->put(key, ksize, val, vsize);
+		store_->commit();
 	}
 }
 
@@ -129,6 +169,105 @@ void DB::del(const void* key, size_t ksize)
 	if (db_)
 	{
 		db_->remove(key, ksize);
+		store_->commit();
+	}
+}
+
+// Applies every operation of batch under one lock and commits them as
+// one; see WriteBatch.
+void DB::write(const WriteBatch* batch)
+{
+	if (!db_)
+	{
+		return;
+	}
+	if (store_->getType() == DBType::BTreeDB)
+	{
+		((BTree*)db_)->write(batch);
+	}
+	else
+	{
+		store_->lock();
+		for (size_t i = 0; i < batch->count(); ++i)
+		{
+			size_t ksize, vsize;
+			const void* key = batch->getKey(i, &ksize);
+			if (batch->getType(i) == WriteBatch::OpType::Delete)
+			{
+				db_->remove(key, ksize);
+			}
+			else
+			{
+				const void* val = batch->getValue(i, &vsize);
+				db_->put(key, ksize, val, vsize);
+			}
+		}
+		store_->unlock();
+	}
+	store_->commit();
+}
+
+// Hands every pair to iter. A B-tree is read by threads workers and
+// the pairs arrive in key order; any other type is read by the calling
+// thread alone. Without DBConfig::concurrent_reads_ the workers take the
+// storage lock for every leaf, so their page reads and I/O go one at a
+// time and only the work of iter overlaps.
+void DB::traverse(Iterator* iter, size_t threads)
+{
+	if (db_ && store_->getType() == DBType::BTreeDB)
+	{
+		((BTree*)db_)->traverse(iter, threads);
+	}
+	else if (db_)
+	{
+		db_->traverse(iter);
+	}
+}
+
+// Scans [start, end) of a B-tree database with threads workers, worker
+// t handing its pairs to sinks[t]; see BTree::scan. Returns false for
+// any other type. As with traverse, the leaves are only read in
+// parallel with DBConfig::concurrent_reads_ set; without it only the
+// sinks run in parallel.
+bool DB::scan(const void* start, size_t ssize, const void* end, size_t esize,
+			Iterator** sinks, size_t threads)
+{
+	if (db_ && store_->getType() == DBType::BTreeDB)
+	{
+		((BTree*)db_)->scan(start, ssize, end, esize, sinks, threads);
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+// Returns a cursor over a B-tree database, NULL for any other type.
+// The caller deletes the cursor before closing the database.
+Cursor* DB::newCursor()
+{
+	if (db_ && store_->getType() == DBType::BTreeDB)
+	{
+		return ((BTree*)db_)->newCursor();
+	}
+	else
+	{
+		return NULL;
+	}
+}
+
+// Returns a bulk loader for an empty B-tree database, NULL for any other
+// type. Pairs added to it become visible when its finish succeeds.
+BulkLoader* DB::newBulkLoader(double fill_factor)
+{
+	if (db_ && store_->getType() == DBType::BTreeDB)
+	{
+		return new BulkLoader((BTree*)db_, fill_factor);
+	}
+	else
+	{
+		return NULL;
 	}
 }
 
@@ -6,6 +6,11 @@
 NAMESPACE_BEGIN
 
 class Storage;
+class Cursor;
+class ValueView;
+class BulkLoader;
+class WriteBatch;
+class Buffer;
 
 class DB {
 private:
@@ -14,6 +19,9 @@ private:
 
 	bool valid_;
 
+	bool attach(const DBConfig& config);
+	void configure(const DBConfig& config);
+
 public:
 	DB();
 	~DB();
@@ -22,8 +30,17 @@ public:
 	bool open(const DBConfig& config);
 	bool create(const DBConfig& config);
 	size_t get(const void* key, size_t ksize, void* buf, size_t buf_size);
+	bool get(const void* key, size_t ksize, ValueView* view);
+	void multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+				Buffer* vals, bool* found);
 	void put(const void* key, size_t ksize, const void* val, size_t vsize);
 	void del(const void* key, size_t ksize);
+	void write(const WriteBatch* batch);
+	void traverse(Iterator* iter, size_t threads = 1);
+	bool scan(const void* start, size_t ssize, const void* end, size_t esize,
+			Iterator** sinks, size_t threads);
+	Cursor* newCursor();
+	BulkLoader* newBulkLoader(double fill_factor = 1.0);
 	void close();
 
 	inline bool valid() { return valid_; }
@@ -13,7 +13,10 @@
 NAMESPACE_BEGIN
 
 typedef uint8_t byte;
+// offset inside a page
 typedef uint32_t offset_t;
+// offset inside the database file
+typedef uint64_t file_offset_t;
 typedef uint32_t hash_t;
 typedef uint32_t page_id_t;
 
@@ -61,28 +64,89 @@ inline T max(T a, T b)
 	return a > b ? a : b;
 }
 
+const size_t CACHE_LINE = 64;
+
+// Asks for the cache lines of [p, p+size) ahead of their first use.
+inline void prefetch(const void* p, size_t size)
+{
+	for (size_t off = 0; off < size; off += CACHE_LINE)
+	{
+		__builtin_prefetch((const byte*)p + off);
+	}
+}
+
 static const uint32_t DB_MAGIC = 0x97f59c92;
 
+// Version 1 files have no version field: their type_ (0 or 1) sits where
+// version_ is now, so any value below DB_VERSION marks a legacy file.
+static const uint32_t DB_VERSION = 2;
+
 enum DBType {
 	BTreeDB = 0,
 	HashDB = 1
 };
 
+// Stored at the start of page 0; page n lives at file offset
+// n * page_size_. Fields appended later must treat zero as their default.
 struct DBHeader {
 	uint32_t magic_;
-	DBType type_;
-	size_t page_size_;
-	size_t cache_size_;
+	uint32_t version_;
+	uint32_t type_;
+	uint32_t page_size_;
+	uint64_t cache_size_;
+	uint64_t min_items_;
 	page_id_t max_page_id_;
 	page_id_t overflow_page_;
 	offset_t overflow_offset_;
 	page_id_t free_pages_;
-	size_t min_items_;
 	uint32_t factor_;
 	page_id_t root_id_;
+	// nonzero if B-tree leaves store the prefix shared by their keys once
+	uint32_t prefix_keys_;
+	// KeyOrder of the B-tree
+	uint32_t key_order_;
+	// nonzero if B-tree slots carry key heads next to the item offsets
+	uint32_t key_heads_;
 };
 
-static const size_t DB_HEADER_SIZE = sizeof(DBHeader);
+// How long a write waits for its log record to reach the disk. NoLog
+// keeps the old behaviour: nothing is logged and a crash loses whatever
+// had not been written back yet.
+enum Durability {
+	NoLog = 0,
+	// every operation fsyncs the log before returning
+	SyncCommit = 1,
+	// concurrent operations share one fsync per group window
+	GroupCommit = 2,
+	// operations return at once; the log is flushed when it fills up
+	AsyncCommit = 3
+};
+
+// Page replacement policy of the cache. LRU moves a page to the front on
+// every hit; CLOCK only sets a reference bit; 2Q admits new pages to a
+// probation queue so a single scan cannot push out the hot set.
+enum CachePolicy {
+	LRU = 0,
+	Clock = 1,
+	TwoQueue = 2
+};
+
+// Order of B-tree keys. Bytes compares them as byte strings, a shorter
+// key first when one is a prefix of the other. The integer orders compare
+// native-endian keys of their width by value; keys of any other size sort
+// by size and then bytewise. Custom uses the comparator given in
+// DBConfig, which has to be passed again every time the database is opened.
+enum KeyOrder {
+	Bytes = 0,
+	Int32 = 1,
+	UInt32 = 2,
+	Int64 = 3,
+	UInt64 = 4,
+	Custom = 5
+};
+
+// Negative, zero or positive as key a sorts before, with or after key b.
+typedef int32_t (*KeyComparator)(const void* a, size_t asize, const void* b, size_t bsize);
 
 class DBConfig {
 private:
@@ -90,8 +154,13 @@ private:
 	static const size_t default_page_size = 4096;
 	static const size_t default_cache_size = 512;
 	static const size_t default_min_items = 4;
+	static const uint32_t default_max_dirty_ratio = 25;
+	static const uint32_t default_group_window = 200;
 
 public:
+	// key heads share a 32-bit slot with a 16-bit item offset
+	static const size_t max_key_heads_page_size = 65536;
+
 	const char* filename_;
 	bool create_;
 	DBType type_;
@@ -99,6 +168,34 @@ public:
 	size_t cache_size_;
 	uint32_t factor_;
 	size_t min_items_;
+	// background flusher: wake-up period in milliseconds (0 disables it)
+	// and the share of the cache, in percent, allowed to stay dirty
+	uint32_t flush_interval_;
+	uint32_t max_dirty_ratio_;
+	// write-ahead log mode and, for GroupCommit, how long in microseconds
+	// the first committer waits for others to join its fsync
+	Durability durability_;
+	uint32_t group_window_;
+	CachePolicy cache_policy_;
+	// B-tree leaves strip the prefix their keys share and keep it once;
+	// fixed when the database is created
+	bool prefix_keys_;
+	// fixed when the database is created; setting comparator_ selects
+	// KeyOrder::Custom. Prefix compression only applies to Bytes.
+	KeyOrder key_order_;
+	KeyComparator comparator_;
+	// B-tree slots keep the first two bytes of their keys, so in-page
+	// search compares items only among keys sharing those. It only pays
+	// off while the leading bytes of keys differ, and only applies to
+	// KeyOrder::Bytes. A B-tree with key heads and pages over 64KB
+	// fails to open, so turn it off for larger pages. Fixed at creation.
+	bool key_heads_;
+	// B-tree lookups latch the pages on their path instead of taking the
+	// storage lock, so they run in parallel with each other and with a
+	// writer working elsewhere in the tree. Writers are not made concurrent:
+	// they still run one at a time under the storage lock, and latch pages
+	// only to keep lookups off the ones they are changing.
+	bool concurrent_reads_;
 
 public:
 	DBConfig(const char* fn,
@@ -110,7 +207,17 @@ public:
 		filename_(fn), create_(create),
 		type_(type), page_size_(page_size),
 		cache_size_(cache_size),
-		min_items_(min_items)
+		min_items_(min_items),
+		flush_interval_(0),
+		max_dirty_ratio_(DBConfig::default_max_dirty_ratio),
+		durability_(Durability::NoLog),
+		group_window_(DBConfig::default_group_window),
+		cache_policy_(CachePolicy::LRU),
+		prefix_keys_(false),
+		key_order_(KeyOrder::Bytes),
+		comparator_(NULL),
+		key_heads_(true),
+		concurrent_reads_(false)
 	{}
 };
 
@@ -148,17 +255,17 @@ void setItemType(void* item, ItemType type)
 {
 	if (type == 0)
 	{
-		*(size_t*)item &= ~(0x1 << ((sizeof(size_t) << 3) - 1));
+		*(size_t*)item &= ~((size_t)0x1 << ((sizeof(size_t) << 3) - 1));
 	}
 	else
 	{
-		*(size_t*)item |= (0x1 << ((sizeof(size_t) << 3) - 1));
+		*(size_t*)item |= ((size_t)0x1 << ((sizeof(size_t) << 3) - 1));
 	}
 }
 
 ItemType getItemType(const void* item)
 {
-	return (*(size_t*)item & (0x1 << ((sizeof(size_t) << 3) - 1))) ? ItemType::OffPage : ItemType::OnPage;
+	return (*(size_t*)item & ((size_t)0x1 << ((sizeof(size_t) << 3) - 1))) ? ItemType::OffPage : ItemType::OnPage;
 }
 
 
@@ -173,11 +280,11 @@ size_t getItemLocalDataSize(const void* p)
 {
 	if (getItemType(p) == ItemType::OnPage)
 	{
-		return (((OnPageItemHeader*)p)->size_ & ~(0x1 << ((sizeof(size_t) << 3) - 1)));
+		return (((OnPageItemHeader*)p)->size_ & ~((size_t)0x1 << ((sizeof(size_t) << 3) - 1)));
 	}
 	else
 	{
-		return (((OffPageItemHeader*)p)->local_size_ & ~(0x1 << ((sizeof(size_t) << 3) - 1)));
+		return (((OffPageItemHeader*)p)->local_size_ & ~((size_t)0x1 << ((sizeof(size_t) << 3) - 1)));
 	}
 }
 
@@ -192,11 +299,11 @@ size_t getItemSizeOnPage(const void* p)
 {
 	if (getItemType(p) == ItemType::OnPage)
 	{
-		return sizeof(OnPageItemHeader) + (((OnPageItemHeader*)p)->size_ & ~(0x1 << ((sizeof(size_t) << 3) - 1)));
+		return sizeof(OnPageItemHeader) + (((OnPageItemHeader*)p)->size_ & ~((size_t)0x1 << ((sizeof(size_t) << 3) - 1)));
 	}
 	else
 	{
-		return sizeof(OffPageItemHeader) + (((OffPageItemHeader*)p)->local_size_ & ~(0x1 << ((sizeof(size_t) << 3) - 1)));
+		return sizeof(OffPageItemHeader) + (((OffPageItemHeader*)p)->local_size_ & ~((size_t)0x1 << ((sizeof(size_t) << 3) - 1)));
 	}
 }
 
@@ -205,6 +312,9 @@ public:
 	virtual void process(const void* key, size_t ksize, const void* val, size_t vsize) = 0;
 };
 
+class ValueView;
+class Buffer;
+
 class DBInterface {
 public:
 	virtual ~DBInterface() {}
@@ -212,8 +322,11 @@ public:
 	virtual size_t get(const void* key, size_t ksize,
 					void* buf, size_t size) = 0;
 	virtual size_t get(const void* key, size_t ksize, void** val) = 0;
+	virtual bool get(const void* key, size_t ksize, ValueView* view) = 0;
 	virtual void put(const void* key, size_t ksize, const void* val, size_t vsize) = 0;
 	virtual void remove(const void* key, size_t ksize) = 0;
+	virtual void multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+					Buffer* vals, bool* found) = 0;
 
 	virtual void traverse(Iterator* iter) = 0;
 };
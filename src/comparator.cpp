@@ -0,0 +1,34 @@
+#include "comparator.h"
+
+NAMESPACE_BEGIN
+
+int32_t compareBytes(const void* a, size_t asize, const void* b, size_t bsize)
+{
+	int32_t r = memcmp(a, b, min(asize, bsize));
+	if (r == 0)
+	{
+		return (asize < bsize) ? -1 : (asize > bsize ? 1 : 0);
+	}
+	return r;
+}
+
+KeyComparator getComparator(KeyOrder order)
+{
+	switch (order)
+	{
+	case KeyOrder::Bytes:
+		return compareBytes;
+	case KeyOrder::Int32:
+		return compareInteger<int32_t>;
+	case KeyOrder::UInt32:
+		return compareInteger<uint32_t>;
+	case KeyOrder::Int64:
+		return compareInteger<int64_t>;
+	case KeyOrder::UInt64:
+		return compareInteger<uint64_t>;
+	default:
+		return NULL;
+	}
+}
+
+NAMESPACE_END
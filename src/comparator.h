@@ -0,0 +1,33 @@
+#ifndef _COMPARATOR_H_
+#define _COMPARATOR_H_
+
+#include "common.h"
+
+NAMESPACE_BEGIN
+
+int32_t compareBytes(const void* a, size_t asize, const void* b, size_t bsize);
+
+// Keys of sizeof(T) bytes by value, anything else by size and bytes.
+template<class T>
+int32_t compareInteger(const void* a, size_t asize, const void* b, size_t bsize)
+{
+	if (asize != sizeof(T) || bsize != sizeof(T))
+	{
+		if (asize != bsize)
+		{
+			return asize < bsize ? -1 : 1;
+		}
+		return compareBytes(a, asize, b, bsize);
+	}
+	T x, y;
+	memcpy(&x, a, sizeof(T));
+	memcpy(&y, b, sizeof(T));
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// The built-in comparator of order, or NULL for KeyOrder::Custom.
+KeyComparator getComparator(KeyOrder order);
+
+NAMESPACE_END
+
+#endif
@@ -1,16 +1,19 @@
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cerrno>
 #include "file.h"
 
 NAMESPACE_BEGIN
 
-File::File(const char* filename): filename_(NULL), fp_(NULL)
+File::File(const char* filename): filename_(NULL), fd_(-1)
 {
 	filename_ = strdup(filename);
 }
 
 File::~File()
 {
-	if (fp_)
+	if (fd_ >= 0)
 	{
 		close();
 	}
@@ -27,23 +30,23 @@ bool File::exist()
 
 bool File::create()
 {
-	fp_ = fopen(filename_, "w+b");
-	return (fp_ != NULL);
+	fd_ = ::open(filename_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	return (fd_ >= 0);
 }
 
 bool File::open()
 {
-	fp_ = fopen(filename_, "r+b");
-	return (fp_ != NULL);
+	fd_ = ::open(filename_, O_RDWR);
+	return (fd_ >= 0);
 }
 
 bool File::close()
 {
 	int ret = 0;
-	if (fp_)
+	if (fd_ >= 0)
 	{
-		ret = fclose(fp_);
-		fp_ = NULL;
+		ret = ::close(fd_);
+		fd_ = -1;
 	}
 	return (ret == 0);
 }
@@ -53,16 +56,143 @@ bool File::remove()
 	return (::remove(filename_) == 0);
 }
 
-size_t File::read(offset_t off, void* buf, size_t size)
+bool File::sync()
 {
-	fseek(fp_, off, SEEK_SET);
-	return fread(buf, 1, size, fp_);
+	return (fd_ >= 0 && fdatasync(fd_) == 0);
 }
 
-size_t File::write(offset_t off, const void* buf, size_t size)
+bool File::truncate(file_offset_t size)
 {
-	fseek(fp_, off, SEEK_SET);
-	return fwrite(buf, 1, size, fp_);
+	return (fd_ >= 0 && ftruncate(fd_, size) == 0);
 }
 
-NAMESPACE_END
\ No newline at end of file
+file_offset_t File::getSize()
+{
+	struct stat st;
+	if (fd_ < 0 || fstat(fd_, &st) != 0)
+	{
+		return 0;
+	}
+	return st.st_size;
+}
+
+// Reads until size bytes are in or the file ends; failed, if given, is
+// set when a read error cut the transfer short instead.
+size_t File::readAt(file_offset_t off, void* buf, size_t size, bool* failed)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t n = pread(fd_, (byte*)buf + done, size - done, off + done);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && failed)
+		{
+			*failed = true;
+		}
+		if (n <= 0)
+		{
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+size_t File::read(file_offset_t off, void* buf, size_t size)
+{
+	return readAt(off, buf, size, NULL);
+}
+
+// A page past the end of the file was allocated but never written, so
+// the missing part reads as zeros. Only a read error makes this fail.
+bool File::readPage(file_offset_t off, void* page, size_t size)
+{
+	bool failed = false;
+	size_t n = readAt(off, page, size, &failed);
+	if (failed)
+	{
+		return false;
+	}
+	zeroMemory((byte*)page + n, size - n);
+	return true;
+}
+
+// Has the kernel start reading [off, off+size) in the background, so a
+// read of it coming soon finds it in the page cache. Only a hint.
+void File::readAhead(file_offset_t off, size_t size)
+{
+	if (fd_ >= 0)
+	{
+		posix_fadvise(fd_, off, size, POSIX_FADV_WILLNEED);
+	}
+}
+
+size_t File::write(file_offset_t off, const void* buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t n = pwrite(fd_, (const byte*)buf + done, size - done, off + done);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+// Gathers count buffers into one contiguous write starting at off.
+size_t File::writev(file_offset_t off, const struct iovec* iov, int count)
+{
+	size_t total = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		total += iov[i].iov_len;
+	}
+
+	ssize_t n;
+	do
+	{
+		n = pwritev(fd_, iov, count, off);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+	{
+		return 0;
+	}
+	if ((size_t)n == total)
+	{
+		return total;
+	}
+
+	// short write: finish buffer by buffer
+	size_t done = n;
+	size_t skip = n;
+	for (int i = 0; i < count; ++i)
+	{
+		if (skip >= iov[i].iov_len)
+		{
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t len = iov[i].iov_len - skip;
+		size_t w = write(off + done, (const byte*)iov[i].iov_base + skip, len);
+		done += w;
+		if (w < len)
+		{
+			break;
+		}
+		skip = 0;
+	}
+	return done;
+}
+
+NAMESPACE_END
@@ -1,14 +1,20 @@
 #ifndef _FILE_H_
 #define _FILE_H_
 
+#include <sys/uio.h>
 #include "common.h"
 
 NAMESPACE_BEGIN
 
+// Page file built on a raw descriptor. All I/O is positional
+// (pread/pwrite), so there is no shared seek position and no stdio
+// buffering; concurrent readers and writers never interfere.
 class File {
 private:
 	char* filename_;
-	FILE* fp_;
+	int fd_;
+
+	size_t readAt(file_offset_t off, void* buf, size_t size, bool* failed);
 
 public:
 	File(const char* filename);
@@ -19,13 +25,19 @@ public:
 	bool open();
 	bool close();
 	bool remove();
+	bool sync();
+	bool truncate(file_offset_t size);
+	file_offset_t getSize();
 
-	size_t read(offset_t off, void* buf, size_t size);
-	size_t write(offset_t off, const void* buf, size_t size);
+	size_t read(file_offset_t off, void* buf, size_t size);
+	bool readPage(file_offset_t off, void* page, size_t size);
+	void readAhead(file_offset_t off, size_t size);
+	size_t write(file_offset_t off, const void* buf, size_t size);
+	size_t writev(file_offset_t off, const struct iovec* iov, int count);
 
 	const char* getFilename() { return filename_; }
 };
 
 NAMESPACE_END
 
-#endif
\ No newline at end of file
+#endif
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <vector>
 #include "hash.h"
 #include "storage.h"
 
@@ -36,8 +38,10 @@ hash_t murmur3(const void* data, size_t size, uint32_t seed)
     {
     	case 3:
     	k ^= remain[2] << 16;
+    	// fall through
     	case 2:
     	k ^= remain[1] << 8;
+    	// fall through
     	case 1:
     	k ^= remain[0];
     	k *= c1;
@@ -268,11 +272,11 @@ page_id_t Hash::initRootPage()
 {
 	page_id_t rid = store_->getNewPage();
 	store_->setRootId(rid);
-	void* page = store_->getPage(rid);
+	void* page = store_->getPageForWrite(rid);
 	initIndexPage(page);
 
 	page_id_t bid = store_->getNewPage();
-	void* bucket = store_->getPage(bid);
+	void* bucket = store_->getPageForWrite(bid);
 	initBucketPage(bucket, page_size_);
 
 	setIndexPageId(page, 0, bid);
@@ -314,14 +318,10 @@ bool Hash::search(const void* page, const void* key, size_t ksize, uint32_t* ind
 	return found;
 }
 
+// Compares against the key bytes on the page; the overflow chain is
+// only read when the local prefix ties.
 int Hash::compare(const void* page, uint32_t index, const void* key, size_t ksize)
 {
-	{
-		getItem(page, index, cmp_buf_);
-		int r = memcmp(cmp_buf_->getBuffer(), key, min(ksize, cmp_buf_->getSize()));
-		return r == 0 ? cmp_buf_->getSize() - ksize: r;
-	}
-
 	void* item = getItemPointer(page, index);
 	size_t local_size = getItemLocalDataSize(item);
 	int r = memcmp(getItemLocalData(item), key, min(local_size, ksize));
@@ -337,7 +337,7 @@ int Hash::compare(const void* page, uint32_t index, const void* key, size_t ksiz
 	}
 	else
 	{
-		getItem(page, index, cmp_buf_);
+		readItem(item, cmp_buf_);
 		r = memcmp(cmp_buf_->getBuffer(), key, min(ksize, cmp_buf_->getSize()));
 		return r == 0 ? cmp_buf_->getSize() - ksize : r;
 	}
@@ -345,32 +345,7 @@ int Hash::compare(const void* page, uint32_t index, const void* key, size_t ksiz
 
 void Hash::getItem(const void* page, uint32_t index, Buffer* buf)
 {
-	buf->clear();
-
-	void* item = getItemPointer(page, index);
-
-	buf->append(getItemLocalData(item), getItemLocalDataSize(item));
-
-	if (getItemType(item) == ItemType::OffPage)
-	{
-		size_t remain = ((OffPageItemHeader*)item)->total_size_ - getItemLocalDataSize(item);
-		page_id_t pid = ((OffPageItemHeader*)item)->ov_page_id_;
-		offset_t off = ((OffPageItemHeader*)item)->ov_off_;
-		while (remain > 0)
-		{
-			void* page = store_->getPage(pid);
-			size_t read_bytes = min(page_size_-off, remain);
-			buf->append((byte*)page + off, read_bytes);
-			remain -= read_bytes;
-			if (remain <= 0)
-			{
-				break;
-			}
-			pid = ((OverflowPageHeader*)page)->next_;
-			off = sizeof(OverflowPageHeader);
-			page = store_->getPage(pid);
-		}
-	}
+	readItem(getItemPointer(page, index), buf);
 }
 
 page_id_t Hash::locateBucket(uint32_t n)
@@ -391,36 +366,43 @@ page_id_t Hash::locateBucket(uint32_t n)
 	return getIndexPageId(page, n);
 }
 
-void Hash::get(const void* key, size_t ksize, Buffer* buf)
+// Number of the bucket a key hashing to h belongs in.
+uint32_t Hash::getBucketNumber(hash_t h)
 {
-	page_id_t pid = store_->getRootId();
-	void* page = store_->getPage(pid);
+	void* page = store_->getPage(store_->getRootId());
 
 	uint32_t level = getLevel(page);
 	uint32_t ns = getNextSplit(page);
 
-	uint32_t h = murmur3(key, ksize, 0);
 	uint32_t k = h & ((1 << level) - 1);
 	if (k < ns)
 	{
 		k = h & ((1 << (level + 1)) - 1);
 	}
+	return k;
+}
 
-	pid = locateBucket(k);
-	page = store_->getPage(pid);
+// Returns the value item of key and the bucket page holding it, or NULL
+// if key is absent.
+void* Hash::findValue(const void* key, size_t ksize, page_id_t* page_id)
+{
+	return findInBucket(locateBucket(getBucketNumber(murmur3(key, ksize, 0))),
+						key, ksize, page_id);
+}
+
+// findValue in the bucket starting at page pid and its overflow buckets.
+void* Hash::findInBucket(page_id_t pid, const void* key, size_t ksize, page_id_t* page_id)
+{
+	void* page = store_->getPage(pid);
 
-	bool found;
 	uint32_t i;
-	buf->clear();
 
 	for (;;)
 	{
-		found = search(page, key, ksize, &i);
-
-		if (found)
+		if (search(page, key, ksize, &i))
 		{
-			getItem(page, i+1, buf);
-			break;
+			*page_id = pid;
+			return getItemPointer(page, i+1);
 		}
 		else if ((pid = getOverflowBucket(page)) != 0)
 		{
@@ -428,7 +410,35 @@ void Hash::get(const void* key, size_t ksize, Buffer* buf)
 		}
 		else
 		{
-			break;
+			return NULL;
+		}
+	}
+}
+
+void Hash::readItem(const void* item, Buffer* buf)
+{
+	buf->clear();
+
+	buf->append(getItemLocalData(item), getItemLocalDataSize(item));
+
+	if (getItemType(item) == ItemType::OffPage)
+	{
+		size_t remain = ((OffPageItemHeader*)item)->total_size_ - getItemLocalDataSize(item);
+		page_id_t pid = ((OffPageItemHeader*)item)->ov_page_id_;
+		offset_t off = ((OffPageItemHeader*)item)->ov_off_;
+		while (remain > 0)
+		{
+			void* page = store_->getPage(pid);
+			size_t read_bytes = min(page_size_-off, remain);
+			buf->append((byte*)page + off, read_bytes);
+			remain -= read_bytes;
+			if (remain <= 0)
+			{
+				break;
+			}
+			pid = ((OverflowPageHeader*)page)->next_;
+			off = sizeof(OverflowPageHeader);
+			page = store_->getPage(pid);
 		}
 	}
 }
@@ -438,9 +448,20 @@ size_t Hash::get(const void* key, size_t ksize,
 {
 	store_->lock();
 
-	get(key, ksize, data_buf_);
-	size_t ret = min(data_buf_->getSize(), size);
-	memcpy(buf, data_buf_->getBuffer(), ret);
+	page_id_t pid;
+	void* item = findValue(key, ksize, &pid);
+	size_t ret = 0;
+	if (item && getItemType(item) == ItemType::OnPage)
+	{
+		ret = min(getItemLocalDataSize(item), size);
+		memcpy(buf, getItemLocalData(item), ret);
+	}
+	else if (item)
+	{
+		readItem(item, data_buf_);
+		ret = min(data_buf_->getSize(), size);
+		memcpy(buf, data_buf_->getBuffer(), ret);
+	}
 
 	store_->unlock();
 
@@ -451,7 +472,13 @@ size_t Hash::get(const void* key, size_t ksize, void** val)
 {
 	store_->lock();
 
-	get(key, ksize, data_buf_);
+	page_id_t pid;
+	void* item = findValue(key, ksize, &pid);
+	data_buf_->clear();
+	if (item)
+	{
+		readItem(item, data_buf_);
+	}
 	*val = (void*)(new byte[data_buf_->getSize()]);
 	size_t ret = data_buf_->getSize();
 	memcpy(*val, data_buf_->getBuffer(), ret);
@@ -461,6 +488,88 @@ size_t Hash::get(const void* key, size_t ksize, void** val)
 	return ret;
 }
 
+// Reads an on-page value in place, pinning its bucket page for the life
+// of the view; overflow values are copied into the view.
+bool Hash::get(const void* key, size_t ksize, ValueView* view)
+{
+	store_->lock();
+
+	page_id_t pid;
+	void* item = findValue(key, ksize, &pid);
+	if (item == NULL)
+	{
+		view->reset();
+	}
+	else if (getItemType(item) == ItemType::OnPage)
+	{
+		view->point(store_, pid, getItemLocalData(item), getItemLocalDataSize(item));
+	}
+	else
+	{
+		readItem(item, view->fill());
+	}
+
+	store_->unlock();
+
+	return item != NULL;
+}
+
+// Looks count keys up under one lock; value i goes to vals[i] and
+// found[i] tells whether key i is there. The keys are taken bucket by
+// bucket, so a bucket is located once for all the keys hashing to it,
+// in groups of multiget_group whose bucket pages are all located, then
+// prefetched (read ahead by the OS if not cached), before any of them
+// is searched.
+void Hash::multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+					Buffer* vals, bool* found)
+{
+	store_->lock();
+
+	std::vector<std::pair<uint32_t, size_t> > order(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		order[i] = std::make_pair(getBucketNumber(murmur3(keys[i], ksizes[i], 0)), i);
+	}
+	std::sort(order.begin(), order.end());
+
+	page_id_t buckets[multiget_group];
+	page_id_t pid = 0;
+	for (size_t from = 0; from < count; from += multiget_group)
+	{
+		size_t n = min(count - from, (size_t)multiget_group);
+		for (size_t k = 0; k < n; ++k)
+		{
+			if (pid == 0 || order[from+k].first != order[from+k-1].first)
+			{
+				pid = locateBucket(order[from+k].first);
+			}
+			buckets[k] = pid;
+		}
+		for (size_t k = 0; k < n; ++k)
+		{
+			if (k == 0 || buckets[k] != buckets[k-1])
+			{
+				store_->prefetchPage(buckets[k]);
+			}
+		}
+		for (size_t k = 0; k < n; ++k)
+		{
+			size_t j = order[from+k].second;
+			page_id_t page_id;
+			void* item = findInBucket(buckets[k], keys[j], ksizes[j], &page_id);
+			found[j] = (item != NULL);
+			vals[j].clear();
+			if (item)
+			{
+				readItem(item, &vals[j]);
+			}
+		}
+		store_->releasePages();
+	}
+
+	store_->unlock();
+}
+
 void Hash::put(const void* key, size_t ksize, const void* val, size_t vsize)
 {
 	store_->lock();
@@ -501,14 +610,17 @@ void Hash::put(const void* key, size_t ksize, const void* val, size_t vsize)
 		found = search(page, key, ksize, &i);
 		if (found)
 		{
-			if (adjustAlign(getItemSizeOnPage(getItemPointer(page, i+1)))
+			if (!writed && adjustAlign(getItemSizeOnPage(getItemPointer(page, i+1)))
 				>= min(on_page_val_size, off_page_size))
 			{
+				store_->markDirty(pid);
 				modifyItem(page, i+1, val, vsize);
+				store_->unlock();
 				return;
 			}
 			else
 			{
+				store_->markDirty(pid);
 				removePair(page, i);
 				removed = true;
 			}
@@ -516,6 +628,7 @@ void Hash::put(const void* key, size_t ksize, const void* val, size_t vsize)
 
 		if (!writed && getBucketSpace(page) >= need)
 		{
+			store_->markDirty(pid);
 			insertPair(page, i, h, key, ksize, val, vsize);
 			writed = true;
 		}
@@ -592,7 +705,7 @@ void Hash::modifyItem(void* page, uint32_t index, const void* data, size_t size)
 			offset_t off = ((OffPageItemHeader*)item)->ov_off_;
 			while(size > 0)
 			{
-				void* page = store_->getPage(pid);
+				void* page = store_->getPageForWrite(pid);
 				size_t write_bytes = min(page_size_ - off, size);
 				memcpy((byte*)page+off, data, write_bytes);
 				data = (byte*)data + write_bytes;
@@ -680,14 +793,18 @@ void Hash::removePair(void* page, uint32_t index)
 
 page_id_t Hash::newOverflowBucket(page_id_t pid)
 {
-	void* page = store_->getPage(pid);
+	void* page = store_->getPageForWrite(pid);
 	page_id_t sid = store_->getNewPage();
-	void* spage = store_->getPage(sid);
+	void* spage = store_->getPageForWrite(sid);
 
 	initBucketPage(spage, page_size_);
 	setPrevBucket(spage, pid);
 	setNextBucket(spage, getNextBucket(page));
 	setNextBucket(page, sid);
+	if (getNextBucket(spage) != 0)
+	{
+		setPrevBucket(store_->getPageForWrite(getNextBucket(spage)), sid);
+	}
 	setOverflowBucket(page, sid);
 
 	return sid;
@@ -702,16 +819,20 @@ void Hash::split()
 	uint32_t ns = getNextSplit(page);
 
 	pid = locateBucket(ns);
-	page = store_->getPage(pid);
+	page = store_->getPageForWrite(pid);
 
 	page_id_t sid = store_->getNewPage();
 	page_id_t sh = sid;
-	void* spage = store_->getPage(sid);
+	void* spage = store_->getPageForWrite(sid);
 
 	initBucketPage(spage, page_size_);
 	setPrevBucket(spage, pid);
 	setNextBucket(spage, getNextBucket(page));
 	setNextBucket(page, sid);
+	if (getNextBucket(spage) != 0)
+	{
+		setPrevBucket(store_->getPageForWrite(getNextBucket(spage)), sid);
+	}
 
 	hash_t h;
 	uint32_t check = 1 << level;
@@ -735,7 +856,7 @@ void Hash::split()
 				{
 					setItemCount(spage, moved);
 					sid = newOverflowBucket(sid);
-					spage = store_->getPage(sid);
+					spage = store_->getPageForWrite(sid);
 					moved = 0;
 					sorted = true;
 				}
@@ -788,7 +909,7 @@ void Hash::split()
 		if (getOverflowBucket(page) != 0)
 		{
 			pid = getOverflowBucket(page);
-			page = store_->getPage(pid);
+			page = store_->getPageForWrite(pid);
 			sorted = false;
 		}
 		else
@@ -803,7 +924,7 @@ void Hash::split()
 void Hash::newBucket(page_id_t bid)
 {
 	page_id_t pid = store_->getRootId();
-	void* page = store_->getPage(pid);
+	void* page = store_->getPageForWrite(pid);
 
 	uint32_t level = getLevel(page);
 	uint32_t ns = getNextSplit(page);
@@ -815,7 +936,7 @@ void Hash::newBucket(page_id_t bid)
 	{
 		page_id_t old = store_->getRootId();
 		page_id_t rid = store_->getNewPage();
-		void* newp = store_->getPage(rid);
+		void* newp = store_->getPageForWrite(rid);
 		initIndexPage(newp);
 		setLevel(newp, level);
 		setNextSplit(newp, ns);
@@ -830,7 +951,7 @@ void Hash::newBucket(page_id_t bid)
 			pid = store_->getNewPage();
 			setIndexPageId(page, n/per, pid);
 			n %= per;
-			page = store_->getPage(pid);
+			page = store_->getPageForWrite(pid);
 			initIndexPage(page);
 			per /= getMaxBuckets(page_size_);
 			setBucketsPerPage(page, per);
@@ -844,14 +965,14 @@ void Hash::newBucket(page_id_t bid)
 			{
 				pid = store_->getNewPage();
 				setIndexPageId(page, n/per, pid);
-				page = store_->getPage(pid);
+				page = store_->getPageForWrite(pid);
 				initIndexPage(page);
 				setBucketsPerPage(page, per / getMaxBuckets(page_size_));
 			}
 			else
 			{
 				pid = getIndexPageId(page, n / per);
-				page = store_->getPage(pid);
+				page = store_->getPageForWrite(pid);
 			}
 			n %= per;
 			per = getBucketsPerPage(page);
@@ -860,7 +981,7 @@ void Hash::newBucket(page_id_t bid)
 
 	setIndexPageId(page, n, bid);
 
-	page = store_->getPage(store_->getRootId());
+	page = store_->getPageForWrite(store_->getRootId());
 	if (ns + 1 == (1u << level))
 	{
 		setNextSplit(page, 0);
@@ -907,7 +1028,7 @@ void Hash::compact(void* page)
 		page_id_t pid = getOverflowBucket(page);
 		if (pid != 0)
 		{
-			page = store_->getPage(pid);
+			page = store_->getPageForWrite(pid);
 		}
 		else
 		{
@@ -938,16 +1059,29 @@ void Hash::remove(const void* key, size_t ksize)
 
 	bool found;
 	uint32_t i;
-	
+	page_id_t owner = 0;
+
+	// no break after a hit: files written before Hash::put stopped
+	// leaving stale duplicates can hold the key again further down the
+	// chain, and a copy left there would come back on the next get
 	for (;;)
 	{
 		found = search(page, key, ksize, &i);
 		if (found)
 		{
+			store_->markDirty(pid);
 			removePair(page, i);
+			if (owner != 0 && getItemCount(page) == 0)
+			{
+				releaseOverflowBucket(owner, pid);
+				pid = owner;
+				page = store_->getPage(pid);
+			}
 		}
-		else if ((pid = getOverflowBucket(page)) != 0)
+		else if (getOverflowBucket(page) != 0)
 		{
+			owner = pid;
+			pid = getOverflowBucket(page);
 			page = store_->getPage(pid);
 		}
 		else
@@ -959,6 +1093,28 @@ void Hash::remove(const void* key, size_t ksize)
 	store_->unlock();
 }
 
+// Drops an empty overflow bucket from its owner's overflow chain and from
+// the bucket list, then hands the page back to storage.
+void Hash::releaseOverflowBucket(page_id_t owner, page_id_t pid)
+{
+	void* page = store_->getPageForWrite(pid);
+	page_id_t prev = getPrevBucket(page);
+	page_id_t next = getNextBucket(page);
+	page_id_t overflow = getOverflowBucket(page);
+
+	setOverflowBucket(store_->getPageForWrite(owner), overflow);
+	if (prev != 0)
+	{
+		setNextBucket(store_->getPageForWrite(prev), next);
+	}
+	if (next != 0)
+	{
+		setPrevBucket(store_->getPageForWrite(next), prev);
+	}
+
+	store_->freePage(pid);
+}
+
 void Hash::traverse(Iterator* iter)
 {
 	store_->lock();
@@ -986,6 +1142,7 @@ void Hash::traverse(Iterator* iter)
 		printf("\n");
 
 		pid = getNextBucket(page);
+		store_->releasePages();
 		page = store_->getPage(pid);
 	}
 
@@ -32,6 +32,10 @@ class Storage;
 class Buffer;
 
 class Hash : public DBInterface {
+private:
+	// lookups of a multiGet in flight together, their pages prefetched
+	static const uint32_t multiget_group = 8;
+
 private:
 	Storage* store_;
 	size_t page_size_;
@@ -44,12 +48,16 @@ private:
 	bool search(const void* page, const void* key, size_t ksize, uint32_t* index);
 	int compare(const void* page, uint32_t index, const void* key, size_t ksize);
 	void getItem(const void* page, uint32_t index, Buffer* buf);
-	void get(const void* key, size_t ksize, Buffer* buf);
+	void readItem(const void* item, Buffer* buf);
+	uint32_t getBucketNumber(hash_t h);
+	void* findValue(const void* key, size_t ksize, page_id_t* page_id);
+	void* findInBucket(page_id_t pid, const void* key, size_t ksize, page_id_t* page_id);
 	void split();
 	void newBucket(page_id_t bid);
 	void compact(void* page);
 	page_id_t locateBucket(uint32_t n);
 	page_id_t newOverflowBucket(page_id_t pid);
+	void releaseOverflowBucket(page_id_t owner, page_id_t pid);
 
 	void modifyItem(void* page, uint32_t index, const void* data, size_t size);
 	void insertPair(void* page, uint32_t index, hash_t h,
@@ -65,8 +73,11 @@ public:
 	size_t get(const void* key, size_t ksize,
 		void* buf, size_t size);
 	size_t get(const void* key, size_t ksize, void** val);
+	bool get(const void* key, size_t ksize, ValueView* view);
 	void put(const void* key, size_t ksize, const void* val, size_t vsize);
 	void remove(const void* key, size_t ksize);
+	void multiGet(size_t count, const void* const* keys, const size_t* ksizes,
+				Buffer* vals, bool* found);
 
 	void traverse(Iterator* iter);
 };
@@ -0,0 +1,155 @@
+#include "keyhead.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEYHEAD_X86 1
+#endif
+
+NAMESPACE_BEGIN
+
+typedef void (*CountFunc)(const uint32_t*, size_t, size_t, uint32_t, size_t*, size_t*);
+
+// Number of slots among the n with a head below bound.
+static size_t bisectKeyHeads(const uint32_t* slots, size_t n, size_t step, uint32_t bound)
+{
+	size_t left = 0;
+	size_t right = n;
+	while (left < right)
+	{
+		size_t mid = (left + right) >> 1;
+		if ((slots[mid * step] >> 16) < bound)
+		{
+			left = mid + 1;
+		}
+		else
+		{
+			right = mid;
+		}
+	}
+	return left;
+}
+
+static void countScalar(const uint32_t* slots, size_t n, size_t step, uint32_t head,
+						size_t* below, size_t* upto)
+{
+	*below = bisectKeyHeads(slots, n, step, head);
+	*upto = *below + bisectKeyHeads(slots + *below * step, n - *below, step, head + 1);
+}
+
+#ifdef KEYHEAD_X86
+
+// Heads fit in 16 bits, so shifted down they compare correctly as signed
+// 32-bit lanes. Lanes of value slots (odd lanes when step is 2) and
+// lanes past the end are masked off.
+
+static void countSse2(const uint32_t* slots, size_t n, size_t step, uint32_t head,
+					size_t* below, size_t* upto)
+{
+	size_t total = (n - 1) * step + 1;
+	__m128i lo = _mm_set1_epi32(head);
+	__m128i hi = _mm_set1_epi32(head + 1);
+	int lanes = (step == 2 ? 0x5 : 0xf);
+	size_t b = 0, u = 0;
+	size_t i = 0;
+	for (; i + 4 <= total; i += 4)
+	{
+		__m128i v = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(slots + i)), 16);
+		b += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(lo, v))) & lanes);
+		u += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(hi, v))) & lanes);
+	}
+	for (; i < total; i += step)
+	{
+		uint32_t h = slots[i] >> 16;
+		b += (h < head);
+		u += (h <= head);
+	}
+	*below = b;
+	*upto = u;
+}
+
+__attribute__((target("avx2")))
+static void countAvx2(const uint32_t* slots, size_t n, size_t step, uint32_t head,
+					size_t* below, size_t* upto)
+{
+	size_t total = (n - 1) * step + 1;
+	__m256i lo = _mm256_set1_epi32(head);
+	__m256i hi = _mm256_set1_epi32(head + 1);
+	int lanes = (step == 2 ? 0x55 : 0xff);
+	size_t b = 0, u = 0;
+	size_t i = 0;
+	for (; i + 8 <= total; i += 8)
+	{
+		__m256i v = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i*)(slots + i)), 16);
+		b += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(lo, v))) & lanes);
+		u += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(hi, v))) & lanes);
+	}
+	for (; i < total; i += step)
+	{
+		uint32_t h = slots[i] >> 16;
+		b += (h < head);
+		u += (h <= head);
+	}
+	*below = b;
+	*upto = u;
+}
+
+static CountFunc pickCount()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return countAvx2;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		return countSse2;
+	}
+	return countScalar;
+}
+
+#else
+
+static CountFunc pickCount()
+{
+	return countScalar;
+}
+
+#endif
+
+static const CountFunc count_func = pickCount();
+
+// Past this many slots, counting every slot costs more than bisecting.
+static const size_t max_count_lanes = 192;
+
+void countKeyHeads(const uint32_t* slots, size_t n, size_t step, uint32_t head,
+				size_t* below, size_t* upto)
+{
+	if (n == 0)
+	{
+		*below = *upto = 0;
+		return;
+	}
+	// heads are sorted: settle keys outside their range, and pages whose
+	// keys all share one head, without a scan
+	uint32_t first = slots[0] >> 16;
+	uint32_t last = slots[(n - 1) * step] >> 16;
+	if (head < first || (head == first && first == last))
+	{
+		*below = 0;
+		*upto = (head < first ? 0 : n);
+		return;
+	}
+	if (head > last)
+	{
+		*below = *upto = n;
+		return;
+	}
+	if (n * step > max_count_lanes)
+	{
+		countScalar(slots, n, step, head, below, upto);
+		return;
+	}
+	count_func(slots, n, step, head, below, upto);
+}
+
+NAMESPACE_END
@@ -0,0 +1,29 @@
+#ifndef _KEYHEAD_H_
+#define _KEYHEAD_H_
+
+#include "common.h"
+
+NAMESPACE_BEGIN
+
+// A key head is the first two bytes of a key as a big-endian number,
+// zero-padded. Heads compare like the keys they come from whenever they
+// differ, so a page keeping the head of every key in the upper half of
+// its slot can narrow a search down to the keys sharing the head of
+// the search key without touching the items themselves.
+inline uint32_t makeKeyHead(const void* key, size_t size)
+{
+	const byte* p = (const byte*)key;
+	return ((size > 0 ? (uint32_t)p[0] : 0) << 8) | (size > 1 ? p[1] : 0);
+}
+
+// Counts, among the n slots slots[0], slots[step], ..., slots[(n-1)*step]
+// sorted by head, those with a head below head (*below) and those with a
+// head not above it (*upto). step is 1 or 2. Small pages are counted
+// with AVX2 or SSE2 when the CPU has them; larger ones, or any page on
+// other CPUs, bisect the heads.
+void countKeyHeads(const uint32_t* slots, size_t n, size_t step, uint32_t head,
+				size_t* below, size_t* upto);
+
+NAMESPACE_END
+
+#endif
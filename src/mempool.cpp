@@ -17,7 +17,7 @@ static Block* pop(Block** list)
 
 MemPool::MemPool(size_t size, size_t cap):
 	block_size_(size), capacity_(cap),
-	buf_(NULL), free_(NULL)
+	buf_(NULL), free_(NULL), extra_(NULL)
 {
 	buf_ = new byte[(size + sizeof(Block*)) * cap];
 	for (size_t i = 0; i < cap; ++i)
@@ -30,6 +30,12 @@ MemPool::MemPool(size_t size, size_t cap):
 MemPool::~MemPool()
 {
 	deleteArray(buf_);
+	while (extra_)
+	{
+		byte* next = *(byte**)extra_;
+		deleteArray(extra_);
+		extra_ = next;
+	}
 }
 
 void* MemPool::getBuffer()
@@ -48,4 +54,18 @@ void MemPool::putBack(void* data)
 	push(&free_, node);
 }
 
+// Adds count more buffers beyond the initial capacity.
+void MemPool::expand(size_t count)
+{
+	size_t block = block_size_ + sizeof(Block*);
+	byte* chunk = new byte[sizeof(byte*) + block * count];
+	*(byte**)chunk = extra_;
+	extra_ = chunk;
+	for (size_t i = 0; i < count; ++i)
+	{
+		push(&free_, (Block*)&chunk[sizeof(byte*) + i * block]);
+	}
+	capacity_ += count;
+}
+
 NAMESPACE_END
\ No newline at end of file
@@ -16,6 +16,8 @@ private:
 	size_t capacity_;
 	byte* buf_;
 	Block* free_;
+	// chunks added by expand, chained through their first word
+	byte* extra_;
 
 public:
 	MemPool(size_t size, size_t cap);
@@ -23,6 +25,7 @@ public:
 
 	void* getBuffer();
 	void putBack(void* data);
+	void expand(size_t count);
 };
 
 NAMESPACE_END
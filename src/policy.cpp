@@ -0,0 +1,293 @@
+#include "policy.h"
+
+NAMESPACE_BEGIN
+
+ReplacementPolicy* ReplacementPolicy::create(CachePolicy policy, size_t capacity)
+{
+	switch (policy)
+	{
+	case CachePolicy::Clock:
+		return new ClockPolicy();
+	case CachePolicy::TwoQueue:
+		return new TwoQueuePolicy(capacity);
+	default:
+		return new LruPolicy();
+	}
+}
+
+LruPolicy::LruPolicy(): list_(NULL)
+{
+	list_ = new LruList();
+}
+
+LruPolicy::~LruPolicy()
+{
+	deletePtr(list_);
+}
+
+void LruPolicy::insert(LruNode* node)
+{
+	list_->pushFront(node);
+}
+
+void LruPolicy::access(LruNode* node)
+{
+	list_->remove(node);
+	list_->pushFront(node);
+}
+
+void LruPolicy::remove(LruNode* node)
+{
+	list_->remove(node);
+}
+
+LruNode* LruPolicy::victim()
+{
+	LruNode* node = list_->getTail();
+	while (node && !isEvictable(node))
+	{
+		node = node->prev_;
+	}
+	if (node)
+	{
+		list_->remove(node);
+	}
+	return node;
+}
+
+LruNode* LruPolicy::coldest()
+{
+	return list_->getTail();
+}
+
+LruNode* LruPolicy::warmer(LruNode* node)
+{
+	return node->prev_;
+}
+
+ClockPolicy::ClockPolicy(): hand_(NULL), size_(0)
+{}
+
+// New pages go right behind the hand, so they are the last it reaches.
+void ClockPolicy::insert(LruNode* node)
+{
+	node->referenced_ = false;
+	if (hand_)
+	{
+		node->next_ = hand_;
+		node->prev_ = hand_->prev_;
+		hand_->prev_->next_ = node;
+		hand_->prev_ = node;
+	}
+	else
+	{
+		node->next_ = node->prev_ = node;
+		hand_ = node;
+	}
+	++size_;
+}
+
+void ClockPolicy::access(LruNode* node)
+{
+	node->referenced_ = true;
+}
+
+void ClockPolicy::remove(LruNode* node)
+{
+	if (node->next_ == node)
+	{
+		hand_ = NULL;
+	}
+	else
+	{
+		if (node == hand_)
+		{
+			hand_ = node->next_;
+		}
+		node->prev_->next_ = node->next_;
+		node->next_->prev_ = node->prev_;
+	}
+	node->prev_ = node->next_ = NULL;
+	--size_;
+}
+
+// Two full turns clear every reference bit, so after that only pages
+// that may not be evicted can stop the hand.
+LruNode* ClockPolicy::victim()
+{
+	for (size_t i = 0; hand_ && i < (size_ << 1); ++i)
+	{
+		if (!hand_->referenced_ && isEvictable(hand_))
+		{
+			LruNode* node = hand_;
+			remove(node);
+			return node;
+		}
+		hand_->referenced_ = false;
+		hand_ = hand_->next_;
+	}
+	return NULL;
+}
+
+LruNode* ClockPolicy::coldest()
+{
+	return hand_;
+}
+
+LruNode* ClockPolicy::warmer(LruNode* node)
+{
+	return (node->next_ == hand_) ? NULL : node->next_;
+}
+
+TwoQueuePolicy::TwoQueuePolicy(size_t capacity):
+	a1in_(NULL), am_(NULL), a1in_size_(0), am_size_(0), kin_(0),
+	a1out_(NULL), free_ghosts_(NULL), ghosts_(NULL), ghost_nodes_(NULL), kout_(0)
+{
+	// the sizes suggested by the paper: a quarter of the frames for
+	// new pages, ghosts for half as many pages as the cache holds
+	kin_ = max(capacity >> 2, (size_t)1);
+	kout_ = max(capacity >> 1, (size_t)1);
+
+	a1in_ = new LruList();
+	am_ = new LruList();
+	a1out_ = new LruList();
+	free_ghosts_ = new LruList();
+	ghosts_ = new HashTable();
+	ghost_nodes_ = new LruNode[kout_];
+	for (size_t i = 0; i < kout_; ++i)
+	{
+		free_ghosts_->pushBack(&ghost_nodes_[i]);
+	}
+}
+
+TwoQueuePolicy::~TwoQueuePolicy()
+{
+	deletePtr(a1in_);
+	deletePtr(am_);
+	deletePtr(a1out_);
+	deletePtr(free_ghosts_);
+	deletePtr(ghosts_);
+	deleteArray(ghost_nodes_);
+}
+
+void TwoQueuePolicy::insert(LruNode* node)
+{
+	LruNode* ghost = ghosts_->get(node->page_id_);
+	if (ghost)
+	{
+		ghosts_->del(node->page_id_);
+		a1out_->remove(ghost);
+		free_ghosts_->pushBack(ghost);
+
+		node->queue_ = TwoQueuePolicy::Am;
+		am_->pushFront(node);
+		++am_size_;
+	}
+	else
+	{
+		node->queue_ = TwoQueuePolicy::A1in;
+		a1in_->pushFront(node);
+		++a1in_size_;
+	}
+}
+
+void TwoQueuePolicy::access(LruNode* node)
+{
+	if (node->queue_ == TwoQueuePolicy::Am)
+	{
+		am_->remove(node);
+		am_->pushFront(node);
+	}
+}
+
+void TwoQueuePolicy::detach(LruNode* node)
+{
+	if (node->queue_ == TwoQueuePolicy::Am)
+	{
+		am_->remove(node);
+		--am_size_;
+	}
+	else
+	{
+		a1in_->remove(node);
+		--a1in_size_;
+	}
+}
+
+void TwoQueuePolicy::remove(LruNode* node)
+{
+	detach(node);
+}
+
+void TwoQueuePolicy::remember(page_id_t page_id)
+{
+	LruNode* ghost = free_ghosts_->getHead();
+	if (ghost)
+	{
+		free_ghosts_->popFront();
+	}
+	else
+	{
+		ghost = a1out_->getTail();
+		a1out_->popBack();
+		ghosts_->del(ghost->page_id_);
+	}
+	ghost->page_id_ = page_id;
+	a1out_->pushFront(ghost);
+	ghosts_->set(page_id, ghost);
+}
+
+LruNode* TwoQueuePolicy::pick(LruList* list)
+{
+	LruNode* node = list->getTail();
+	while (node && !isEvictable(node))
+	{
+		node = node->prev_;
+	}
+	return node;
+}
+
+// Reclaims from a1in_ while it holds more than its share, otherwise from
+// the tail of am_; either way falls back to the other queue when no page
+// in the first one may be evicted.
+LruNode* TwoQueuePolicy::victim()
+{
+	LruNode* node;
+	if (a1in_size_ > kin_ || am_size_ == 0)
+	{
+		node = pick(a1in_);
+		node = node ? node : pick(am_);
+	}
+	else
+	{
+		node = pick(am_);
+		node = node ? node : pick(a1in_);
+	}
+	if (!node)
+	{
+		return NULL;
+	}
+
+	if (node->queue_ == TwoQueuePolicy::A1in)
+	{
+		remember(node->page_id_);
+	}
+	detach(node);
+	return node;
+}
+
+LruNode* TwoQueuePolicy::coldest()
+{
+	return a1in_->getTail() ? a1in_->getTail() : am_->getTail();
+}
+
+LruNode* TwoQueuePolicy::warmer(LruNode* node)
+{
+	if (node->prev_)
+	{
+		return node->prev_;
+	}
+	return (node->queue_ == TwoQueuePolicy::A1in) ? am_->getTail() : NULL;
+}
+
+NAMESPACE_END
@@ -0,0 +1,90 @@
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include "common.h"
+#include "cache.h"
+
+NAMESPACE_BEGIN
+
+// Least recently used: every access moves the page to the front.
+class LruPolicy: public ReplacementPolicy {
+private:
+	LruList* list_;
+
+public:
+	LruPolicy();
+	~LruPolicy();
+
+	void insert(LruNode* node);
+	void access(LruNode* node);
+	void remove(LruNode* node);
+	LruNode* victim();
+
+	LruNode* coldest();
+	LruNode* warmer(LruNode* node);
+};
+
+// Second-chance CLOCK. Pages sit on a ring that is only relinked when a
+// page enters or leaves; an access just sets the reference bit, and the
+// hand clears bits until it finds an unreferenced page.
+class ClockPolicy: public ReplacementPolicy {
+private:
+	LruNode* hand_;
+	size_t size_;
+
+public:
+	ClockPolicy();
+
+	void insert(LruNode* node);
+	void access(LruNode* node);
+	void remove(LruNode* node);
+	LruNode* victim();
+
+	LruNode* coldest();
+	LruNode* warmer(LruNode* node);
+};
+
+// Full 2Q (Johnson and Shasha). New pages enter the FIFO a1in_ and are
+// not promoted by hits there. Pages evicted from it leave their id in the
+// ghost queue a1out_; a page that comes back while still remembered goes
+// to the LRU queue am_. Pages read once by a scan therefore never
+// displace the pages in am_.
+class TwoQueuePolicy: public ReplacementPolicy {
+private:
+	enum Queue {
+		A1in = 0,
+		Am = 1
+	};
+
+	LruList* a1in_;
+	LruList* am_;
+	size_t a1in_size_;
+	size_t am_size_;
+	size_t kin_;
+
+	LruList* a1out_;
+	LruList* free_ghosts_;
+	HashTable* ghosts_;
+	LruNode* ghost_nodes_;
+	size_t kout_;
+
+	void remember(page_id_t page_id);
+	LruNode* pick(LruList* list);
+	void detach(LruNode* node);
+
+public:
+	TwoQueuePolicy(size_t capacity);
+	~TwoQueuePolicy();
+
+	void insert(LruNode* node);
+	void access(LruNode* node);
+	void remove(LruNode* node);
+	LruNode* victim();
+
+	LruNode* coldest();
+	LruNode* warmer(LruNode* node);
+};
+
+NAMESPACE_END
+
+#endif
@@ -1,9 +1,29 @@
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include "file.h"
 #include "mempool.h"
 #include "storage.h"
 
 NAMESPACE_BEGIN
 
+// On-disk header of version 1 files, which used native sizes and placed
+// page n at sizeof(LegacyDBHeader) + (n - 1) * page_size_.
+struct LegacyDBHeader {
+	uint32_t magic_;
+	DBType type_;
+	size_t page_size_;
+	size_t cache_size_;
+	page_id_t max_page_id_;
+	page_id_t overflow_page_;
+	offset_t overflow_offset_;
+	page_id_t free_pages_;
+	size_t min_items_;
+	uint32_t factor_;
+	page_id_t root_id_;
+};
+
 Buffer::Buffer():
 	buf_(NULL), used_(0), capacity_(0)
 {
@@ -48,14 +68,16 @@ void Buffer::append(const void* data, size_t size)
 }
 
 Storage::Storage(const char* filename):
-	file_(NULL), cache_(NULL), mem_(NULL), valid_(false)
+	file_(NULL), cache_(NULL), mem_(NULL), valid_(false), lock_depth_(0),
+	page_limit_(0), stop_flusher_(false), flush_interval_(0), max_dirty_(0),
+	clean_reserve_(0), staging_(NULL), flushing_(false), wal_(NULL)
 {
 	lock();
 
 	file_ = new File(filename);
 	if (file_->exist())
 	{
-		if (file_->open() && loadFile() && meta_.magic_ == DB_MAGIC)
+		if (file_->open() && loadFile())
 		{
 			goto file_ok;
 		}
@@ -70,6 +92,7 @@ Storage::Storage(const char* filename):
 	goto end;
 
 file_ok:
+	page_limit_ = meta_.max_page_id_;
 	valid_ = initCache();
 
 end:
@@ -77,14 +100,19 @@ end:
 }
 
 Storage::Storage(const DBConfig& config):
-	file_(NULL), cache_(NULL), valid_(false)
+	file_(NULL), cache_(NULL), mem_(NULL), valid_(false), lock_depth_(0),
+	page_limit_(0), stop_flusher_(false), flush_interval_(0), max_dirty_(0),
+	clean_reserve_(0), staging_(NULL), flushing_(false), wal_(NULL)
 {
 	lock();
 
 	file_ = new File(config.filename_);
 	if (file_->create())
 	{
+		// a log left behind by an earlier file of this name is stale
+		File(logName().c_str()).remove();
 		initNewFileHeader(config);
+		page_limit_ = meta_.max_page_id_;
 		valid_ = initCache();
 	}
 	else
@@ -97,12 +125,24 @@ Storage::Storage(const DBConfig& config):
 
 Storage::~Storage()
 {
+	stopFlusher();
+
 	lock();
 
 	if (valid_)
 	{
 		valid_ = false;
-		syncMeta();
+		if (wal_)
+		{
+			commit();
+			checkpoint();
+			deletePtr(wal_);
+			File(logName().c_str()).remove();
+		}
+		else
+		{
+			syncMeta();
+		}
 	}
 
 	deletePtr(cache_);
@@ -114,104 +154,661 @@ Storage::~Storage()
 
 bool Storage::loadFile()
 {
-	return (file_->read(0, &meta_, sizeof(meta_)) == sizeof(meta_));
+	byte buf[max(sizeof(DBHeader), sizeof(LegacyDBHeader))];
+	zeroMemory(buf, sizeof(buf));
+	if (file_->read(0, buf, sizeof(buf)) < sizeof(LegacyDBHeader))
+	{
+		return false;
+	}
+
+	memcpy(&meta_, buf, sizeof(meta_));
+	if (meta_.magic_ != DB_MAGIC)
+	{
+		return false;
+	}
+	if (meta_.version_ < DB_VERSION)
+	{
+		return upgradeFile(buf);
+	}
+	if (meta_.version_ != DB_VERSION)
+	{
+		return false;
+	}
+
+	// redo whatever a crash left in the log, then make it redundant
+	std::string log = logName();
+	if (WriteAheadLog::replay(log.c_str(), this, meta_.page_size_))
+	{
+		if (!syncMeta() || !file_->sync())
+		{
+			return false;
+		}
+	}
+	File(log.c_str()).remove();
+	return true;
+}
+
+std::string Storage::logName()
+{
+	return std::string(file_->getFilename()) + "-wal";
+}
+
+void Storage::applyMeta(const DBHeader& meta)
+{
+	meta_ = meta;
+}
+
+void Storage::applyPage(page_id_t page_id, const void* page, size_t size)
+{
+	file_->write(pageOffset(page_id), page, size);
+}
+
+// Rewrites a version 1 file into the current layout. The new image is
+// built next to the original and renamed over it, so a crash midway
+// leaves the old file untouched.
+bool Storage::upgradeFile(const void* legacy)
+{
+	LegacyDBHeader old;
+	memcpy(&old, legacy, sizeof(old));
+
+	zeroMemory(&meta_, sizeof(meta_));
+	meta_.magic_ = DB_MAGIC;
+	meta_.version_ = DB_VERSION;
+	meta_.type_ = old.type_;
+	meta_.page_size_ = old.page_size_;
+	meta_.cache_size_ = old.cache_size_;
+	meta_.min_items_ = old.min_items_;
+	meta_.max_page_id_ = old.max_page_id_;
+	meta_.overflow_page_ = old.overflow_page_;
+	meta_.overflow_offset_ = old.overflow_offset_;
+	meta_.free_pages_ = old.free_pages_;
+	meta_.factor_ = old.factor_;
+	meta_.root_id_ = old.root_id_;
+
+	std::string name(file_->getFilename());
+	std::string tmpname = name + ".upgrade";
+	File tmp(tmpname.c_str());
+	if (!tmp.create())
+	{
+		return false;
+	}
+
+	bool ok = true;
+	byte* page = new byte[meta_.page_size_];
+	zeroMemory(page, meta_.page_size_);
+	memcpy(page, &meta_, sizeof(meta_));
+	ok = (tmp.write(0, page, meta_.page_size_) == meta_.page_size_);
+
+	for (page_id_t pid = 1; ok && pid <= old.max_page_id_; ++pid)
+	{
+		file_offset_t from = sizeof(LegacyDBHeader) + (file_offset_t)(pid - 1) * old.page_size_;
+		ok = file_->readPage(from, page, meta_.page_size_)
+			&& (tmp.write(pageOffset(pid), page, meta_.page_size_) == meta_.page_size_);
+	}
+	deleteArray(page);
+
+	ok = ok && tmp.sync() && tmp.close();
+	if (!ok)
+	{
+		tmp.remove();
+		return false;
+	}
+
+	file_->close();
+	ok = (::rename(tmpname.c_str(), name.c_str()) == 0);
+	if (!ok)
+	{
+		tmp.remove();
+	}
+	return file_->open() && ok;
 }
 
 void Storage::initNewFileHeader(const DBConfig& config)
 {
 	zeroMemory(&meta_, sizeof(meta_));
 	meta_.magic_ = DB_MAGIC;
+	meta_.version_ = DB_VERSION;
+	meta_.type_ = config.type_;
 	meta_.page_size_ = config.page_size_;
 	meta_.cache_size_ = config.cache_size_;
 	meta_.min_items_ = config.min_items_;
+	meta_.key_order_ = config.comparator_ ? KeyOrder::Custom : config.key_order_;
+	meta_.prefix_keys_ = (config.prefix_keys_ && meta_.key_order_ == KeyOrder::Bytes) ? 1 : 0;
+	meta_.key_heads_ = (config.key_heads_ && meta_.key_order_ == KeyOrder::Bytes) ? 1 : 0;
 }
 
 bool Storage::initCache()
 {
-	cache_ = new Cache(meta_.cache_size_);
+	size_t shards = min(Storage::max_cache_shards,
+						(size_t)meta_.cache_size_ / Storage::min_shard_frames);
+	cache_ = new Cache(meta_.cache_size_, max(shards, (size_t)1));
 	cache_->setCacheSync(this);
 	mem_ = new MemPool(meta_.page_size_, meta_.cache_size_+1);
 	return (cache_ && mem_);
 }
 
-void Storage::syncMeta()
+// Rebuilds the cache around another replacement policy. Cached pages are
+// written back first, so this is meant to be called right after opening.
+void Storage::setCachePolicy(CachePolicy policy)
 {
-	file_->write(0, &meta_, sizeof(meta_));
+	lock();
+	if (valid_ && cache_->getPolicy() != policy)
+	{
+		size_t shards = cache_->getShardCount();
+		deletePtr(cache_);
+		cache_ = new Cache(meta_.cache_size_, shards, policy);
+		cache_->setCacheSync(this);
+	}
+	unlock();
+}
+
+bool Storage::syncMeta()
+{
+	return file_->write(0, &meta_, sizeof(meta_)) == sizeof(meta_);
 }
 
 void Storage::lock()
 {
 	lock_.lock();
+	++lock_depth_;
 }
 
+// Leaving the outermost lock ends the operation: the pages it used may
+// be evicted again.
 void Storage::unlock()
 {
+	if (--lock_depth_ == 0 && cache_)
+	{
+		cache_->releaseHeld();
+	}
 	lock_.unlock();
 }
 
+// Pins the page and marks it dirty; release unpins it.
 void* Storage::acquire(page_id_t page_id)
 {
-	if (page_id > meta_.max_page_id_)
+	void* page = pin(page_id);
+	if (page)
 	{
-		return NULL;
+		markDirty(page_id);
 	}
+	return page;
+}
 
-	lock();
+void Storage::release(page_id_t page_id)
+{
+	unpin(page_id);
+}
 
-	void* page = cache_->get(page_id);
+// The page stays in the cache until the operation in progress, that is
+// the outermost lock(), ends.
+void* Storage::getPage(page_id_t page_id)
+{
+	return fetchPage(page_id, PinMode::Hold);
+}
+
+// Readies page for a getPage coming soon. A cached page is held as
+// getPage would hold it and pulled into the CPU cache; an uncached one
+// is read ahead by the OS, so the misses of several pages prefetched in
+// a row are served together instead of one after the other.
+void Storage::prefetchPage(page_id_t page_id)
+{
+	if (page_id > page_limit_.load(std::memory_order_acquire))
+	{
+		return;
+	}
+	void* page = cache_->get(page_id, PinMode::Hold);
 	if (page)
 	{
-		return page;
+		prefetch(page, 4 * CACHE_LINE);
+	}
+	else
+	{
+		file_->readAhead(pageOffset(page_id), meta_.page_size_);
 	}
-
-	page = mem_->getBuffer();
-	file_->read(pageOffset(page_id), page, meta_.page_size_);
-	cache_->put(page_id, page);
-	return page;
 }
 
-void Storage::release(page_id_t page_id)
+// Lets the pages the operation in progress has used so far be evicted
+// again, so a long scan does not keep the whole file cached. Pointers
+// obtained before must not be used afterwards. Nested calls are ignored,
+// as the enclosing operation may still need its pages.
+void Storage::releasePages()
 {
+	lock();
+	if (lock_depth_ == 2)
+	{
+		cache_->releaseHeld();
+	}
 	unlock();
 }
 
-void* Storage::getPage(page_id_t page_id)
+// The page stays in the cache until a matching unpin.
+void* Storage::pin(page_id_t page_id)
 {
-	if (page_id > meta_.max_page_id_)
+	return fetchPage(page_id, PinMode::Pin);
+}
+
+// Pins the page only if it is cached; never takes the storage lock.
+void* Storage::pinCached(page_id_t page_id)
+{
+	if (page_id > page_limit_.load(std::memory_order_acquire))
 	{
 		return NULL;
 	}
+	return cache_->get(page_id, PinMode::Pin);
+}
 
-	void* page = cache_->get(page_id);
+void Storage::unpin(page_id_t page_id)
+{
+	cache_->unpin(page_id);
+}
+
+void* Storage::fetchPage(page_id_t page_id, PinMode mode)
+{
+	if (page_id > page_limit_.load(std::memory_order_acquire))
+	{
+		return NULL;
+	}
+
+	// a hit only takes the lock of the page's cache shard
+	void* page = cache_->get(page_id, mode);
 	if (page)
 	{
 		return page;
 	}
 
-	page = mem_->getBuffer();
-	file_->read(pageOffset(page_id), page, meta_.page_size_);
-	cache_->put(page_id, page);
+	lock();
+	page = cache_->get(page_id, mode);
+	if (!page)
+	{
+		page = loadPage(page_id, mode);
+	}
+	unlock();
+	return page;
+}
+
+void* Storage::getPageForWrite(page_id_t page_id)
+{
+	void* page = getPage(page_id);
+	if (page)
+	{
+		markDirty(page_id);
+	}
 	return page;
 }
 
+void Storage::markDirty(page_id_t page_id)
+{
+	lock();
+	if (cache_->markDirty(page_id, wal_ != NULL))
+	{
+		txn_pages_.push_back(page_id);
+	}
+	unlock();
+	if (flush_interval_ && cache_->getDirtyCount() > max_dirty_)
+	{
+		flush_cond_.notify_one();
+	}
+}
+
+void* Storage::loadPage(page_id_t page_id, PinMode mode)
+{
+	waitForFlush(page_id);
+
+	void* page = mem_->getBuffer();
+	if (!page)
+	{
+		// every cached page is pinned, so the cache grows for a while
+		mem_->expand(Storage::pool_growth);
+		page = mem_->getBuffer();
+	}
+	if (!file_->readPage(pageOffset(page_id), page, meta_.page_size_))
+	{
+		// an I/O error; caching zeros would pass them off as the page
+		mem_->putBack(page);
+		return NULL;
+	}
+	cache_->put(page_id, page, mode);
+	return page;
+}
 
 page_id_t Storage::getNewPage()
+{
+	lock();
+	page_id_t ret;
+	if (meta_.free_pages_ != 0)
+	{
+		ret = meta_.free_pages_;
+		void* page = getPageForWrite(ret);
+		meta_.free_pages_ = ((FreePageHeader*)page)->next_;
+		zeroMemory(page, meta_.page_size_);
+	}
+	else
+	{
+		ret = ++meta_.max_page_id_;
+		page_limit_.store(ret, std::memory_order_release);
+	}
+	unlock();
+	return ret;
+}
+
+void Storage::freePage(page_id_t page_id)
+{
+	lock();
+	void* page = getPageForWrite(page_id);
+	if (page)
+	{
+		((FreePageHeader*)page)->next_ = meta_.free_pages_;
+		meta_.free_pages_ = page_id;
+	}
+	unlock();
+}
+
+// Hands out a page past the end of the file, skipping the free list. The
+// page has never been cached, so it may be written with writePages.
+page_id_t Storage::reservePage()
 {
 	lock();
 	page_id_t ret = ++meta_.max_page_id_;
+	page_limit_.store(ret, std::memory_order_release);
 	unlock();
 	return ret;
 }
 
-void Storage::syncCache(page_id_t page_id, void* page)
+// Writes reserved pages straight to the data file, bypassing the cache
+// and the log. ids must be ascending; runs of consecutive pages go out
+// in one write each.
+void Storage::writePages(const page_id_t* ids, void** pages, size_t count)
 {
-	file_->write(pageOffset(page_id), page, meta_.page_size_);
+	std::vector<struct iovec> iov(min(count, (size_t)IOV_MAX));
+	io_lock_.lock();
+	size_t start = 0;
+	while (start < count)
+	{
+		size_t end = start;
+		do
+		{
+			iov[end - start].iov_base = pages[end];
+			iov[end - start].iov_len = meta_.page_size_;
+			++end;
+		} while (end < count && end - start < IOV_MAX && ids[end] == ids[end-1] + 1);
+
+		file_->writev(pageOffset(ids[start]), &iov[0], end - start);
+		start = end;
+	}
+	io_lock_.unlock();
+}
+
+void Storage::syncFile()
+{
+	io_lock_.lock();
+	file_->sync();
+	io_lock_.unlock();
+}
+
+const char* Storage::getFilename()
+{
+	return file_->getFilename();
+}
+
+void Storage::syncCache(page_id_t page_id, void* page, bool dirty)
+{
+	if (dirty)
+	{
+		writeBack(page_id, page);
+	}
 	mem_->putBack(page);
 }
 
-offset_t Storage::pageOffset(page_id_t page_id)
+void Storage::writeBack(page_id_t page_id, void* page)
+{
+	if (wal_)
+	{
+		wal_->sync(wal_->getLastLsn());
+	}
+	waitForFlush(page_id);
+	file_->write(pageOffset(page_id), page, meta_.page_size_);
+}
+
+// Called with lock_ held before any foreground I/O on a page. If the
+// flusher is writing an older copy of it, wait for that write to land so
+// reads see it and newer writes are not overtaken by it.
+void Storage::waitForFlush(page_id_t page_id)
+{
+	if (flushing_ && std::binary_search(in_flight_.begin(), in_flight_.end(), page_id))
+	{
+		io_lock_.lock();
+		io_lock_.unlock();
+	}
+}
+
+// Starts a thread that writes back dirty pages every interval
+// milliseconds, or sooner once more than max_dirty_ratio percent of the
+// cache is dirty. It keeps the coldest pages clean so eviction in the
+// foreground rarely has to write.
+void Storage::startFlusher(uint32_t interval, uint32_t max_dirty_ratio)
+{
+	if (!valid_ || interval == 0 || flusher_.joinable())
+	{
+		return;
+	}
+
+	size_t cache_size = cache_->getCacheSize();
+	flush_interval_ = interval;
+	max_dirty_ = cache_size * min(max_dirty_ratio, 100u) / 100;
+	clean_reserve_ = max(cache_size >> 3, (size_t)1);
+	staging_ = new MemPool(meta_.page_size_, Storage::flush_batch);
+	stop_flusher_ = false;
+	flusher_ = std::thread(&Storage::flushLoop, this);
+}
+
+void Storage::stopFlusher()
+{
+	if (!flusher_.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(flush_lock_);
+		stop_flusher_ = true;
+	}
+	flush_cond_.notify_one();
+	flusher_.join();
+	flush_interval_ = 0;
+	deletePtr(staging_);
+}
+
+size_t Storage::getDirtyCount()
+{
+	return cache_->getDirtyCount();
+}
+
+void Storage::flushLoop()
+{
+	std::unique_lock<std::mutex> guard(flush_lock_);
+	while (!stop_flusher_)
+	{
+		flush_cond_.wait_for(guard, std::chrono::milliseconds(flush_interval_));
+		if (stop_flusher_)
+		{
+			break;
+		}
+		guard.unlock();
+		while (flushDirtyPages() > 0)
+		{}
+		guard.lock();
+	}
+}
+
+// One flusher round: snapshot a batch of cold dirty pages, sort them by
+// file offset and write each run of adjacent pages with a single
+// vectored write. Returns the number of pages written.
+size_t Storage::flushDirtyPages()
+{
+	page_id_t ids[Storage::flush_batch];
+	void* pages[Storage::flush_batch];
+
+	lock();
+	size_t n = cache_->takeDirty(ids, pages, Storage::flush_batch,
+								clean_reserve_, max_dirty_);
+	if (n == 0)
+	{
+		unlock();
+		return 0;
+	}
+
+	uint32_t order[Storage::flush_batch];
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		order[i] = i;
+	}
+	std::sort(order, order + n, [&ids](uint32_t a, uint32_t b) {
+		return ids[a] < ids[b];
+	});
+
+	void* copies[Storage::flush_batch];
+	in_flight_.clear();
+	for (size_t i = 0; i < n; ++i)
+	{
+		copies[i] = staging_->getBuffer();
+		memcpy(copies[i], pages[order[i]], meta_.page_size_);
+		in_flight_.push_back(ids[order[i]]);
+	}
+
+	uint64_t lsn = wal_ ? wal_->getLastLsn() : 0;
+	io_lock_.lock();
+	flushing_ = true;
+	unlock();
+
+	if (wal_)
+	{
+		wal_->sync(lsn);
+	}
+
+	struct iovec iov[Storage::flush_batch];
+	size_t start = 0;
+	while (start < n)
+	{
+		size_t end = start;
+		do
+		{
+			iov[end - start].iov_base = copies[end];
+			iov[end - start].iov_len = meta_.page_size_;
+			++end;
+		} while (end < n && end - start < IOV_MAX && in_flight_[end] == in_flight_[end-1] + 1);
+
+		file_->writev(pageOffset(in_flight_[start]), iov, end - start);
+		start = end;
+	}
+
+	flushing_ = false;
+	io_lock_.unlock();
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		staging_->putBack(copies[i]);
+	}
+	return n;
+}
+
+// Starts logging every operation with the given durability. The current
+// state is checkpointed first, so the log only ever holds work done
+// after this call.
+bool Storage::openLog(Durability mode, uint32_t group_window)
+{
+	if (!valid_ || wal_ || mode == Durability::NoLog)
+	{
+		return false;
+	}
+
+	lock();
+	wal_ = new WriteAheadLog(logName().c_str(), mode, group_window);
+	bool ok = wal_->open() && checkpoint();
+	if (!ok)
+	{
+		deletePtr(wal_);
+	}
+	unlock();
+	return ok;
+}
+
+// Ends an operation: logs the after-image of every page it dirtied with
+// the header, then waits as long as the durability mode asks for. The
+// wait happens outside lock_ so concurrent commits can share an fsync.
+// Returns false if the log could not make the operation durable.
+bool Storage::commit()
+{
+	if (!wal_)
+	{
+		return true;
+	}
+
+	lock();
+	uint64_t lsn;
+	if (txn_pages_.empty())
+	{
+		lsn = wal_->getLastLsn();
+	}
+	else
+	{
+		std::vector<void*> pages;
+		for (size_t i = 0; i < txn_pages_.size(); ++i)
+		{
+			pages.push_back(getPage(txn_pages_[i]));
+		}
+		lsn = wal_->append(meta_, &txn_pages_[0], &pages[0],
+						txn_pages_.size(), meta_.page_size_);
+		for (size_t i = 0; i < txn_pages_.size(); ++i)
+		{
+			cache_->clearPending(txn_pages_[i]);
+		}
+		txn_pages_.clear();
+
+		if (wal_->getSize() > Storage::checkpoint_size)
+		{
+			checkpoint();
+		}
+	}
+	unlock();
+
+	return wal_->commit(lsn);
+}
+
+// Called with lock_ held. Writes every committed dirty page and the
+// header to the data file, syncs it and empties the log. The log is
+// kept if any of that fails, so recovery can still replay it.
+bool Storage::checkpoint()
 {
-	return DB_HEADER_SIZE + (page_id - 1) * meta_.page_size_;
+	if (!wal_->sync(wal_->getLastLsn()))
+	{
+		return false;
+	}
+
+	size_t cache_size = cache_->getCacheSize();
+	page_id_t* ids = new page_id_t[cache_size];
+	void** pages = new void*[cache_size];
+
+	bool ok = true;
+	io_lock_.lock();
+	size_t n = cache_->takeDirty(ids, pages, cache_size, cache_size, 0);
+	for (size_t i = 0; i < n; ++i)
+	{
+		ok = (file_->write(pageOffset(ids[i]), pages[i], meta_.page_size_) == meta_.page_size_) && ok;
+	}
+	ok = syncMeta() && ok;
+	ok = file_->sync() && ok;
+	io_lock_.unlock();
+
+	deleteArray(ids);
+	deleteArray(pages);
+	return ok && wal_->reset();
+}
+
+file_offset_t Storage::pageOffset(page_id_t page_id)
+{
+	// page 0 holds the header
+	return (file_offset_t)page_id * meta_.page_size_;
 }
 
 void Storage::storeOverflowData(const void* data, size_t size)
@@ -224,7 +821,7 @@ void Storage::storeOverflowData(const void* data, size_t size)
 	{
 		meta_.overflow_page_ = getNewPage();
 		meta_.overflow_offset_ = sizeof(OverflowPageHeader);
-		page = getPage(meta_.overflow_page_);
+		page = getPageForWrite(meta_.overflow_page_);
 		((OverflowPageHeader*)page)->next_ = 0;
 		((OverflowPageHeader*)page)->off_ = sizeof(OverflowPageHeader);
 	}
@@ -236,7 +833,7 @@ void Storage::storeOverflowData(const void* data, size_t size)
 
 		size_t write_bytes = min(getPageSize() - off, size);
 
-		void* page = getPage(pid);
+		void* page = getPageForWrite(pid);
 		memcpy((byte*)page+off, data, write_bytes);
 
 		data = (byte*)data + write_bytes;
@@ -249,7 +846,7 @@ void Storage::storeOverflowData(const void* data, size_t size)
 			meta_.overflow_page_ = getNewPage();
 			meta_.overflow_offset_ = sizeof(OverflowPageHeader);
 			((OverflowPageHeader*)page)->next_ = meta_.overflow_page_;
-			page = getPage(meta_.overflow_page_);
+			page = getPageForWrite(meta_.overflow_page_);
 			((OverflowPageHeader*)page)->next_ = 0;
 			((OverflowPageHeader*)page)->off_ = sizeof(OverflowPageHeader);
 		}
@@ -258,4 +855,96 @@ void Storage::storeOverflowData(const void* data, size_t size)
 	unlock();
 }
 
-NAMESPACE_END
\ No newline at end of file
+PageHandle::PageHandle():
+	store_(NULL), page_id_(0), page_(NULL)
+{}
+
+PageHandle::PageHandle(Storage* store, page_id_t page_id):
+	store_(store), page_id_(page_id), page_(NULL)
+{
+	page_ = store_->pin(page_id);
+}
+
+PageHandle::PageHandle(PageHandle&& other):
+	store_(other.store_), page_id_(other.page_id_), page_(other.page_)
+{
+	other.page_ = NULL;
+}
+
+PageHandle& PageHandle::operator=(PageHandle&& other)
+{
+	if (this != &other)
+	{
+		reset();
+		store_ = other.store_;
+		page_id_ = other.page_id_;
+		page_ = other.page_;
+		other.page_ = NULL;
+	}
+	return *this;
+}
+
+PageHandle::~PageHandle()
+{
+	reset();
+}
+
+void PageHandle::reset()
+{
+	if (page_)
+	{
+		store_->unpin(page_id_);
+		page_ = NULL;
+	}
+}
+
+void* PageHandle::getForWrite()
+{
+	if (page_)
+	{
+		store_->markDirty(page_id_);
+	}
+	return page_;
+}
+
+ValueView::ValueView():
+	data_(NULL), size_(0), copy_(NULL), valid_(false)
+{
+	copy_ = new Buffer();
+}
+
+ValueView::~ValueView()
+{
+	page_.reset();
+	deletePtr(copy_);
+}
+
+void ValueView::reset()
+{
+	page_.reset();
+	data_ = NULL;
+	size_ = 0;
+	copy_->clear();
+	valid_ = false;
+}
+
+// Points the view at size bytes inside page page_id and pins that page.
+void ValueView::point(Storage* store, page_id_t page_id, const void* data, size_t size)
+{
+	reset();
+	page_ = PageHandle(store, page_id);
+	data_ = data;
+	size_ = size;
+	valid_ = true;
+}
+
+// Switches the view to its own buffer and returns it for the caller to
+// fill with a copy of the value.
+Buffer* ValueView::fill()
+{
+	reset();
+	valid_ = true;
+	return copy_;
+}
+
+NAMESPACE_END
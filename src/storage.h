@@ -2,8 +2,14 @@
 #define _STORAGE_H_
 
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <vector>
+#include <string>
 #include "common.h"
 #include "cache.h"
+#include "wal.h"
 
 NAMESPACE_BEGIN
 
@@ -34,10 +40,22 @@ public:
 	inline size_t getSize() { return used_; }
 };
 
+// Freed pages form a singly linked list headed by DBHeader::free_pages_.
+struct FreePageHeader {
+	page_id_t next_;
+};
+
 class File;
 class MemPool;
 
-class Storage: public CacheSynchronizer {
+class Storage: public CacheSynchronizer, public LogApplier {
+private:
+	static const size_t flush_batch = 64;
+	static const size_t max_cache_shards = 16;
+	static const size_t min_shard_frames = 64;
+	static const size_t pool_growth = 16;
+	static const file_offset_t checkpoint_size = (file_offset_t)64 << 20;
+
 private:
 	DBHeader meta_;
 	File* file_;
@@ -46,14 +64,49 @@ private:
 	bool valid_;
 
 	std::recursive_mutex lock_;
+	// nesting depth of lock_; pages used while it is held stay cached
+	size_t lock_depth_;
+	// meta_.max_page_id_ as seen by lookups that skip lock_; it is only
+	// written under lock_
+	std::atomic<page_id_t> page_limit_;
+
+	// background flusher; it copies dirty pages under lock_ and writes them
+	// under io_lock_, which foreground I/O on an in-flight page must take
+	std::thread flusher_;
+	std::mutex flush_lock_;
+	std::condition_variable flush_cond_;
+	bool stop_flusher_;
+	uint32_t flush_interval_;
+	size_t max_dirty_;
+	size_t clean_reserve_;
+	MemPool* staging_;
+	std::mutex io_lock_;
+	std::atomic<bool> flushing_;
+	std::vector<page_id_t> in_flight_;
+
+	// write-ahead log; pages dirtied since the last commit are kept in
+	// txn_pages_ and pinned in the cache until they are logged
+	WriteAheadLog* wal_;
+	std::vector<page_id_t> txn_pages_;
 
 	bool loadFile();
+	bool upgradeFile(const void* legacy);
 	void initNewFileHeader(const DBConfig& config);
 	bool initCache();
-	void syncMeta();
-	void syncCache(page_id_t page_id, void* page);
-
-	inline offset_t pageOffset(page_id_t page_id);
+	bool syncMeta();
+	void syncCache(page_id_t page_id, void* page, bool dirty);
+	void writeBack(page_id_t page_id, void* page);
+	void* loadPage(page_id_t page_id, PinMode mode);
+	void* fetchPage(page_id_t page_id, PinMode mode);
+	void waitForFlush(page_id_t page_id);
+	void flushLoop();
+	size_t flushDirtyPages();
+	std::string logName();
+	bool checkpoint();
+	void applyMeta(const DBHeader& meta);
+	void applyPage(page_id_t page_id, const void* page, size_t size);
+
+	inline file_offset_t pageOffset(page_id_t page_id);
 
 public:
 	Storage(const char* filename);
@@ -66,21 +119,100 @@ public:
 	void* acquire(page_id_t page_id);
 	void release(page_id_t page_id);
 	void* getPage(page_id_t page_id);
+	void prefetchPage(page_id_t page_id);
+	void releasePages();
+	void* getPageForWrite(page_id_t page_id);
+	void* pin(page_id_t page_id);
+	void* pinCached(page_id_t page_id);
+	void unpin(page_id_t page_id);
+	void markDirty(page_id_t page_id);
 	page_id_t getNewPage();
+	void freePage(page_id_t page_id);
+	page_id_t reservePage();
+	void writePages(const page_id_t* ids, void** pages, size_t count);
+	void syncFile();
+	const char* getFilename();
 
 	void storeOverflowData(const void* data, size_t size);
 
+	void startFlusher(uint32_t interval, uint32_t max_dirty_ratio);
+	void stopFlusher();
+	size_t getDirtyCount();
+	void setCachePolicy(CachePolicy policy);
+
+	bool openLog(Durability mode, uint32_t group_window);
+	bool commit();
+
 	inline bool valid() { return valid_; }
 
-	inline DBType getType() { return meta_.type_; }
+	inline DBType getType() { return (DBType)meta_.type_; }
 	inline size_t getPageSize() { return meta_.page_size_; }
 	inline size_t getMinItems() { return meta_.min_items_; }
+	inline bool getPrefixKeys() { return meta_.prefix_keys_ != 0; }
+	inline KeyOrder getKeyOrder() { return (KeyOrder)meta_.key_order_; }
+	inline bool getKeyHeads() { return meta_.key_heads_ != 0; }
+	inline page_id_t getMaxPageId() { return page_limit_.load(std::memory_order_acquire); }
 	inline page_id_t getRootId() { return meta_.root_id_; }
 	inline void setRootId(page_id_t root) { meta_.root_id_ = root; }
 	inline page_id_t getOverflowPageId() { return meta_.overflow_page_; }
 	inline offset_t getOverflowPageOffset() { return meta_.overflow_offset_; }
 };
 
+// Keeps a page pinned in the cache for as long as the handle lives, so
+// its pointer stays valid whatever else gets loaded meanwhile.
+class PageHandle {
+private:
+	Storage* store_;
+	page_id_t page_id_;
+	void* page_;
+
+public:
+	PageHandle();
+	PageHandle(Storage* store, page_id_t page_id);
+	PageHandle(PageHandle&& other);
+	PageHandle& operator=(PageHandle&& other);
+	~PageHandle();
+
+	PageHandle(const PageHandle&) = delete;
+	PageHandle& operator=(const PageHandle&) = delete;
+
+	void reset();
+	void* getForWrite();
+
+	inline void* get() const { return page_; }
+	inline page_id_t getPageId() const { return page_id_; }
+	inline bool valid() const { return page_ != NULL; }
+};
+
+// A read-only view of a value. Values stored on their page are read in
+// place with the page pinned for the life of the view; overflow values
+// are copied into a buffer the view owns. Any write to the database may
+// move the bytes of an in-place view, so read it before writing.
+class ValueView {
+private:
+	PageHandle page_;
+	const void* data_;
+	size_t size_;
+	Buffer* copy_;
+	bool valid_;
+
+public:
+	ValueView();
+	~ValueView();
+
+	ValueView(const ValueView&) = delete;
+	ValueView& operator=(const ValueView&) = delete;
+
+	void reset();
+	void point(Storage* store, page_id_t page_id, const void* data, size_t size);
+	Buffer* fill();
+
+	inline bool valid() const { return valid_; }
+	inline bool inPlace() const { return page_.valid(); }
+	inline const void* data() const { return page_.valid() ? data_ : copy_->getBuffer(); }
+	inline size_t size() const { return page_.valid() ? size_ : copy_->getSize(); }
+};
+
 NAMESPACE_END
 
 #endif
\ No newline at end of file
@@ -0,0 +1,310 @@
+#include <chrono>
+#include <thread>
+#include "file.h"
+#include "storage.h"
+#include "wal.h"
+
+NAMESPACE_BEGIN
+
+static uint32_t crc_table[256];
+
+static bool initCrcTable()
+{
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k)
+		{
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+	return true;
+}
+
+// crc is the checksum of the bytes before data, so a record may be
+// checksummed in pieces.
+static uint32_t crc32(const void* data, size_t size, uint32_t crc = 0)
+{
+	static bool ready = initCrcTable();
+	(void)ready;
+
+	const byte* p = (const byte*)data;
+	uint32_t c = crc ^ 0xffffffff;
+	for (size_t i = 0; i < size; ++i)
+	{
+		c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffff;
+}
+
+// Checksums size bytes of the log at off through buf, chunk bytes at a
+// time, so a record is verified before anything is sized after it.
+static bool checkRecord(File& log, file_offset_t off, size_t size,
+						uint32_t checksum, byte* buf, size_t chunk)
+{
+	uint32_t crc = 0;
+	while (size > 0)
+	{
+		size_t n = min(size, chunk);
+		if (log.read(off, buf, n) != n)
+		{
+			return false;
+		}
+		crc = crc32(buf, n, crc);
+		off += n;
+		size -= n;
+	}
+	return crc == checksum;
+}
+
+WriteAheadLog::WriteAheadLog(const char* filename, Durability mode, uint32_t window):
+	file_(NULL), mode_(mode), window_(window),
+	buf_(NULL), flush_buf_(NULL), syncing_(false), failed_(false),
+	last_lsn_(0), durable_lsn_(0), size_(0), sync_count_(0)
+{
+	file_ = new File(filename);
+	buf_ = new Buffer();
+	flush_buf_ = new Buffer();
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+	sync(getLastLsn());
+	deletePtr(file_);
+	deletePtr(buf_);
+	deletePtr(flush_buf_);
+}
+
+bool WriteAheadLog::open()
+{
+	return file_->create();
+}
+
+// Applies the log's records in order and stops at the first one that is
+// torn, corrupt or not written for pages of page_size bytes. A record is
+// applied only after its checksum matches; its sizes are checked against
+// what is left of the log before that, so a bad header cannot make
+// replay read or allocate past the end of the file. Returns true if any
+// record was applied.
+bool WriteAheadLog::replay(const char* filename, LogApplier* applier, size_t page_size)
+{
+	File log(filename);
+	if (!log.exist() || !log.open())
+	{
+		return false;
+	}
+
+	bool applied = false;
+	uint64_t last = 0;
+	file_offset_t off = 0;
+	file_offset_t end = log.getSize();
+	LogRecordHeader header;
+	size_t item = sizeof(page_id_t) + page_size;
+	byte* buf = new byte[max(item, sizeof(DBHeader))];
+
+	while (log.read(off, &header, sizeof(header)) == sizeof(header))
+	{
+		if (header.magic_ != WriteAheadLog::log_magic || header.lsn_ <= last
+			|| header.page_size_ != page_size)
+		{
+			break;
+		}
+
+		file_offset_t body = off + sizeof(header);
+		file_offset_t left = end - body;
+		if (left < sizeof(DBHeader) || header.page_count_ > (left - sizeof(DBHeader)) / item)
+		{
+			break;
+		}
+		size_t size = sizeof(DBHeader) + (size_t)header.page_count_ * item;
+		if (!checkRecord(log, body, size, header.checksum_, buf, item))
+		{
+			break;
+		}
+
+		DBHeader meta;
+		bool ok = (log.read(body, &meta, sizeof(meta)) == sizeof(meta));
+		if (ok)
+		{
+			applier->applyMeta(meta);
+		}
+		file_offset_t p = body + sizeof(DBHeader);
+		for (uint32_t i = 0; ok && i < header.page_count_; ++i, p += item)
+		{
+			ok = (log.read(p, buf, item) == item);
+			if (ok)
+			{
+				page_id_t page_id;
+				memcpy(&page_id, buf, sizeof(page_id));
+				applier->applyPage(page_id, buf + sizeof(page_id_t), page_size);
+			}
+		}
+		if (!ok)
+		{
+			break;
+		}
+		applied = true;
+		last = header.lsn_;
+		off = body + size;
+	}
+
+	deleteArray(buf);
+	log.close();
+	return applied;
+}
+
+// Empties the log once the data file holds everything it describes.
+bool WriteAheadLog::reset()
+{
+	if (!sync(getLastLsn()))
+	{
+		return false;
+	}
+
+	std::unique_lock<std::mutex> guard(lock_);
+	while (syncing_)
+	{
+		cond_.wait(guard);
+	}
+	size_ = 0;
+	return file_->truncate(0) && file_->sync();
+}
+
+uint64_t WriteAheadLog::append(const DBHeader& meta, const page_id_t* ids,
+							void* const* pages, size_t count, size_t page_size)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+
+	LogRecordHeader header;
+	header.magic_ = WriteAheadLog::log_magic;
+	header.checksum_ = 0;
+	header.lsn_ = ++last_lsn_;
+	header.page_count_ = count;
+	header.page_size_ = page_size;
+
+	size_t start = buf_->getSize();
+	buf_->append(&header, sizeof(header));
+	buf_->append(&meta, sizeof(meta));
+	for (size_t i = 0; i < count; ++i)
+	{
+		buf_->append(&ids[i], sizeof(page_id_t));
+		buf_->append(pages[i], page_size);
+	}
+
+	byte* record = buf_->getBuffer() + start;
+	header.checksum_ = crc32(record + sizeof(header), buf_->getSize() - start - sizeof(header));
+	memcpy(record, &header, sizeof(header));
+
+	return header.lsn_;
+}
+
+// Called with guard held and no flush running. The caller becomes the
+// leader: everything buffered so far, including records appended by
+// other committers during the group window, goes out with one fsync.
+// A failed write or fsync leaves durable_lsn_ where it was and fails
+// the log for good: after a failed fsync the kernel may have dropped
+// the pages, so no later flush could vouch for them.
+void WriteAheadLog::flush(std::unique_lock<std::mutex>& guard)
+{
+	syncing_ = true;
+	if (mode_ == Durability::GroupCommit && window_ > 0)
+	{
+		guard.unlock();
+		std::this_thread::sleep_for(std::chrono::microseconds(window_));
+		guard.lock();
+	}
+
+	Buffer* tmp = buf_;
+	buf_ = flush_buf_;
+	flush_buf_ = tmp;
+	uint64_t target = last_lsn_;
+	file_offset_t off = size_;
+	size_t size = flush_buf_->getSize();
+
+	guard.unlock();
+	bool ok = true;
+	if (size > 0)
+	{
+		ok = (file_->write(off, flush_buf_->getBuffer(), size) == size) && file_->sync();
+	}
+	guard.lock();
+
+	flush_buf_->clear();
+	if (ok)
+	{
+		size_ += size;
+		durable_lsn_ = target;
+	}
+	else
+	{
+		failed_ = true;
+	}
+	++sync_count_;
+	syncing_ = false;
+	cond_.notify_all();
+}
+
+// Blocks until every record up to lsn is on stable storage. Returns
+// false if the log failed before they got there.
+bool WriteAheadLog::sync(uint64_t lsn)
+{
+	std::unique_lock<std::mutex> guard(lock_);
+	while (durable_lsn_ < lsn)
+	{
+		if (failed_)
+		{
+			return false;
+		}
+		if (syncing_)
+		{
+			cond_.wait(guard);
+		}
+		else
+		{
+			flush(guard);
+		}
+	}
+	return true;
+}
+
+// Waits for lsn as far as the durability mode asks for. Asynchronous
+// commits only flush once enough log has piled up in memory. Returns
+// false once the log has failed, whatever the mode.
+bool WriteAheadLog::commit(uint64_t lsn)
+{
+	bool full;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		if (failed_)
+		{
+			return false;
+		}
+		full = (buf_->getSize() >= WriteAheadLog::async_limit);
+	}
+	if (mode_ != Durability::AsyncCommit || full)
+	{
+		return sync(lsn);
+	}
+	return true;
+}
+
+uint64_t WriteAheadLog::getLastLsn()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return last_lsn_;
+}
+
+file_offset_t WriteAheadLog::getSize()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return size_ + buf_->getSize() + (syncing_ ? flush_buf_->getSize() : 0);
+}
+
+uint64_t WriteAheadLog::getSyncCount()
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	return sync_count_;
+}
+
+NAMESPACE_END
@@ -0,0 +1,75 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <mutex>
+#include <condition_variable>
+#include "common.h"
+
+NAMESPACE_BEGIN
+
+// A record carries the after-image of every page one operation dirtied,
+// plus the file header as of its commit. Replaying records in order over
+// the data file therefore restores the state of the last commit.
+struct LogRecordHeader {
+	uint32_t magic_;
+	uint32_t checksum_;
+	uint64_t lsn_;
+	uint32_t page_count_;
+	uint32_t page_size_;
+};
+
+class File;
+class Buffer;
+
+class LogApplier {
+protected:
+	virtual void applyMeta(const DBHeader& meta) = 0;
+	virtual void applyPage(page_id_t page_id, const void* page, size_t size) = 0;
+	friend class WriteAheadLog;
+};
+
+class WriteAheadLog {
+private:
+	static const uint32_t log_magic = 0x4c4f4743;
+	static const size_t async_limit = 1 << 20;
+
+private:
+	File* file_;
+	Durability mode_;
+	uint32_t window_;
+
+	std::mutex lock_;
+	std::condition_variable cond_;
+	Buffer* buf_;
+	Buffer* flush_buf_;
+	bool syncing_;
+	// a write or fsync of the log failed; nothing is durable from then on
+	bool failed_;
+	uint64_t last_lsn_;
+	uint64_t durable_lsn_;
+	file_offset_t size_;
+	uint64_t sync_count_;
+
+	void flush(std::unique_lock<std::mutex>& guard);
+
+public:
+	WriteAheadLog(const char* filename, Durability mode, uint32_t window);
+	~WriteAheadLog();
+
+	static bool replay(const char* filename, LogApplier* applier, size_t page_size);
+
+	bool open();
+	bool reset();
+	uint64_t append(const DBHeader& meta, const page_id_t* ids,
+					void* const* pages, size_t count, size_t page_size);
+	bool sync(uint64_t lsn);
+	bool commit(uint64_t lsn);
+
+	uint64_t getLastLsn();
+	file_offset_t getSize();
+	uint64_t getSyncCount();
+};
+
+NAMESPACE_END
+
+#endif
@@ -0,0 +1,60 @@
+// Page table benchmark, not part of the unit tests: times cache hit
+// lookups with the old chained table next to the flat one that replaced
+// it.
+//
+//	g++ -std=c++11 -O2 -Isrc tests/bench_cache.cpp src/libcldb.a -pthread
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "cache.h"
+
+int main()
+{
+	const size_t frames = 4096;
+	const size_t lookups = 1 << 22;
+	std::vector<cl::LruNode> nodes(frames);
+	std::vector<cl::page_id_t> ids(frames);
+	cl::HashTable chained;
+	cl::PageTable flat(frames);
+	srand(1);
+	for (size_t i = 0; i < frames; ++i)
+	{
+		ids[i] = rand();
+		chained.set(ids[i], &nodes[i]);
+		flat.set(ids[i], &nodes[i]);
+	}
+	std::vector<cl::page_id_t> order(frames * 64);
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = ids[rand() % frames];
+	}
+
+	// the best of a few alternating rounds keeps scheduling noise out
+	size_t hits = 0;
+	double chained_ns = 1e9, flat_ns = 1e9;
+	for (int round = 0; round < 3; ++round)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lookups; ++i)
+		{
+			hits += chained.get(order[i & (order.size() - 1)]) != NULL;
+		}
+		auto mid = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lookups; ++i)
+		{
+			hits += flat.get(order[i & (order.size() - 1)]) != NULL;
+		}
+		auto end = std::chrono::steady_clock::now();
+		chained_ns = std::min(chained_ns, std::chrono::duration<double, std::nano>(mid - start).count() / lookups);
+		flat_ns = std::min(flat_ns, std::chrono::duration<double, std::nano>(end - mid).count() / lookups);
+	}
+	if (hits != lookups * 6)
+	{
+		fprintf(stderr, "missed %zu lookups\n", lookups * 6 - hits);
+	}
+	printf("chained   %6.2f ns/get\n", chained_ns);
+	printf("flat      %6.2f ns/get\n", flat_ns);
+	return 0;
+}
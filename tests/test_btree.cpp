@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <cstring>
+#include <map>
 #include <string>
+#include <thread>
 #include <vector>
 #include "gtest/gtest.h"
 #include "btree.h"
@@ -22,6 +26,35 @@ void randstr(size_t min_size, size_t max_size, string& ret)
 	}
 }
 
+static string numkey(int i)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%08d", i);
+	return string(buf);
+}
+
+// Levels from the root down to the leftmost leaf; internal pages counts
+// the internal pages met on the way down the leftmost spine.
+static int treeHeight(cl::Storage* store)
+{
+	int height = 1;
+	void* page = store->getPage(store->getRootId());
+	while (((cl::LeafPageHeader*)page)->type_ == cl::BTreePageType::Internal)
+	{
+		cl::InternalPageHeader* header = (cl::InternalPageHeader*)page;
+		cl::page_id_t child = header->last_child_id_;
+		if (header->item_count_ > 0)
+		{
+			// the lower half of a slot is the offset; the upper the key head
+			cl::offset_t off = *(cl::offset_t*)((char*)page + sizeof(cl::InternalPageHeader)) & 0xffff;
+			child = *(cl::page_id_t*)((char*)page + off);
+		}
+		page = store->getPage(child);
+		++height;
+	}
+	return height;
+}
+
 TEST_F(BTreeTest, Test) {
 	const char* filename = ".btree.db";
 	cl::DBConfig config(filename);
@@ -97,6 +130,980 @@ TEST_F(BTreeTest, Test) {
 	delete store;
 }
 
+TEST_F(BTreeTest, PageReuse) {
+	const char* filename = ".btree_reuse.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	int count = 20000;
+	char val[64] = {0};
+	cl::page_id_t max_pages = 0;
+
+	for (int round = 0; round < 3; ++round)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			int k = round * count + i;
+			tree->put(&k, sizeof(k), val, sizeof(val));
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			int k = round * count + i;
+			tree->remove(&k, sizeof(k));
+		}
+		if (round == 0)
+		{
+			max_pages = store->getMaxPageId();
+		}
+	}
+	EXPECT_LE(store->getMaxPageId(), max_pages + max_pages / 10);
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, MergeOnDelete) {
+	const char* filename = ".btree_merge.db";
+	remove(filename);
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	int count = 20000;
+	char val[32] = {0};
+	// descending, so leaves split evenly and stay half full
+	for (int i = count - 1; i >= 0; --i)
+	{
+		string k = numkey(i);
+		tree->put(k.data(), k.size(), val, sizeof(val));
+	}
+	cl::page_id_t max_pages = store->getMaxPageId();
+
+	// thin every leaf out to a tenth; the leaves merge and their pages
+	// are reused by the keys that follow
+	for (int i = 0; i < count; ++i)
+	{
+		if (i % 10 != 0)
+		{
+			string k = numkey(i);
+			tree->remove(k.data(), k.size());
+		}
+	}
+	for (int i = count; i < count + count * 8 / 10; ++i)
+	{
+		string k = numkey(i);
+		tree->put(k.data(), k.size(), val, sizeof(val));
+	}
+	EXPECT_LE(store->getMaxPageId(), max_pages + max_pages / 10);
+
+	cl::Cursor* cur = tree->newCursor();
+	vector<int> seen;
+	for (cur->seekToFirst(); cur->valid(); cur->next())
+	{
+		seen.push_back(atoi(string((const char*)cur->key(), cur->keySize()).c_str()));
+	}
+	size_t forward = seen.size();
+	for (cur->seekToLast(); cur->valid(); cur->prev())
+	{
+		seen.push_back(atoi(string((const char*)cur->key(), cur->keySize()).c_str()));
+	}
+	ASSERT_EQ(forward, (size_t)(count / 10 + count * 8 / 10));
+	ASSERT_EQ(seen.size(), forward * 2);
+	for (size_t i = 0; i < forward; ++i)
+	{
+		int expect = i < (size_t)count / 10 ? i * 10 : count + (i - count / 10);
+		ASSERT_EQ(seen[i], expect);
+		ASSERT_EQ(seen[forward * 2 - 1 - i], expect);
+	}
+	delete cur;
+
+	// emptying the tree collapses it back to a single leaf
+	for (size_t i = 0; i < forward; ++i)
+	{
+		string k = numkey(seen[i]);
+		tree->remove(k.data(), k.size());
+	}
+	string k = numkey(7);
+	tree->put(k.data(), k.size(), val, sizeof(val));
+	cur = tree->newCursor();
+	cur->seekToFirst();
+	ASSERT_TRUE(cur->valid());
+	cur->next();
+	EXPECT_FALSE(cur->valid());
+	delete cur;
+	void* root = store->getPage(store->getRootId());
+	EXPECT_EQ(((cl::LeafPageHeader*)root)->type_, cl::BTreePageType::Leaf);
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, SmallCache) {
+	const char* filename = ".btree_small.db";
+	cl::DBConfig config(filename);
+	config.cache_size_ = 16;
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	// splits touch more pages than the cache holds; none of them may be
+	// evicted while the split still uses it
+	int count = 20000;
+	for (int i = 0; i < count; ++i)
+	{
+		tree->put(&i, sizeof(i), &i, sizeof(i));
+	}
+
+	int r;
+	for (int i = 0; i < count; ++i)
+	{
+		EXPECT_EQ(tree->get(&i, sizeof(i), &r, sizeof(r)), sizeof(r));
+		EXPECT_EQ(r, i);
+	}
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, Cursor) {
+	const char* filename = ".btree_cursor.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	// even keys only, so seeks can land between two of them
+	int count = 20000;
+	for (int i = 0; i < count; i += 2)
+	{
+		string k = numkey(i);
+		tree->put(k.data(), k.size(), &i, sizeof(i));
+	}
+
+	cl::Cursor* cur = tree->newCursor();
+	int n = 0;
+	for (cur->seekToFirst(); cur->valid(); cur->next(), n += 2)
+	{
+		ASSERT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(n));
+		ASSERT_EQ(*(const int*)cur->value(), n);
+	}
+	EXPECT_EQ(n, count);
+
+	for (cur->seekToLast(); cur->valid(); cur->prev())
+	{
+		n -= 2;
+		ASSERT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(n));
+	}
+	EXPECT_EQ(n, 0);
+
+	string k = numkey(1001);
+	cur->seek(k.data(), k.size());
+	ASSERT_TRUE(cur->valid());
+	EXPECT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(1002));
+
+	// [5001, 6000) holds 5002 .. 5998
+	string start = numkey(5001);
+	string end = numkey(6000);
+	cur->setRange(start.data(), start.size(), end.data(), end.size());
+	n = 5002;
+	for (cur->seekToFirst(); cur->valid(); cur->next(), n += 2)
+	{
+		ASSERT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(n));
+	}
+	EXPECT_EQ(n, 6000);
+	cur->seekToLast();
+	ASSERT_TRUE(cur->valid());
+	EXPECT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(5998));
+
+	// the tree changes under the cursor: it picks up from its last key
+	cur->setRange(NULL, 0, NULL, 0);
+	k = numkey(100);
+	cur->seek(k.data(), k.size());
+	for (int i = 101; i < 200; i += 2)
+	{
+		string ik = numkey(i);
+		tree->put(ik.data(), ik.size(), &i, sizeof(i));
+	}
+	k = numkey(102);
+	tree->remove(k.data(), k.size());
+	cur->next();
+	EXPECT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(101));
+	cur->next();
+	EXPECT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(103));
+	cur->prev();
+	EXPECT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(101));
+	delete cur;
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, ValueView) {
+	const char* filename = ".btree_view.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	string small("small value");
+	string large;
+	randstr(3 * config.page_size_, 3 * config.page_size_, large);
+	tree->put("a", 1, small.data(), small.size());
+	tree->put("b", 1, large.data(), large.size());
+
+	cl::ValueView view;
+	ASSERT_TRUE(tree->get("a", 1, &view));
+	EXPECT_TRUE(view.inPlace());
+	EXPECT_EQ(string((const char*)view.data(), view.size()), small);
+
+	// overflow values come back as a copy
+	ASSERT_TRUE(tree->get("b", 1, &view));
+	EXPECT_FALSE(view.inPlace());
+	EXPECT_EQ(string((const char*)view.data(), view.size()), large);
+
+	EXPECT_FALSE(tree->get("c", 1, &view));
+	EXPECT_FALSE(view.valid());
+
+	view.reset();
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+// Bytewise, but as a custom order: the tree cannot look at the local
+// bytes of an off-page key and reads the whole key for every compare.
+static int32_t customBytes(const void* a, size_t asize, const void* b, size_t bsize)
+{
+	int32_t r = memcmp(a, b, std::min(asize, bsize));
+	return (r != 0 ? r : (int32_t)asize - (int32_t)bsize);
+}
+
+// Gets every key of probes from a tree built over keys and ordered by
+// comparator (bytewise if NULL); found[i] is the index of probes[i] in
+// keys, or -1 if the tree does not have it.
+static void lookupAll(const vector<string>& keys, const vector<string>& probes,
+	cl::KeyComparator comparator, vector<int64_t>& found)
+{
+	const char* filename = ".btree_search.db";
+	remove(filename);
+	cl::DBConfig config(filename);
+	config.cache_size_ = 64;
+	config.comparator_ = comparator;
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store, comparator);
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		int64_t v = i;
+		tree->put(keys[i].data(), keys[i].size(), &v, sizeof(v));
+	}
+
+	found.assign(probes.size(), -1);
+	for (size_t i = 0; i < probes.size(); ++i)
+	{
+		int64_t v;
+		if (tree->get(probes[i].data(), probes[i].size(), &v, sizeof(v)) == sizeof(v))
+		{
+			found[i] = v;
+		}
+	}
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, InPlaceSearch) {
+	const int count = 5000;
+
+	// keys too long for their page: the bytewise tree settles compares on
+	// the local part of the key, the custom one reads the whole key each
+	// time, and both must find the same keys. The probes also ask for
+	// keys that differ only past the local part, or are a prefix of a
+	// key, or sort before or after every key.
+	vector<string> keys(count);
+	for (int i = 0; i < count; ++i)
+	{
+		keys[i] = numkey(i * 7919 % count) + string(1200, 'k');
+	}
+	vector<string> probes(keys);
+	for (int i = 0; i < count; i += 7)
+	{
+		probes.push_back(numkey(i) + string(1199, 'k') + "j");
+		probes.push_back(numkey(i) + string(1201, 'k'));
+		probes.push_back(numkey(i) + string(600, 'k'));
+		probes.push_back(numkey(i));
+	}
+	probes.push_back("");
+	probes.push_back(numkey(count) + string(1200, 'k'));
+
+	vector<int64_t> in_place, read_all;
+	lookupAll(keys, probes, NULL, in_place);
+	lookupAll(keys, probes, customBytes, read_all);
+	EXPECT_EQ(in_place, read_all);
+	for (int i = 0; i < count; ++i)
+	{
+		EXPECT_EQ(in_place[i], i);
+	}
+	for (size_t i = count; i < probes.size(); ++i)
+	{
+		EXPECT_EQ(in_place[i], -1);
+	}
+}
+
+TEST_F(BTreeTest, BulkLoad) {
+	const char* filename = ".btree_bulk.db";
+	const int count = 30000;
+	remove(filename);
+	cl::DBConfig config(filename);
+	config.cache_size_ = 64;
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	// shuffled, every key twice with the second value winning, a few
+	// overflow values, and little sort memory so that runs get spilled
+	vector<int> order(count);
+	for (int i = 0; i < count; ++i)
+	{
+		order[i] = i;
+	}
+	std::random_shuffle(order.begin(), order.end());
+	string large;
+	randstr(3 * config.page_size_, 3 * config.page_size_, large);
+	cl::BulkLoader* loader = new cl::BulkLoader(tree, 1.0, 64 << 10);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			string k = numkey(order[i]);
+			int v = order[i] + pass;
+			if (order[i] % 1000 == 0)
+			{
+				loader->add(k.data(), k.size(), large.data(), large.size());
+			}
+			else
+			{
+				loader->add(k.data(), k.size(), &v, sizeof(v));
+			}
+		}
+	}
+	ASSERT_TRUE(loader->finish());
+	delete loader;
+
+	int r;
+	string v;
+	for (int i = 0; i < count; ++i)
+	{
+		string k = numkey(i);
+		if (i % 1000 == 0)
+		{
+			v.resize(large.size());
+			ASSERT_EQ(tree->get(k.data(), k.size(), &v[0], v.size()), large.size());
+			EXPECT_EQ(v, large);
+		}
+		else
+		{
+			ASSERT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+			EXPECT_EQ(r, i + 1);
+		}
+	}
+
+	cl::Cursor* cur = tree->newCursor();
+	int n = 0;
+	for (cur->seekToLast(); cur->valid(); cur->prev())
+	{
+		++n;
+		ASSERT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(count - n));
+	}
+	EXPECT_EQ(n, count);
+	delete cur;
+
+	// the loaded tree keeps working with ordinary updates
+	for (int i = 0; i < count; i += 3)
+	{
+		string k = numkey(i);
+		tree->remove(k.data(), k.size());
+	}
+	for (int i = count; i < count + 5000; ++i)
+	{
+		string k = numkey(i);
+		tree->put(k.data(), k.size(), &i, sizeof(i));
+	}
+	for (int i = 1; i < count + 5000; i += 3)
+	{
+		string k = numkey(i);
+		EXPECT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+	}
+
+	// only an empty tree can be loaded
+	loader = new cl::BulkLoader(tree);
+	loader->add("a", 1, "b", 1);
+	EXPECT_FALSE(loader->finish());
+	delete loader;
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, BulkLoadPacksPages) {
+	const char* filename = ".btree_packed.db";
+	const int count = 20000;
+	cl::page_id_t pages[3];
+
+	// descending puts, which split leaves evenly, then bulk loads at fill
+	// factors 1.0 and 0.5
+	for (int run = 0; run < 3; ++run)
+	{
+		remove(filename);
+		cl::DBConfig config(filename);
+		cl::Storage* store = new cl::Storage(config);
+		cl::BTree* tree = new cl::BTree(store);
+		cl::BulkLoader* loader = run ? new cl::BulkLoader(tree, run == 1 ? 1.0 : 0.5) : NULL;
+		for (int n = 0; n < count; ++n)
+		{
+			int i = (loader ? n : count - 1 - n);
+			string k = numkey(i);
+			if (loader)
+			{
+				loader->add(k.data(), k.size(), &i, sizeof(i));
+			}
+			else
+			{
+				tree->put(k.data(), k.size(), &i, sizeof(i));
+			}
+		}
+		if (loader)
+		{
+			ASSERT_TRUE(loader->finish());
+			delete loader;
+		}
+		int r;
+		string k = numkey(count / 3);
+		EXPECT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+		EXPECT_EQ(r, count / 3);
+		pages[run] = store->getMaxPageId();
+		delete tree;
+		delete store;
+	}
+	remove(filename);
+
+	EXPECT_LT(pages[1] * 3, pages[0] * 2);
+	EXPECT_GT(pages[2], pages[1] * 3 / 2);
+}
+
+TEST_F(BTreeTest, PrefixKeys) {
+	const char* filename = ".btree_prefix.db";
+	const int count = 20000;
+	cl::page_id_t pages[2];
+	vector<int> order;
+	for (int i = 0; i < count; ++i)
+	{
+		order.push_back(i);
+	}
+	random_shuffle(order.begin(), order.end());
+
+	// the same keys, with their long common prefixes stored per key and
+	// then once per leaf
+	for (int run = 0; run < 2; ++run)
+	{
+		remove(filename);
+		cl::DBConfig config(filename);
+		config.prefix_keys_ = (run == 1);
+		cl::Storage* store = new cl::Storage(config);
+		cl::BTree* tree = new cl::BTree(store);
+		for (int i = 0; i < count; ++i)
+		{
+			string k = "/users/" + numkey(order[i] / 1000) + "/sessions/" + numkey(order[i]);
+			tree->put(k.data(), k.size(), &order[i], sizeof(int));
+		}
+		pages[run] = store->getMaxPageId();
+		delete tree;
+		delete store;
+	}
+	EXPECT_LT(pages[1] * 3, pages[0] * 2);
+
+	// the flag is kept in the file header
+	cl::Storage* store = new cl::Storage(filename);
+	cl::BTree* tree = new cl::BTree(store);
+	EXPECT_TRUE(store->getPrefixKeys());
+	int r;
+	for (int i = 0; i < count; ++i)
+	{
+		string k = "/users/" + numkey(i / 1000) + "/sessions/" + numkey(i);
+		ASSERT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, i);
+	}
+	string k = "/users/";
+	EXPECT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), 0u);
+
+	// keys that share less of the prefix shrink it on their leaves
+	for (int i = 0; i < count; i += 100)
+	{
+		k = "/users/" + numkey(i / 1000) + "/x" + numkey(i);
+		tree->put(k.data(), k.size(), &i, sizeof(i));
+		k = "/u" + numkey(i);
+		tree->put(k.data(), k.size(), &i, sizeof(i));
+	}
+	for (int i = 0; i < count; i += 2)
+	{
+		k = "/users/" + numkey(i / 1000) + "/sessions/" + numkey(i);
+		tree->remove(k.data(), k.size());
+	}
+
+	cl::Cursor* cur = tree->newCursor();
+	string last;
+	size_t seen = 0;
+	for (cur->seekToFirst(); cur->valid(); cur->next())
+	{
+		string key((const char*)cur->key(), cur->keySize());
+		ASSERT_LT(last, key);
+		last = key;
+		++seen;
+	}
+	EXPECT_EQ(seen, (size_t)(count / 2 + count / 50));
+	delete cur;
+	for (int i = 0; i < count; i += 100)
+	{
+		k = "/users/" + numkey(i / 1000) + "/x" + numkey(i);
+		ASSERT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, i);
+		k = "/u" + numkey(i);
+		ASSERT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, i);
+	}
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+// Longest key among the separators of internal page page_id.
+static size_t maxSeparatorSize(cl::Storage* store, cl::page_id_t page_id)
+{
+	void* page = store->getPage(page_id);
+	cl::InternalPageHeader* header = (cl::InternalPageHeader*)page;
+	cl::offset_t* slots = (cl::offset_t*)((char*)page + sizeof(cl::InternalPageHeader));
+	size_t size = 0;
+	for (size_t i = 0; i < header->item_count_; ++i)
+	{
+		char* item = (char*)page + (slots[i] & 0xffff) + sizeof(cl::page_id_t);
+		size = std::max(size, cl::getItemLocalDataSize(item));
+	}
+	return size;
+}
+
+TEST_F(BTreeTest, SeparatorTruncation) {
+	const char* filename = ".btree_sep.db";
+	const int count = 200000;
+	remove(filename);
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	// long keys that differ early: full-key separators would hold about
+	// 25 children per internal page, truncated ones a few hundred
+	string tail(120, 'x');
+	for (int i = 0; i < count; ++i)
+	{
+		string k = numkey(rand() % count) + tail;
+		tree->put(k.data(), k.size(), &i, sizeof(i));
+	}
+	// keys are told apart by their first 8 bytes, so no separator needs
+	// more, where a full key would take 128
+	EXPECT_LE(maxSeparatorSize(store, store->getRootId()), 8u);
+	EXPECT_LE(treeHeight(store), 3);
+
+	cl::Cursor* cur = tree->newCursor();
+	string last;
+	for (cur->seekToFirst(); cur->valid(); cur->next())
+	{
+		string key((const char*)cur->key(), cur->keySize());
+		ASSERT_LT(last, key);
+		last = key;
+		int r;
+		ASSERT_EQ(tree->get(cur->key(), cur->keySize(), &r, sizeof(r)), sizeof(r));
+	}
+	delete cur;
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, MixedSeparatorSizes) {
+	const char* filename = ".btree_mixed.db";
+	const int ops = 20000;
+	remove(filename);
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+
+	// short binary keys truncate to separators of a byte or two; long keys
+	// sharing hundreds of leading bytes give off-page separators, so
+	// internal pages mix items of very different sizes
+	srand(7);
+	std::map<string, string> expect;
+	for (int i = 0; i < ops; ++i)
+	{
+		string k;
+		if (rand() % 100 < 3)
+		{
+			k = string(600 + rand() % 3000, (char)(rand() % 3));
+			k += (char)rand();
+		}
+		else
+		{
+			k.resize(1 + rand() % 8);
+			for (size_t j = 0; j < k.size(); ++j)
+			{
+				k[j] = (char)rand();
+			}
+		}
+		if (rand() % 4 == 0)
+		{
+			tree->remove(k.data(), k.size());
+			expect.erase(k);
+		}
+		else
+		{
+			string v(rand() % 100, (char)i);
+			tree->put(k.data(), k.size(), v.data(), v.size());
+			expect[k] = v;
+		}
+	}
+
+	char buf[128];
+	for (std::map<string, string>::iterator it = expect.begin(); it != expect.end(); ++it)
+	{
+		size_t l = tree->get(it->first.data(), it->first.size(), buf, sizeof(buf));
+		ASSERT_EQ(string(buf, l), it->second);
+	}
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, KeyHeads) {
+	const char* filename = ".btree_heads.db";
+	const char alphabet[] = { 0, 1, 'a', (char)255 };
+	remove(filename);
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+	ASSERT_TRUE(store->getKeyHeads());
+
+	// short keys over a tiny alphabet: many share a head, and zero bytes
+	// look like the padding of shorter keys
+	std::map<string, int> expect;
+	for (int i = 0; i < 50000; ++i)
+	{
+		string k(rand() % 6, 0);
+		for (size_t j = 0; j < k.size(); ++j)
+		{
+			k[j] = alphabet[rand() % 4];
+		}
+		if (rand() % 4 == 0)
+		{
+			tree->remove(k.data(), k.size());
+			expect.erase(k);
+		}
+		else
+		{
+			tree->put(k.data(), k.size(), &i, sizeof(i));
+			expect[k] = i;
+		}
+	}
+
+	int r;
+	for (std::map<string, int>::iterator it = expect.begin(); it != expect.end(); ++it)
+	{
+		ASSERT_EQ(tree->get(it->first.data(), it->first.size(), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, it->second);
+	}
+	cl::Cursor* cur = tree->newCursor();
+	std::map<string, int>::iterator it = expect.begin();
+	for (cur->seekToFirst(); cur->valid(); cur->next(), ++it)
+	{
+		ASSERT_TRUE(it != expect.end());
+		ASSERT_EQ(string((const char*)cur->key(), cur->keySize()), it->first);
+	}
+	EXPECT_TRUE(it == expect.end());
+	delete cur;
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+// Value of key i: i itself, padded to size; long ones go off the page.
+static string numval(int i, size_t size)
+{
+	string v(size, (char)i);
+	memcpy(&v[0], &i, sizeof(i));
+	return v;
+}
+
+TEST_F(BTreeTest, ConcurrentReads) {
+	const char* filename = ".btree_concurrent.db";
+	const int count = 20000;
+	const int readers = 4;
+	remove(filename);
+	cl::DBConfig config(filename);
+	config.cache_size_ = 64;
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+	tree->setConcurrentReads(true);
+
+	for (int i = 0; i < count; ++i)
+	{
+		string k = numkey(i), v = numval(i, i % 50 == 0 ? 3000 : 8);
+		tree->put(k.data(), k.size(), v.data(), v.size());
+	}
+
+	// the lower half stays in the tree, changing value size as it is
+	// rewritten; the upper half comes and goes, splitting and merging pages
+	std::atomic<bool> done(false);
+	std::atomic<int> errors(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < readers; ++t)
+	{
+		threads.push_back(std::thread([tree, t, &done, &errors]() {
+			unsigned seed = t;
+			char buf[4096];
+			while (!done.load())
+			{
+				int i = rand_r(&seed) % count;
+				string k = numkey(i);
+				size_t size = tree->get(k.data(), k.size(), buf, sizeof(buf));
+				int r;
+				memcpy(&r, buf, sizeof(r));
+				if ((size == 0 && i < count / 2) ||
+					(size != 0 && (size < sizeof(r) || r != i)))
+				{
+					++errors;
+				}
+			}
+		}));
+	}
+
+	for (int round = 0; round < 4; ++round)
+	{
+		for (int i = count / 2; i < count; ++i)
+		{
+			string k = numkey(i);
+			tree->remove(k.data(), k.size());
+		}
+		for (int i = 0; i < count; ++i)
+		{
+			string k = numkey(i), v = numval(i, (i + round) % 7 == 0 ? 3000 : 8 + round);
+			tree->put(k.data(), k.size(), v.data(), v.size());
+		}
+	}
+	done.store(true);
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	EXPECT_EQ(errors.load(), 0);
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+TEST_F(BTreeTest, AppendSplit) {
+	const char* filename = ".btree_append.db";
+	const int count = 100000;
+	cl::page_id_t pages[2];
+	vector<int> order;
+	for (int i = 0; i < count; ++i)
+	{
+		order.push_back(i);
+	}
+
+	// ascending keys fill their leaves almost to the brim; the same keys in
+	// random order leave the usual slack
+	for (int run = 0; run < 2; ++run)
+	{
+		remove(filename);
+		if (run == 1)
+		{
+			random_shuffle(order.begin(), order.end());
+		}
+		cl::DBConfig config(filename);
+		cl::Storage* store = new cl::Storage(config);
+		cl::BTree* tree = new cl::BTree(store);
+		for (int i = 0; i < count; ++i)
+		{
+			string k = numkey(order[i]);
+			tree->put(k.data(), k.size(), &order[i], sizeof(int));
+		}
+		pages[run] = store->getMaxPageId();
+		delete tree;
+		delete store;
+	}
+	EXPECT_LT(pages[0] * 6, pages[1] * 5);
+
+	// the rightmost leaf goes away under deletes and comes back under
+	// appends
+	cl::Storage* store = new cl::Storage(filename);
+	cl::BTree* tree = new cl::BTree(store);
+	int next = count;
+	for (int round = 0; round < 3; ++round)
+	{
+		for (int i = next - 5000; i < next; ++i)
+		{
+			string k = numkey(i);
+			tree->remove(k.data(), k.size());
+		}
+		next -= 5000;
+		for (int i = next; i < next + 8000; ++i)
+		{
+			string k = numkey(i);
+			tree->put(k.data(), k.size(), &i, sizeof(i));
+		}
+		next += 8000;
+	}
+	int r;
+	for (int i = 0; i < next; ++i)
+	{
+		string k = numkey(i);
+		ASSERT_EQ(tree->get(k.data(), k.size(), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, i);
+	}
+	cl::Cursor* cur = tree->newCursor();
+	int seen = 0;
+	for (cur->seekToFirst(); cur->valid(); cur->next(), ++seen)
+	{
+		ASSERT_EQ(string((const char*)cur->key(), cur->keySize()), numkey(seen));
+	}
+	EXPECT_EQ(seen, next);
+	delete cur;
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
+// Keeps the keys handed to it and counts values not matching their key.
+class KeyCollector: public cl::Iterator {
+public:
+	vector<string> keys_;
+	int errors_;
+
+	KeyCollector(): errors_(0) {}
+
+	void process(const void* key, size_t ksize, const void* val, size_t vsize)
+	{
+		keys_.push_back(string((const char*)key, ksize));
+		int i;
+		memcpy(&i, val, sizeof(i));
+		if (vsize < sizeof(i) || numkey(i) != keys_.back())
+		{
+			++errors_;
+		}
+	}
+};
+
+TEST_F(BTreeTest, ParallelScan) {
+	const char* filename = ".btree_scan.db";
+	const int count = 20000;
+	const int threads = 4;
+	remove(filename);
+	cl::DBConfig config(filename);
+	config.cache_size_ = 64;
+	cl::Storage* store = new cl::Storage(config);
+	cl::BTree* tree = new cl::BTree(store);
+	for (int i = 0; i < count; ++i)
+	{
+		string k = numkey(i), v = numval(i, i % 50 == 0 ? 3000 : 8);
+		tree->put(k.data(), k.size(), v.data(), v.size());
+	}
+
+	// every worker gets its pieces in key order, and together they cover
+	// the range once
+	string start = numkey(5000), end = numkey(15000);
+	KeyCollector sinks[threads];
+	cl::Iterator* iters[threads];
+	for (int t = 0; t < threads; ++t)
+	{
+		iters[t] = &sinks[t];
+	}
+	tree->scan(start.data(), start.size(), end.data(), end.size(), iters, threads);
+	vector<string> all;
+	for (int t = 0; t < threads; ++t)
+	{
+		EXPECT_EQ(sinks[t].errors_, 0);
+		EXPECT_TRUE(std::is_sorted(sinks[t].keys_.begin(), sinks[t].keys_.end()));
+		all.insert(all.end(), sinks[t].keys_.begin(), sinks[t].keys_.end());
+	}
+	std::sort(all.begin(), all.end());
+	ASSERT_EQ(all.size(), 10000u);
+	for (int i = 0; i < 10000; ++i)
+	{
+		ASSERT_EQ(all[i], numkey(5000 + i));
+	}
+
+	KeyCollector ordered;
+	tree->traverse(&ordered, threads);
+	EXPECT_EQ(ordered.errors_, 0);
+	ASSERT_EQ(ordered.keys_.size(), (size_t)count);
+	for (int i = 0; i < count; ++i)
+	{
+		ASSERT_EQ(ordered.keys_[i], numkey(i));
+	}
+
+	// with concurrent reads the scan runs beside a writer: the lower half
+	// stays, rewritten with other value sizes, the upper half comes and goes
+	tree->setConcurrentReads(true);
+	std::atomic<bool> done(false);
+	std::thread writer([tree, &done]() {
+		for (int round = 0; !done.load(); ++round)
+		{
+			for (int i = count / 2; i < count; ++i)
+			{
+				string k = numkey(i);
+				tree->remove(k.data(), k.size());
+			}
+			for (int i = 0; i < count; ++i)
+			{
+				string k = numkey(i), v = numval(i, (i + round) % 7 == 0 ? 3000 : 8 + round % 8);
+				tree->put(k.data(), k.size(), v.data(), v.size());
+			}
+		}
+	});
+	int errors = 0;
+	for (int pass = 0; pass < 4; ++pass)
+	{
+		KeyCollector live;
+		tree->traverse(&live, threads);
+		errors += live.errors_;
+		if (live.keys_.size() < (size_t)count / 2)
+		{
+			++errors;
+			continue;
+		}
+		for (int i = 0; i < count / 2; ++i)
+		{
+			errors += (live.keys_[i] != numkey(i));
+		}
+		for (size_t i = 1; i < live.keys_.size(); ++i)
+		{
+			errors += (live.keys_[i-1] >= live.keys_[i]);
+		}
+	}
+	done.store(true);
+	writer.join();
+	EXPECT_EQ(errors, 0);
+
+	delete tree;
+	delete store;
+	remove(filename);
+}
+
 int main(int argc, char *argv[])
 {
 	srand(time(NULL));
@@ -1,4 +1,12 @@
+#include <algorithm>
 #include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include "gtest/gtest.h"
 #include "cache.h"
@@ -10,22 +18,22 @@ TEST_F(HashTableTest, Test) {
 	int count = 100000;
 	for (int i = 0; i < count; ++i)
 	{
-		table->set(i, (cl::LruNode*)i);
+		table->set(i, (cl::LruNode*)(size_t)i);
 	}
 	for (int i = 0; i < count; ++i)
 	{
-		EXPECT_EQ((cl::LruNode*)i, table->get(i));
+		EXPECT_EQ((cl::LruNode*)(size_t)i, table->get(i));
 	}
 	for (int i = 0; i < count; i+=2)
 	{
-		table->set(i, (cl::LruNode*)(i<<1));
+		table->set(i, (cl::LruNode*)(size_t)(i<<1));
 	}
 	for (int i = 0; i < count; ++i)
 	{
 		if (i & 1)
-			EXPECT_EQ((cl::LruNode*)i, table->get(i));
+			EXPECT_EQ((cl::LruNode*)(size_t)i, table->get(i));
 		else
-			EXPECT_EQ((cl::LruNode*)(i<<1), table->get(i));
+			EXPECT_EQ((cl::LruNode*)(size_t)(i<<1), table->get(i));
 	}
 	for (int i = 0; i < count; i+=3)
 	{
@@ -45,6 +53,187 @@ TEST_F(HashTableTest, Test) {
 	delete table;
 }
 
+class PageTableTest: public ::testing::Test {};
+
+TEST_F(PageTableTest, Test) {
+	cl::PageTable table(64);
+	std::map<cl::page_id_t, cl::LruNode*> expect;
+	srand(1);
+	for (int i = 0; i < 100000; ++i)
+	{
+		cl::page_id_t pid = rand() % 256;
+		if (rand() % 3 == 0)
+		{
+			table.del(pid);
+			expect.erase(pid);
+		}
+		else
+		{
+			cl::LruNode* node = (cl::LruNode*)(size_t)(i + 1);
+			table.set(pid, node);
+			expect[pid] = node;
+		}
+	}
+	for (cl::page_id_t pid = 0; pid < 256; ++pid)
+	{
+		auto it = expect.find(pid);
+		EXPECT_EQ(table.get(pid), it == expect.end() ? (cl::LruNode*)NULL : it->second);
+	}
+}
+
+// The first n page ids whose home slot in a table of slots slots is home.
+static std::vector<cl::page_id_t> homedAt(size_t home, size_t slots, size_t n)
+{
+	std::vector<cl::page_id_t> ids;
+	for (cl::page_id_t pid = 1; ids.size() < n; ++pid)
+	{
+		if ((cl::HashTable::hashFunc(pid) & (slots - 1)) == home)
+		{
+			ids.push_back(pid);
+		}
+	}
+	return ids;
+}
+
+TEST_F(PageTableTest, SetGetDel) {
+	cl::PageTable table(8);
+	cl::LruNode* a = (cl::LruNode*)(size_t)0x10;
+	cl::LruNode* b = (cl::LruNode*)(size_t)0x20;
+	EXPECT_EQ(table.get(1), (cl::LruNode*)NULL);
+
+	table.set(1, a);
+	table.set(2, b);
+	EXPECT_EQ(table.get(1), a);
+	EXPECT_EQ(table.get(2), b);
+	EXPECT_EQ(table.get(3), (cl::LruNode*)NULL);
+
+	// set replaces, del of a missing page changes nothing
+	table.set(1, b);
+	EXPECT_EQ(table.get(1), b);
+	table.del(3);
+	EXPECT_EQ(table.get(1), b);
+	EXPECT_EQ(table.get(2), b);
+
+	table.del(1);
+	EXPECT_EQ(table.get(1), (cl::LruNode*)NULL);
+	EXPECT_EQ(table.get(2), b);
+	table.set(1, a);
+	EXPECT_EQ(table.get(1), a);
+
+	// growing past the capacity keeps every page
+	for (cl::page_id_t pid = 100; pid < 200; ++pid)
+	{
+		table.set(pid, (cl::LruNode*)(size_t)pid);
+	}
+	EXPECT_EQ(table.get(1), a);
+	EXPECT_EQ(table.get(2), b);
+	for (cl::page_id_t pid = 100; pid < 200; ++pid)
+	{
+		EXPECT_EQ(table.get(pid), (cl::LruNode*)(size_t)pid);
+	}
+}
+
+// A table for 8 pages has 16 slots and grows only past 8 pages, so the
+// runs below stay where they are put.
+TEST_F(PageTableTest, BackwardShift) {
+	const size_t slots = 16;
+	cl::PageTable table(8);
+
+	// x0..x2 share home slot 5 and fill 5..7, y has home 6 and lands on
+	// 8, z has home 9 and stays there
+	std::vector<cl::page_id_t> x = homedAt(5, slots, 3);
+	cl::page_id_t y = homedAt(6, slots, 1)[0];
+	cl::page_id_t z = homedAt(9, slots, 1)[0];
+	std::vector<cl::page_id_t> all(x);
+	all.push_back(y);
+	all.push_back(z);
+	for (size_t i = 0; i < all.size(); ++i)
+	{
+		table.set(all[i], (cl::LruNode*)(size_t)(all[i] + 1));
+	}
+
+	// deleting the middle of the run moves x2 and y back a slot; the
+	// run must not be cut at the hole, and z must not move before its
+	// home
+	table.del(x[1]);
+	EXPECT_EQ(table.get(x[1]), (cl::LruNode*)NULL);
+	for (size_t i = 0; i < all.size(); ++i)
+	{
+		if (all[i] != x[1])
+		{
+			EXPECT_EQ(table.get(all[i]), (cl::LruNode*)(size_t)(all[i] + 1));
+		}
+	}
+
+	// and again from the head of the run, then refill it
+	table.del(x[0]);
+	EXPECT_EQ(table.get(x[0]), (cl::LruNode*)NULL);
+	EXPECT_EQ(table.get(x[2]), (cl::LruNode*)(size_t)(x[2] + 1));
+	EXPECT_EQ(table.get(y), (cl::LruNode*)(size_t)(y + 1));
+	EXPECT_EQ(table.get(z), (cl::LruNode*)(size_t)(z + 1));
+	table.set(x[0], (cl::LruNode*)(size_t)7);
+	table.set(x[1], (cl::LruNode*)(size_t)9);
+	EXPECT_EQ(table.get(x[0]), (cl::LruNode*)(size_t)7);
+	EXPECT_EQ(table.get(x[1]), (cl::LruNode*)(size_t)9);
+	EXPECT_EQ(table.get(x[2]), (cl::LruNode*)(size_t)(x[2] + 1));
+	EXPECT_EQ(table.get(y), (cl::LruNode*)(size_t)(y + 1));
+}
+
+TEST_F(PageTableTest, Wraparound) {
+	const size_t slots = 16;
+	cl::PageTable table(8);
+
+	// x0..x2 have the last slot as home and wrap to 15, 0 and 1; y has
+	// home 0 and lands on 2, z has home 1 and lands on 3
+	std::vector<cl::page_id_t> x = homedAt(slots - 1, slots, 3);
+	cl::page_id_t y = homedAt(0, slots, 1)[0];
+	cl::page_id_t z = homedAt(1, slots, 1)[0];
+	std::vector<cl::page_id_t> all(x);
+	all.push_back(y);
+	all.push_back(z);
+	for (size_t i = 0; i < all.size(); ++i)
+	{
+		table.set(all[i], (cl::LruNode*)(size_t)(all[i] + 1));
+	}
+	for (size_t i = 0; i < all.size(); ++i)
+	{
+		EXPECT_EQ(table.get(all[i]), (cl::LruNode*)(size_t)(all[i] + 1));
+	}
+
+	// deleting the entry in the last slot shifts the rest of the run back
+	// across the end of the array
+	table.del(x[0]);
+	EXPECT_EQ(table.get(x[0]), (cl::LruNode*)NULL);
+	for (size_t i = 1; i < all.size(); ++i)
+	{
+		EXPECT_EQ(table.get(all[i]), (cl::LruNode*)(size_t)(all[i] + 1));
+	}
+
+	// deleting past the wrap keeps the entries homed before it
+	table.del(y);
+	EXPECT_EQ(table.get(y), (cl::LruNode*)NULL);
+	EXPECT_EQ(table.get(x[1]), (cl::LruNode*)(size_t)(x[1] + 1));
+	EXPECT_EQ(table.get(x[2]), (cl::LruNode*)(size_t)(x[2] + 1));
+	EXPECT_EQ(table.get(z), (cl::LruNode*)(size_t)(z + 1));
+
+	table.del(x[1]);
+	table.del(x[2]);
+	EXPECT_EQ(table.get(z), (cl::LruNode*)(size_t)(z + 1));
+	table.del(z);
+	for (size_t i = 0; i < all.size(); ++i)
+	{
+		EXPECT_EQ(table.get(all[i]), (cl::LruNode*)NULL);
+	}
+
+	// an entry in its home slot right after the wrap must not be moved
+	// back into the last slot
+	table.set(x[0], (cl::LruNode*)(size_t)(x[0] + 1));
+	table.set(y, (cl::LruNode*)(size_t)(y + 1));
+	table.del(x[0]);
+	EXPECT_EQ(table.get(x[0]), (cl::LruNode*)NULL);
+	EXPECT_EQ(table.get(y), (cl::LruNode*)(size_t)(y + 1));
+}
+
 class CacheTest: public ::testing::Test {};
 
 TEST_F(CacheTest, Operations) {
@@ -54,7 +243,7 @@ TEST_F(CacheTest, Operations) {
 
 	for (uint32_t i = 0; i <= cache_size; ++i)
 	{
-		cache.put(i, (void*)i);
+		cache.put(i, (void*)(size_t)i);
 	}
 	EXPECT_EQ(cache.get((uint32_t)0), (void*)0);
 	EXPECT_EQ(cache.get((uint32_t)cache_size), (void*)cache_size);
@@ -62,7 +251,7 @@ TEST_F(CacheTest, Operations) {
 	EXPECT_EQ(cache.get((uint32_t)cache_size), (void*)0);
 	for (uint32_t i = 0; i < cache_size; ++i)
 	{
-		EXPECT_EQ(cache.get((uint32_t)i), (void*)i);
+		EXPECT_EQ(cache.get((uint32_t)i), (void*)(size_t)i);
 	}
 }
 
@@ -81,6 +270,193 @@ TEST_F(CacheTest, LRU) {
 	EXPECT_NE(cache.get((uint32_t)5), (void*)0);
 }
 
+class CountingSync: public cl::CacheSynchronizer {
+public:
+	int evicted_;
+	int written_;
+
+	CountingSync(): evicted_(0), written_(0) {}
+
+protected:
+	void syncCache(cl::page_id_t, void*, bool dirty)
+	{
+		++evicted_;
+		if (dirty)
+		{
+			++written_;
+		}
+	}
+	void writeBack(cl::page_id_t, void*)
+	{
+		++written_;
+	}
+};
+
+TEST_F(CacheTest, DirtyWriteBack) {
+	CountingSync sync;
+	char buf[1024];
+	{
+		cl::Cache cache(4);
+		cache.setCacheSync(&sync);
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			cache.put(i, buf);
+			if (i & 1)
+			{
+				cache.markDirty(i);
+			}
+		}
+		EXPECT_EQ(sync.evicted_, 4);
+		EXPECT_EQ(sync.written_, 2);
+	}
+	EXPECT_EQ(sync.evicted_, 8);
+	EXPECT_EQ(sync.written_, 4);
+}
+
+// Blocks the write back of an evicted page until another thread has
+// looked up pages of the same shard, the evicted one included.
+class BlockingSync: public cl::CacheSynchronizer {
+public:
+	cl::Cache* cache_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool looked_up_;
+	bool found_;
+
+	BlockingSync(cl::Cache* cache): cache_(cache), looked_up_(false), found_(false) {}
+
+protected:
+	void syncCache(cl::page_id_t, void*, bool) {}
+	void writeBack(cl::page_id_t page_id, void*)
+	{
+		std::thread reader([this, page_id]() {
+			bool found = cache_->get(page_id) != NULL && cache_->get(page_id + 1) != NULL;
+			std::lock_guard<std::mutex> guard(lock_);
+			looked_up_ = true;
+			found_ = found;
+			cond_.notify_one();
+		});
+		std::unique_lock<std::mutex> guard(lock_);
+		cond_.wait_for(guard, std::chrono::seconds(5), [this]() { return looked_up_; });
+		guard.unlock();
+		reader.join();
+	}
+};
+
+TEST_F(CacheTest, WriteBackOutsideShardLock) {
+	cl::Cache cache(2);
+	BlockingSync sync(&cache);
+	cache.setCacheSync(&sync);
+	char buf[1024];
+	cache.put(1, buf);
+	cache.markDirty(1);
+	cache.put(2, buf);
+	cache.put(3, buf);
+
+	// the lookups finished while page 1 was still being written back
+	std::lock_guard<std::mutex> guard(sync.lock_);
+	EXPECT_TRUE(sync.looked_up_);
+	EXPECT_TRUE(sync.found_);
+	EXPECT_EQ(cache.get((uint32_t)1), (void*)0);
+	EXPECT_EQ(cache.getDirtyCount(), 0u);
+}
+
+TEST_F(CacheTest, Sharded) {
+	EXPECT_EQ(cl::Cache(10, 16).getShardCount(), 8u);
+	EXPECT_EQ(cl::Cache(4, 3).getShardCount(), 2u);
+
+	cl::Cache cache(1024, 8);
+	EXPECT_EQ(cache.getShardCount(), 8u);
+
+	const int threads = 4;
+	const uint32_t per_thread = 100;
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([&cache, t, per_thread]() {
+			for (uint32_t i = t * per_thread; i < (t + 1) * per_thread; ++i)
+			{
+				cache.put(i, (void*)(size_t)(i + 1));
+				cache.markDirty(i);
+			}
+			for (int round = 0; round < 100; ++round)
+			{
+				for (uint32_t i = t * per_thread; i < (t + 1) * per_thread; ++i)
+				{
+					EXPECT_EQ(cache.get(i), (void*)(size_t)(i + 1));
+				}
+			}
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		workers[i].join();
+	}
+	EXPECT_EQ(cache.getDirtyCount(), (size_t)threads * per_thread);
+
+	cl::page_id_t ids[threads * per_thread];
+	void* pages[threads * per_thread];
+	EXPECT_EQ(cache.takeDirty(ids, pages, threads * per_thread, 1024, 0),
+			(size_t)threads * per_thread);
+	EXPECT_EQ(cache.getDirtyCount(), 0u);
+}
+
+TEST_F(CacheTest, Clock) {
+	cl::Cache cache(3, 1, cl::CachePolicy::Clock);
+	char buf[1024];
+	for (uint32_t i = 1; i <= 3; ++i)
+	{
+		cache.put(i, buf);
+	}
+	EXPECT_NE(cache.get((uint32_t)1), (void*)0);
+	cache.put(4, buf);
+	// 1 had its reference bit set, so the hand passes it and takes 2
+	EXPECT_NE(cache.get((uint32_t)1), (void*)0);
+	EXPECT_EQ(cache.get((uint32_t)2), (void*)0);
+	EXPECT_NE(cache.get((uint32_t)3), (void*)0);
+	EXPECT_NE(cache.get((uint32_t)4), (void*)0);
+}
+
+static size_t hotPagesAfterScan(cl::CachePolicy policy)
+{
+	const uint32_t hot = 16;
+	cl::Cache cache(64, 1, policy);
+	char buf[1024];
+	uint32_t cold = 1000;
+	for (int round = 0; round < 20; ++round)
+	{
+		for (uint32_t i = 0; i < hot; ++i)
+		{
+			if (!cache.get(i))
+			{
+				cache.put(i, buf);
+			}
+		}
+		for (int i = 0; i < 8; ++i)
+		{
+			cache.put(cold++, buf);
+		}
+	}
+
+	// one pass over many pages, as a full traverse would do
+	for (int i = 0; i < 1000; ++i)
+	{
+		cache.put(cold++, buf);
+	}
+
+	size_t n = 0;
+	for (uint32_t i = 0; i < hot; ++i)
+	{
+		n += cache.get(i) ? 1 : 0;
+	}
+	return n;
+}
+
+TEST_F(CacheTest, ScanResistance) {
+	EXPECT_EQ(hotPagesAfterScan(cl::CachePolicy::LRU), 0u);
+	EXPECT_EQ(hotPagesAfterScan(cl::CachePolicy::TwoQueue), 16u);
+}
+
 int main(int argc, char *argv[])
 {
 	::testing::InitGoogleTest(&argc, argv);
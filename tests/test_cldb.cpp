@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
+#include <map>
+#include <string>
+#include <vector>
 #include "gtest/gtest.h"
 #include "cldb.h"
+#include "batch.h"
+#include "btree.h"
+#include "storage.h"
 
 class DBTest: public ::testing::Test {};
 
@@ -48,6 +56,264 @@ TEST_F(DBTest, Test) {
 	delete db;
 }
 
+// Orders 4-byte keys by descending value.
+static int32_t reverseInt(const void* a, size_t, const void* b, size_t)
+{
+	int x, y;
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+TEST_F(DBTest, KeyOrder) {
+	const char* filename = ".order.db";
+	const int count = 20000;
+	std::vector<int> keys;
+	for (int i = -count / 2; i < count / 2; ++i)
+	{
+		keys.push_back(i * 3);
+	}
+	std::random_shuffle(keys.begin(), keys.end());
+
+	// native-endian ints in numeric order, negatives first
+	remove(filename);
+	cl::DBConfig config(filename, true);
+	config.key_order_ = cl::KeyOrder::Int32;
+	cl::DB* db = new cl::DB();
+	ASSERT_TRUE(db->open(config));
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		db->put(&keys[i], sizeof(int), &keys[i], sizeof(int));
+	}
+	delete db;
+
+	db = new cl::DB();
+	ASSERT_TRUE(db->open(filename));
+	cl::Cursor* cur = db->newCursor();
+	int start = -300, end = 301;
+	cur->setRange(&start, sizeof(start), &end, sizeof(end));
+	int expect = start;
+	for (cur->seekToFirst(); cur->valid(); cur->next())
+	{
+		int k;
+		memcpy(&k, cur->key(), sizeof(k));
+		ASSERT_EQ(k, expect);
+		expect += 3;
+	}
+	EXPECT_EQ(expect, 303);
+	delete cur;
+	int r;
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		ASSERT_EQ(db->get(&keys[i], sizeof(int), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, keys[i]);
+	}
+	delete db;
+
+	// a custom order has to be supplied again on every open
+	remove(filename);
+	config.comparator_ = reverseInt;
+	db = new cl::DB();
+	ASSERT_TRUE(db->open(config));
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		db->put(&keys[i], sizeof(int), &keys[i], sizeof(int));
+	}
+	delete db;
+
+	db = new cl::DB();
+	EXPECT_FALSE(db->open(filename));
+	delete db;
+	db = new cl::DB();
+	ASSERT_TRUE(db->open(config));
+	cur = db->newCursor();
+	cur->seekToFirst();
+	ASSERT_TRUE(cur->valid());
+	memcpy(&r, cur->key(), sizeof(r));
+	EXPECT_EQ(r, (count / 2 - 1) * 3);
+	delete cur;
+	delete db;
+	remove(filename);
+}
+
+TEST_F(DBTest, KeyHeadsPageLimit) {
+	const char* filename = ".heads.db";
+	const size_t page_size = cl::DBConfig::max_key_heads_page_size * 2;
+	remove(filename);
+
+	// key head slots cannot address pages this large
+	cl::DBConfig config(filename, true, cl::DBType::BTreeDB, page_size, 16);
+	cl::DB* db = new cl::DB();
+	EXPECT_FALSE(db->open(config));
+	delete db;
+	remove(filename);
+
+	config.key_heads_ = false;
+	db = new cl::DB();
+	ASSERT_TRUE(db->open(config));
+	for (int i = 0; i < 1000; ++i)
+	{
+		db->put(&i, sizeof(i), &i, sizeof(i));
+	}
+	delete db;
+
+	db = new cl::DB();
+	ASSERT_TRUE(db->open(filename));
+	int r;
+	for (int i = 0; i < 1000; ++i)
+	{
+		ASSERT_EQ(db->get(&i, sizeof(i), &r, sizeof(r)), sizeof(r));
+		ASSERT_EQ(r, i);
+	}
+	delete db;
+	remove(filename);
+}
+
+TEST_F(DBTest, WriteBatch) {
+	const char* filename = ".batch.db";
+	const int count = 20000;
+	cl::DBType types[] = { cl::DBType::BTreeDB, cl::DBType::HashDB };
+	for (int t = 0; t < 2; ++t)
+	{
+		remove(filename);
+		cl::DBConfig config(filename, true, types[t]);
+		config.durability_ = cl::Durability::SyncCommit;
+		cl::DB* db = new cl::DB();
+		ASSERT_TRUE(db->open(config));
+
+		std::map<int, std::string> expect;
+		for (int i = 0; i < count; i += 3)
+		{
+			db->put(&i, sizeof(i), &i, sizeof(i));
+			expect[i] = std::string((const char*)&i, sizeof(i));
+		}
+
+		// keys in random order, some values too long for their page, and
+		// keys written more than once, the last write winning
+		std::vector<int> keys;
+		for (int i = 0; i < count; ++i)
+		{
+			keys.push_back(i);
+		}
+		std::random_shuffle(keys.begin(), keys.end());
+		cl::WriteBatch batch;
+		for (size_t n = 0; n < keys.size(); ++n)
+		{
+			int i = keys[n];
+			if (i % 3 == 0 && i % 2 == 0)
+			{
+				batch.del(&i, sizeof(i));
+				expect.erase(i);
+				continue;
+			}
+			std::string v(i % 97 == 0 ? 3000 : 12, (char)i);
+			memcpy(&v[0], &i, sizeof(i));
+			batch.put(&i, sizeof(i), v.data(), v.size());
+			if (i % 5 == 0)
+			{
+				batch.del(&i, sizeof(i));
+			}
+			if (i % 7 == 0)
+			{
+				batch.put(&i, sizeof(i), &i, sizeof(i));
+				v = std::string((const char*)&i, sizeof(i));
+			}
+			if (i % 5 == 0 && i % 7 != 0)
+			{
+				expect.erase(i);
+			}
+			else
+			{
+				expect[i] = v;
+			}
+		}
+		db->write(&batch);
+		delete db;
+
+		db = new cl::DB();
+		ASSERT_TRUE(db->open(filename));
+		char buf[4096];
+		for (int i = 0; i < count; ++i)
+		{
+			size_t l = db->get(&i, sizeof(i), buf, sizeof(buf));
+			std::map<int, std::string>::iterator it = expect.find(i);
+			if (it == expect.end())
+			{
+				ASSERT_EQ(l, 0u);
+			}
+			else
+			{
+				ASSERT_EQ(std::string(buf, l), it->second);
+			}
+		}
+		delete db;
+	}
+	remove(filename);
+}
+
+TEST_F(DBTest, MultiGet) {
+	const char* filename = ".multiget.db";
+	const int count = 20000;
+	const size_t batch = 300;
+	cl::DBType types[] = { cl::DBType::BTreeDB, cl::DBType::HashDB };
+	for (int t = 0; t < 2; ++t)
+	{
+		remove(filename);
+		cl::DBConfig config(filename, true, types[t]);
+		cl::DB* db = new cl::DB();
+		ASSERT_TRUE(db->open(config));
+
+		std::map<int, std::string> expect;
+		for (int i = 0; i < count; i += 2)
+		{
+			std::string v(i % 101 == 0 ? 3000 : 16, (char)i);
+			memcpy(&v[0], &i, sizeof(i));
+			db->put(&i, sizeof(i), v.data(), v.size());
+			expect[i] = v;
+		}
+
+		// keys in random order, half of them absent, some asked twice
+		std::vector<int> keys;
+		for (int i = 0; i < count; ++i)
+		{
+			keys.push_back(i);
+			if (i % 13 == 0)
+			{
+				keys.push_back(i);
+			}
+		}
+		std::random_shuffle(keys.begin(), keys.end());
+
+		const void* kp[batch];
+		size_t ks[batch];
+		cl::Buffer* vals = new cl::Buffer[batch];
+		bool found[batch];
+		for (size_t from = 0; from < keys.size(); from += batch)
+		{
+			size_t n = std::min(batch, keys.size() - from);
+			for (size_t i = 0; i < n; ++i)
+			{
+				kp[i] = &keys[from+i];
+				ks[i] = sizeof(int);
+			}
+			db->multiGet(n, kp, ks, vals, found);
+			for (size_t i = 0; i < n; ++i)
+			{
+				std::map<int, std::string>::iterator it = expect.find(keys[from+i]);
+				ASSERT_EQ(found[i], it != expect.end());
+				if (found[i])
+				{
+					ASSERT_EQ(std::string((const char*)vals[i].getBuffer(), vals[i].getSize()),
+							it->second);
+				}
+			}
+		}
+		delete [] vals;
+		delete db;
+	}
+	remove(filename);
+}
+
 int main(int argc, char *argv[])
 {
 	::testing::InitGoogleTest(&argc, argv);
@@ -1,3 +1,5 @@
+#include <thread>
+#include <vector>
 #include "gtest/gtest.h"
 #include "file.h"
 
@@ -36,6 +38,63 @@ TEST_F(FileTest, ReadWrite) {
 	delete fp;
 }
 
+TEST_F(FileTest, Positional) {
+	const char* filename = "fileop_pos.test";
+	cl::File f(filename);
+	EXPECT_EQ(f.create(), true);
+
+	const size_t page = 4096;
+	const int count = 8;
+	std::vector<std::thread> workers;
+	for (int t = 0; t < count; ++t)
+	{
+		workers.push_back(std::thread([&f, t, page]() {
+			char buf[page];
+			memset(buf, 'a' + t, page);
+			f.write((cl::offset_t)((count - 1 - t) * page), buf, page);
+		}));
+	}
+	for (auto& w : workers)
+	{
+		w.join();
+	}
+
+	char buf[page];
+	for (int t = 0; t < count; ++t)
+	{
+		EXPECT_EQ(page, f.read((cl::offset_t)((count - 1 - t) * page), buf, page));
+		EXPECT_EQ(buf[0], 'a' + t);
+		EXPECT_EQ(buf[page-1], 'a' + t);
+	}
+	EXPECT_EQ(0u, f.read((cl::offset_t)(count * page), buf, page));
+	EXPECT_EQ(f.sync(), true);
+	EXPECT_EQ(f.close(), true);
+	EXPECT_EQ(f.remove(), true);
+}
+
+TEST_F(FileTest, ReadPage) {
+	const char* filename = "fileop_page.test";
+	cl::File f(filename);
+	EXPECT_EQ(f.create(), true);
+
+	const size_t page = 512;
+	char buf[page];
+	memset(buf, 'x', page);
+	EXPECT_EQ(page / 2, f.write(0, buf, page / 2));
+
+	// the part past the end of the file reads as zeros
+	memset(buf, 'y', page);
+	EXPECT_EQ(f.readPage(0, buf, page), true);
+	EXPECT_EQ(buf[page / 2 - 1], 'x');
+	EXPECT_EQ(buf[page / 2], 0);
+	EXPECT_EQ(buf[page - 1], 0);
+	EXPECT_EQ(f.close(), true);
+
+	// but a failed read is not passed off as an empty page
+	EXPECT_EQ(f.readPage(0, buf, page), false);
+	EXPECT_EQ(f.remove(), true);
+}
+
 int main(int argc, char *argv[])
 {
 	::testing::InitGoogleTest(&argc, argv);
@@ -1,6 +1,10 @@
 #include <cstring>
+#include <vector>
+#include <chrono>
+#include <thread>
 #include "gtest/gtest.h"
 #include "storage.h"
+#include "file.h"
 
 class StorageTest: public ::testing::Test {};
 
@@ -38,6 +42,225 @@ TEST_F(StorageTest, Test) {
 	delete store;
 }
 
+TEST_F(StorageTest, FreePages) {
+	const char* filename = ".free.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+
+	cl::page_id_t a = store->getNewPage();
+	cl::page_id_t b = store->getNewPage();
+	cl::page_id_t c = store->getNewPage();
+	memset(store->getPageForWrite(b), 0xff, config.page_size_);
+	store->freePage(b);
+	store->freePage(a);
+	delete store;
+
+	store = new cl::Storage(filename);
+	EXPECT_EQ(store->getNewPage(), a);
+	EXPECT_EQ(store->getNewPage(), b);
+	EXPECT_EQ(((char*)store->getPage(b))[config.page_size_-1], 0);
+	EXPECT_EQ(store->getNewPage(), c+1);
+	EXPECT_EQ(store->getMaxPageId(), c+1);
+	delete store;
+	remove(filename);
+}
+
+// layout of version 1 headers, kept here to fabricate an old file
+struct LegacyHeader {
+	uint32_t magic_;
+	cl::DBType type_;
+	size_t page_size_;
+	size_t cache_size_;
+	cl::page_id_t max_page_id_;
+	cl::page_id_t overflow_page_;
+	cl::offset_t overflow_offset_;
+	cl::page_id_t free_pages_;
+	size_t min_items_;
+	uint32_t factor_;
+	cl::page_id_t root_id_;
+};
+
+TEST_F(StorageTest, UpgradeLegacyFile) {
+	const char* filename = ".legacy.db";
+	const size_t page_size = 4096;
+	const cl::page_id_t pages = 3;
+
+	FILE* fp = fopen(filename, "w+b");
+	ASSERT_NE(fp, (FILE*)NULL);
+	LegacyHeader old;
+	memset(&old, 0, sizeof(old));
+	old.magic_ = cl::DB_MAGIC;
+	old.type_ = cl::DBType::BTreeDB;
+	old.page_size_ = page_size;
+	old.cache_size_ = 16;
+	old.max_page_id_ = pages;
+	old.min_items_ = 4;
+	old.root_id_ = 2;
+	fwrite(&old, sizeof(old), 1, fp);
+	char page[page_size];
+	for (cl::page_id_t i = 1; i <= pages; ++i)
+	{
+		memset(page, 'a' + i, page_size);
+		fwrite(page, page_size, 1, fp);
+	}
+	fclose(fp);
+
+	cl::Storage* store = new cl::Storage(filename);
+	ASSERT_TRUE(store->valid());
+	EXPECT_EQ(store->getRootId(), (cl::page_id_t)2);
+	for (cl::page_id_t i = 1; i <= pages; ++i)
+	{
+		char* p = (char*)store->getPage(i);
+		EXPECT_EQ(p[0], 'a' + (int)i);
+		EXPECT_EQ(p[page_size-1], 'a' + (int)i);
+	}
+	delete store;
+
+	cl::DBHeader meta;
+	fp = fopen(filename, "rb");
+	ASSERT_EQ(fread(&meta, sizeof(meta), 1, fp), 1u);
+	fclose(fp);
+	EXPECT_EQ(meta.magic_, cl::DB_MAGIC);
+	EXPECT_EQ(meta.version_, cl::DB_VERSION);
+	EXPECT_EQ(meta.max_page_id_, pages);
+	remove(filename);
+}
+
+TEST_F(StorageTest, LargeOffsets) {
+	const char* filename = ".large.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+
+	// a page id whose offset does not fit in 32 bits
+	cl::page_id_t target = (cl::page_id_t)((5ull << 30) / config.page_size_);
+	cl::page_id_t pid = 0;
+	while (pid < target)
+	{
+		pid = store->getNewPage();
+	}
+	char* page = (char*)store->getPageForWrite(pid);
+	memcpy(page, "far away", 9);
+	page = (char*)store->getPageForWrite(1);
+	memcpy(page, "near", 5);
+	delete store;
+
+	store = new cl::Storage(filename);
+	EXPECT_EQ(0, memcmp(store->getPage(pid), "far away", 9));
+	EXPECT_EQ(0, memcmp(store->getPage(1), "near", 5));
+	delete store;
+	remove(filename);
+}
+
+TEST_F(StorageTest, CleanPagesNotWritten) {
+	const char* filename = ".clean.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+
+	cl::page_id_t pid = store->getNewPage();
+	memcpy(store->getPageForWrite(pid), "dirty", 6);
+	// scribble on a page fetched read-only; it must not reach the disk
+	cl::page_id_t other = store->getNewPage();
+	memcpy(store->getPage(other), "clean", 6);
+	delete store;
+
+	store = new cl::Storage(filename);
+	EXPECT_EQ(0, memcmp(store->getPage(pid), "dirty", 6));
+	EXPECT_NE(0, memcmp(store->getPage(other), "clean", 6));
+	delete store;
+	remove(filename);
+}
+
+TEST_F(StorageTest, BackgroundFlush) {
+	const char* filename = ".flush.db";
+	cl::DBConfig config(filename);
+	cl::Storage* store = new cl::Storage(config);
+	store->startFlusher(5, 10);
+
+	const cl::page_id_t count = 200;
+	store->lock();
+	for (cl::page_id_t i = 0; i < count; ++i)
+	{
+		cl::page_id_t pid = store->getNewPage();
+		memset(store->getPageForWrite(pid), (int)pid, config.page_size_);
+	}
+	store->unlock();
+
+	size_t max_dirty = config.cache_size_ * 10 / 100;
+	for (int i = 0; i < 200 && store->getDirtyCount() > max_dirty; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	EXPECT_LE(store->getDirtyCount(), max_dirty);
+
+	// the coldest pages reached the file while the store is still open
+	cl::File f(filename);
+	ASSERT_TRUE(f.open());
+	char buf[4096];
+	EXPECT_EQ(sizeof(buf), f.read(1 * config.page_size_, buf, sizeof(buf)));
+	EXPECT_EQ(buf[0], 1);
+	EXPECT_EQ(buf[sizeof(buf)-1], 1);
+	f.close();
+
+	delete store;
+
+	store = new cl::Storage(filename);
+	for (cl::page_id_t i = 1; i <= count; ++i)
+	{
+		char* p = (char*)store->getPage(i);
+		EXPECT_EQ(p[0], (char)i);
+		EXPECT_EQ(p[config.page_size_-1], (char)i);
+	}
+	delete store;
+	remove(filename);
+}
+
+TEST_F(StorageTest, PinnedPagesStayCached) {
+	const char* filename = ".pin.db";
+	cl::DBConfig config(filename);
+	config.cache_size_ = 4;
+	cl::Storage* store = new cl::Storage(config);
+
+	const cl::page_id_t count = 32;
+	for (cl::page_id_t i = 1; i <= count; ++i)
+	{
+		EXPECT_EQ(store->getNewPage(), i);
+		*(cl::page_id_t*)store->getPageForWrite(i) = i;
+	}
+
+	cl::PageHandle first(store, 1);
+	ASSERT_TRUE(first.valid());
+	for (cl::page_id_t i = 2; i <= count; ++i)
+	{
+		store->lock();
+		EXPECT_EQ(*(cl::page_id_t*)store->getPage(i), i);
+		store->unlock();
+	}
+	EXPECT_EQ(*(cl::page_id_t*)first.get(), (cl::page_id_t)1);
+
+	// more pins than frames: the cache grows instead of evicting any
+	std::vector<cl::PageHandle> handles;
+	for (cl::page_id_t i = 2; i <= 12; ++i)
+	{
+		handles.push_back(cl::PageHandle(store, i));
+		*(cl::page_id_t*)handles.back().getForWrite() += 100;
+	}
+	for (size_t i = 0; i < handles.size(); ++i)
+	{
+		EXPECT_EQ(*(cl::page_id_t*)handles[i].get(), handles[i].getPageId() + 100);
+	}
+	handles.clear();
+	first.reset();
+	delete store;
+
+	store = new cl::Storage(filename);
+	for (cl::page_id_t i = 1; i <= count; ++i)
+	{
+		cl::PageHandle h(store, i);
+		EXPECT_EQ(*(cl::page_id_t*)h.get(), (i >= 2 && i <= 12) ? i + 100 : i);
+	}
+	delete store;
+}
+
 int main(int argc, char *argv[])
 {
 	::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,228 @@
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "cldb.h"
+#include "file.h"
+#include "wal.h"
+
+class WalTest: public ::testing::Test {};
+
+class CountingApplier: public cl::LogApplier {
+public:
+	size_t metas_;
+	size_t pages_;
+	cl::page_id_t last_page_;
+	CountingApplier(): metas_(0), pages_(0), last_page_(0) {}
+
+protected:
+	void applyMeta(const cl::DBHeader&) { ++metas_; }
+	void applyPage(cl::page_id_t page_id, const void*, size_t)
+	{
+		++pages_;
+		last_page_ = page_id;
+	}
+};
+
+static void copyFile(const char* from, const char* to)
+{
+	std::ifstream in(from, std::ios::binary);
+	std::ofstream out(to, std::ios::binary | std::ios::trunc);
+	out << in.rdbuf();
+}
+
+TEST_F(WalTest, ReplayStopsAtTornRecord) {
+	const char* filename = ".tmp.wal";
+	const size_t page_size = 64;
+	cl::WriteAheadLog* wal = new cl::WriteAheadLog(filename, cl::Durability::SyncCommit, 0);
+	ASSERT_TRUE(wal->open());
+
+	cl::DBHeader meta;
+	memset(&meta, 0, sizeof(meta));
+	char page[page_size];
+	void* pages[1] = { page };
+	for (cl::page_id_t pid = 1; pid <= 3; ++pid)
+	{
+		memset(page, pid, page_size);
+		wal->commit(wal->append(meta, &pid, pages, 1, page_size));
+	}
+	cl::file_offset_t size = wal->getSize();
+	delete wal;
+
+	CountingApplier all;
+	EXPECT_TRUE(cl::WriteAheadLog::replay(filename, &all, page_size));
+	EXPECT_EQ(all.metas_, 3u);
+	EXPECT_EQ(all.pages_, 3u);
+	EXPECT_EQ(all.last_page_, (cl::page_id_t)3);
+
+	// chop the last record in half, as a crash during its write would
+	cl::File f(filename);
+	ASSERT_TRUE(f.open());
+	ASSERT_TRUE(f.truncate(size - page_size / 2));
+	f.close();
+
+	CountingApplier torn;
+	EXPECT_TRUE(cl::WriteAheadLog::replay(filename, &torn, page_size));
+	EXPECT_EQ(torn.pages_, 2u);
+	EXPECT_EQ(torn.last_page_, (cl::page_id_t)2);
+	f.remove();
+}
+
+TEST_F(WalTest, ReplayRejectsBadSizes) {
+	const char* filename = ".sizes.wal";
+	const size_t page_size = 64;
+	cl::WriteAheadLog* wal = new cl::WriteAheadLog(filename, cl::Durability::SyncCommit, 0);
+	ASSERT_TRUE(wal->open());
+
+	cl::DBHeader meta;
+	memset(&meta, 0, sizeof(meta));
+	char page[page_size];
+	memset(page, 1, page_size);
+	void* pages[1] = { page };
+	cl::page_id_t pid = 1;
+	wal->commit(wal->append(meta, &pid, pages, 1, page_size));
+	cl::file_offset_t size = wal->getSize();
+	delete wal;
+
+	// a log written for another page size is not replayed at all
+	CountingApplier other;
+	EXPECT_FALSE(cl::WriteAheadLog::replay(filename, &other, page_size * 2));
+	EXPECT_EQ(other.metas_, 0u);
+
+	// a record claiming far more pages than the log holds stops replay
+	// before anything is read or allocated for it
+	cl::File f(filename);
+	ASSERT_TRUE(f.open());
+	cl::LogRecordHeader header;
+	ASSERT_EQ(f.read(0, &header, sizeof(header)), sizeof(header));
+	header.lsn_ += 1;
+	header.page_count_ = 0xffffffff;
+	ASSERT_EQ(f.write(size, &header, sizeof(header)), sizeof(header));
+	f.close();
+
+	CountingApplier applier;
+	EXPECT_TRUE(cl::WriteAheadLog::replay(filename, &applier, page_size));
+	EXPECT_EQ(applier.metas_, 1u);
+	EXPECT_EQ(applier.pages_, 1u);
+	f.remove();
+}
+
+TEST_F(WalTest, FailedWriteIsNotDurable) {
+	// every write to /dev/full fails with ENOSPC
+	const size_t page_size = 64;
+	cl::WriteAheadLog wal("/dev/full", cl::Durability::SyncCommit, 0);
+	if (!wal.open())
+	{
+		return;
+	}
+
+	cl::DBHeader meta;
+	memset(&meta, 0, sizeof(meta));
+	char page[page_size];
+	memset(page, 1, page_size);
+	void* pages[1] = { page };
+	cl::page_id_t pid = 1;
+	EXPECT_FALSE(wal.commit(wal.append(meta, &pid, pages, 1, page_size)));
+	EXPECT_FALSE(wal.sync(wal.getLastLsn()));
+	EXPECT_FALSE(wal.commit(wal.append(meta, &pid, pages, 1, page_size)));
+}
+
+TEST_F(WalTest, GroupCommit) {
+	const char* filename = ".group.wal";
+	const size_t page_size = 64;
+	const int threads = 8;
+	const int per_thread = 200;
+	cl::WriteAheadLog* wal = new cl::WriteAheadLog(filename, cl::Durability::GroupCommit, 500);
+	ASSERT_TRUE(wal->open());
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([wal, t, page_size]() {
+			cl::DBHeader meta;
+			memset(&meta, 0, sizeof(meta));
+			char page[page_size];
+			memset(page, t, page_size);
+			void* pages[1] = { page };
+			cl::page_id_t pid = t + 1;
+			for (int i = 0; i < per_thread; ++i)
+			{
+				wal->commit(wal->append(meta, &pid, pages, 1, page_size));
+			}
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		workers[i].join();
+	}
+
+	// committers arriving within one window share its fsync
+	EXPECT_LT(wal->getSyncCount(), (uint64_t)threads * per_thread);
+	delete wal;
+
+	CountingApplier applier;
+	cl::WriteAheadLog::replay(filename, &applier, page_size);
+	EXPECT_EQ(applier.pages_, (size_t)threads * per_thread);
+	cl::File(filename).remove();
+}
+
+TEST_F(WalTest, RecoverAfterCrash) {
+	const char* filename = ".wal.db";
+	const char* crashed = ".crashed.db";
+	const int count = 20000;
+	std::string log(filename);
+	log += "-wal";
+	std::string crashed_log(crashed);
+	crashed_log += "-wal";
+	cl::File(filename).remove();
+
+	cl::DBConfig config(filename, true);
+	config.durability_ = cl::Durability::SyncCommit;
+	cl::DB* db = new cl::DB();
+	ASSERT_TRUE(db->open(config));
+
+	for (int i = 0; i < count; ++i)
+	{
+		db->put(&i, sizeof(i), &i, sizeof(i));
+	}
+	for (int i = 0; i < count; i += 2)
+	{
+		db->del(&i, sizeof(i));
+	}
+
+	// snapshot both files while the database is still open: the data file
+	// lags behind and only the log knows about the latest operations
+	copyFile(filename, crashed);
+	copyFile(log.c_str(), crashed_log.c_str());
+	delete db;
+
+	db = new cl::DB();
+	ASSERT_TRUE(db->open(crashed));
+	int r;
+	size_t l;
+	for (int i = 0; i < count; ++i)
+	{
+		l = db->get(&i, sizeof(i), &r, sizeof(r));
+		if (i & 0x1)
+		{
+			EXPECT_EQ(l, sizeof(i));
+			EXPECT_EQ(r, i);
+		}
+		else
+		{
+			EXPECT_EQ(l, 0u);
+		}
+	}
+	delete db;
+
+	EXPECT_FALSE(cl::File(crashed_log.c_str()).exist());
+	EXPECT_FALSE(cl::File(log.c_str()).exist());
+}
+
+int main(int argc, char *argv[])
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}